@@ -70,11 +70,17 @@ fi
 # rm -rf "$BUILD_DIR" "$TARGET_DIR"
 mkdir -p "$BUILD_DIR" "$TARGET_DIR"
 
+# --overlay encodes with libx264 when x264 is installed in the target, mpeg4 is always there
+X264_FLAGS=""
+if pkg-config --exists x264; then
+  X264_FLAGS="--enable-libx264 --enable-encoder=libx264"
+fi
+
 # FFMpeg
 echo "*** Building FFmpeg 4.0 ***"
 cd $BUILD_DIR/ffmpeg
 
 # add "--prefix=${OUTPUT_DIR:-$TARGET_DIR}" to /make custom install to "target folder"
-CFLAGS="-I$TARGET_DIR/include" LDFLAGS="-L$TARGET_DIR/lib -lm" ./configure --prefix=${OUTPUT_DIR:-$TARGET_DIR} --extra-version=shared --disable-debug --enable-shared --disable-static --extra-cflags=--shared --disable-ffplay --disable-doc --enable-gpl --enable-pthreads --enable-pic --enable-postproc --enable-gray --enable-runtime-cpudetect --enable-nonfree --enable-version3 --disable-devices --disable-swresample --disable-swscale --disable-encoders --disable-filters --disable-hwaccels --disable-decoders --enable-decoder=h264 --disable-demuxers --enable-demuxer=h264 --enable-demuxer=rtp --enable-demuxer=rtsp --enable-demuxer=avi --enable-demuxer=mpegts --enable-demuxer=aac --enable-demuxer=mp3 --disable-muxers --enable-muxer=matroska --enable-muxer=mp4 --enable-muxer=avi --enable-muxer=mpeg2video --enable-muxer=mpegts --enable-muxer=rtp --enable-muxer=rtsp --disable-bzlib --disable-zlib
+CFLAGS="-I$TARGET_DIR/include" LDFLAGS="-L$TARGET_DIR/lib -lm" ./configure --prefix=${OUTPUT_DIR:-$TARGET_DIR} --extra-version=shared --disable-debug --enable-shared --disable-static --extra-cflags=--shared --disable-ffplay --disable-doc --enable-gpl --enable-pthreads --enable-pic --enable-postproc --enable-gray --enable-runtime-cpudetect --enable-nonfree --enable-version3 --disable-devices --disable-swresample --disable-swscale --disable-encoders --enable-encoder=mpeg4 --enable-encoder=ffv1 $X264_FLAGS --disable-filters --disable-hwaccels --disable-decoders --enable-decoder=h264 --disable-demuxers --enable-demuxer=h264 --enable-demuxer=rtp --enable-demuxer=rtsp --enable-demuxer=avi --enable-demuxer=mpegts --enable-demuxer=aac --enable-demuxer=mp3 --disable-muxers --enable-muxer=matroska --enable-muxer=mp4 --enable-muxer=avi --enable-muxer=mpeg2video --enable-muxer=mpegts --enable-muxer=rtp --enable-muxer=rtsp --disable-bzlib --disable-zlib
 
 make -j2 && make install
@@ -1,4 +1,6 @@
 #include <unistd.h>
+#include <getopt.h>
+#include <algorithm>
 #include <chrono>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -13,8 +15,6 @@
 
 MoveDetector::MoveDetector()
 {
-    int i, j;
-
     nSectors = 0;
     nSectorsX = 0;
     nSectorsY = 0;
@@ -33,14 +33,35 @@ MoveDetector::MoveDetector()
     sum = 0;
 
     packet_skip = PACKET_SKIP;
+    analysisStride = ANALYSIS_STRIDE;
     useSquareElement = USE_SQUARE;
     binThreshold = BIN_THRESHOLD;
 
+    logFile = stderr;
     fvideo_desc = NULL;
     fvideomask_desc = NULL;
     movemask_file_flag = 0;
+    maskFormat = MASK_FORMAT_Y4M;
+    maskCodec = MASK_CODEC;
+    maskVideo = NULL;
     amplify_yuv = 255;
     movemask_std_flag = 0;
+    outputPolicy = OutputQueue::DROP_MASKS;
+    outputQueueBytes = (size_t)OUTPUT_QUEUE_MB << 20;
+    maskStreamBuffer = NULL;
+    maskStreamSize = 0;
+    reportStream = NULL;
+    reportStreamBuffer = NULL;
+    reportStreamSize = 0;
+    resultRingSlots = SHM_SLOTS;
+    resultRingFailed = false;
+    resultRingFrames = 0;
+    resultRingSkipped = 0;
+    eventFormat = EVENT_FORMAT_BINARY;
+    eventFile = NULL;
+    eventHeaderWritten = false;
+    eventFrames = 0;
+    eventBytes = 0;
     perfTest = false;
 
     output_width = 0;
@@ -51,6 +72,57 @@ MoveDetector::MoveDetector()
     beta = 4.0f;
     sizeThreshold = 0;
 
+    maxAreas = MAX_AREAS;
+    maxTrackers = MAX_TRACKERS;
+    maxFgFraction = MAX_FG_PERCENT / 100.0f;
+    globalMotionCompensation = false;
+
+    cpuBudget = 0;
+    frameInterval = 40000.0;
+    usePyramid = false;
+    workerThreads = WORKER_THREADS;
+    frameParallel = false;
+    ringSize = AREABUFFER_SIZE;
+    pyramidFactor = 1;
+    rangeStart = 0;
+    rangeEnd = INT64_MAX;
+    segments = 1;
+    segmentIndex = -1;
+    triage = false;
+    triageSample = false;
+    triageCheck = false;
+    recordDetections = false;
+    playlistIndex = 0;
+    inputFrameOffset = 0;
+    inputSwitched = false;
+    useMmap = false;
+    ioBench = false;
+    mmapIO = NULL;
+    cachedParams = NULL;
+    clipPreRoll = CLIP_PRE_ROLL;
+    clipPostRoll = CLIP_POST_ROLL;
+    clipList = NULL;
+    clipCtx = NULL;
+    overlayCodec = OVERLAY_CODEC;
+    overlayPreset = OVERLAY_PRESET;
+    overlayCtx = NULL;
+    overlayEnc = NULL;
+    overlayFailed = false;
+    overlayCount = 0;
+    overlaySkipped = 0;
+    cachedFrameRate = AVRational{0, 1};
+    checkpointInterval = CHECKPOINT_INTERVAL;
+    resume = false;
+    watchWorkers = WATCH_WORKERS;
+    ingestThreads = INGEST_THREADS;
+    ingestQueue = INGEST_QUEUE;
+    ingestCodec = "h264";
+    follow = false;
+    followIdle = FOLLOW_IDLE_SECONDS;
+    followSource = {-1, -1, FOLLOW_IDLE_SECONDS, false};
+    followIO = NULL;
+    ResetStreamState();
+
     // ffmpeg
     fmt_ctx = NULL;
     dec_ctx = NULL;
@@ -68,7 +140,72 @@ MoveDetector::MoveDetector()
 }
 
 MoveDetector::~MoveDetector()
-{  }
+{
+    if (reportStream)
+        fclose(reportStream);
+    free(reportStreamBuffer);
+}
+
+//analysis options only: files, ranges and the decoder state stay with each detector
+void MoveDetector::CopySettings(const MoveDetector &other)
+{
+    nSectors = other.nSectors;
+    packet_skip = other.packet_skip;
+    analysisStride = other.analysisStride;
+    useSquareElement = other.useSquareElement;
+    binThreshold = other.binThreshold;
+    movemask_std_flag = other.movemask_std_flag;
+    alpha = other.alpha;
+    beta = other.beta;
+    sizeThreshold = other.sizeThreshold;
+    maxAreas = other.maxAreas;
+    maxTrackers = other.maxTrackers;
+    maxFgFraction = other.maxFgFraction;
+    globalMotionCompensation = other.globalMotionCompensation;
+    cpuBudget = other.cpuBudget;
+    usePyramid = other.usePyramid;
+    workerThreads = other.workerThreads;
+    frameParallel = other.frameParallel;
+    recordDetections = other.recordDetections;
+    useMmap = other.useMmap;
+    streamCache = other.streamCache;
+    clipDir = other.clipDir;
+    clipPreRoll = other.clipPreRoll;
+    clipPostRoll = other.clipPostRoll;
+    maskFormat = other.maskFormat;
+    maskCodec = other.maskCodec;
+}
+
+//what one recording leaves behind, so that the next one starts from scratch on the same buffers
+void MoveDetector::ResetStreamState()
+{
+    trackedObjects.clear();
+    headTrackers.clear();
+    tailTrackers.clear();
+    detectedFrames.clear();
+    degradation = {};
+
+    governorLevel = GOVERNOR_LEVEL_FULL;
+    governorLoad = 0.0f;
+    governorOverCount = 0;
+    governorUnderCount = 0;
+    governorChanges = 0;
+    governorHoldUp = GOVERNOR_HOLD_UP;
+    governorLevelAge = 0;
+    governorSteppedUp = false;
+    for (int i = 0; i < GOVERNOR_LEVELS; i++)
+        governorLevelFrames[i] = 0;
+    gridPooling = 1;
+
+    pyramidFrames = 0;
+    pyramidCells = 0.0;
+    processedFrames = 0;
+    warmUpFrames = 0;
+    reportedFrames = 0;
+    lastReportedFrame = -1;
+    lastMotionFrame = -1;
+    last_pts = AV_NOPTS_VALUE;
+}
 
 void MoveDetector::AllocBuffers(void)
 {
@@ -108,10 +245,68 @@ void MoveDetector::AllocAnalyzeBuffers()
     {
         mbPerSectorX = 1;
         mbPerSectorY = 1;
-        nSectorsX = nBlocksX * 4;
-        nSectorsY = nBlocksY * 4;
-        output_block_size = 4;
+        nSectorsX = nBlocksX * 4 / gridPooling;
+        nSectorsY = nBlocksY * 4 / gridPooling;
+        output_block_size = 4 * gridPooling;
+    }
+    pyramidFactor = PYRAMID_BLOCK_SIZE / output_block_size;
+
+    //a batch of frames analysed in parallel needs its own slots plus the two before it
+    const int jobs = frameParallel ? workerThreads : 1;
+    ringSize = jobs + AREABUFFER_SIZE - 1;
+    areaGridMarked.resize(ringSize);
+    mvGridCoords.resize(ringSize);
+    subMbTypes.resize(ringSize);
+    mvCoarseCoords.resize(ringSize);
+    globalMotionFrame.resize(ringSize, false);
+    truncatedFrame.resize(ringSize, false);
+    globalMotion.resize(ringSize, globalMotionModel());
+    mvFrameScale.resize(ringSize, 1.0f);
+    slotFrameNumber.resize(ringSize, 0);
+    workspaces.resize(jobs);
+
+    //grids are sized for the unpooled scan, pooled levels use their top-left part
+    const int gridRows = nSectors < 0 ? nBlocksY * 4 : nSectorsY;
+    const int gridCols = nSectors < 0 ? nBlocksX * 4 : nSectorsX;
+    for (int i = 0; i < ringSize; i++)
+    {
+        areaGridMarked[i].Resize(gridRows, gridCols);
+        mvGridCoords[i].Resize(gridRows, gridCols);
+        subMbTypes[i].Resize(gridRows, gridCols);
+        mvCoarseCoords[i].Resize(nBlocksY, nBlocksX);
+    }
+    areaBuffer.Resize(ringSize, MAX_CONNAREAS);
+    maskFrameY.Resize(gridRows, gridCols);
+    maskFrameU.Resize(gridRows, gridCols);
+    maskFrameV.Resize(gridRows, gridCols);
+
+    for (auto &ws : workspaces)
+    {
+        ws.mvGridArg.Resize(gridRows, gridCols);
+        ws.mvGridMag.Resize(gridRows, gridCols);
+        ws.bwProjected.Resize(gridRows, gridCols);
+        ws.fwProjected.Resize(gridRows, gridCols);
+        ws.similarityBW.Resize(gridRows, gridCols);
+        ws.similarityFW.Resize(gridRows, gridCols);
+        ws.similarityBWFW.Resize(gridRows, gridCols);
+        ws.areaFgMarked.Resize(gridRows, gridCols);
+        ws.mvMask.Resize(gridRows, gridCols);
+        ws.mvMaskTemp.Resize(gridRows, gridCols);
+        ws.markedTemp.Resize(gridRows, gridCols);
+        ws.holeLabels.Resize(gridRows, gridCols);
+
+        ws.coarseGridArg.Resize(nBlocksY, nBlocksX);
+        ws.coarseGridMag.Resize(nBlocksY, nBlocksX);
+        ws.coarseBwProjected.Resize(nBlocksY, nBlocksX);
+        ws.coarseFwProjected.Resize(nBlocksY, nBlocksX);
+        ws.coarseSimilarityBW.Resize(nBlocksY, nBlocksX);
+        ws.coarseSimilarityFW.Resize(nBlocksY, nBlocksX);
+        ws.coarseSimilarityBWFW.Resize(nBlocksY, nBlocksX);
+        ws.coarseFgMarked.Resize(nBlocksY, nBlocksX);
     }
+
+    if (workerThreads > 1 && !workers)
+        workers.reset(new ThreadPool(workerThreads));
     output_width = nSectorsX * mbPerSectorX * output_block_size;
     output_height = nSectorsY * mbPerSectorY * output_block_size;
     if (perfTest)
@@ -128,16 +323,9 @@ void MoveDetector::AllocAnalyzeBuffers()
 
 void MoveDetector::PrepareFrameBuffers()
 {
-    int i, j;
-    for (i = 0; i < MAX_MAP_SIDE; ++i)
-        for (j = 0; j < MAX_MAP_SIDE; ++j)
-        {
-            // mvGridSum[i][j] = 0;
-            // mvGridMag[i][j] = 0;
-            // mvGridArg[i][j] = 0;
-            mvGridCoords[currFrameBuffer][i][j] = {};
-            subMbTypes[currFrameBuffer][i][j] = 0;
-        }
+    int i;
+    mvGridCoords[currFrameBuffer].Clear();
+    subMbTypes[currFrameBuffer].Clear();
     for (i = 0; i < MAX_CONNAREAS; i++)
     {
         areaBuffer[currFrameBuffer][i] = {};
@@ -288,15 +476,13 @@ void MoveDetector::PrepareFrameBuffers()
     // }
 
     MotionFieldProcessing();
-    currFrameBuffer = (currFrameBuffer + 1) % AREABUFFER_SIZE;
+    currFrameBuffer = (currFrameBuffer + 1) % ringSize;
 } */
 
 void MoveDetector::MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx)
 {
     int i;
-    int mb_x, mb_y;
     int subBlockY, subBlockX;
-    const int subBlocksY = nSectorsY, subBlocksX = nSectorsX;
     int mv_x, mv_y;
 
     AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
@@ -305,7 +491,6 @@ void MoveDetector::MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx)
     const AVMotionVector *mvs = (const AVMotionVector *)sd->data;
     int mvsCount = sd->size / sizeof(*mvs);
 
-    const int is_iframe = frame->pict_type == AV_PICTURE_TYPE_I;
     const int is_pframe = frame->pict_type == AV_PICTURE_TYPE_P;
     const int is_bframe = frame->pict_type == AV_PICTURE_TYPE_B;
 
@@ -330,6 +515,7 @@ void MoveDetector::MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx)
                 for (i = 0; i < 16; i++)
                 {
                     mvGridCoords[currFrameBuffer][subBlockY + (i >> 2)][subBlockX + (i & 3)] = {mv_x, mv_y};
+                    subMbTypes[currFrameBuffer][subBlockY + (i >> 2)][subBlockX + (i & 3)] = SUBMB_TYPE_16x16;
                 }
             }
             //16x8
@@ -340,6 +526,7 @@ void MoveDetector::MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx)
                 for (i = 0; i < 8; i++)
                 {
                     mvGridCoords[currFrameBuffer][subBlockY + (i >> 2)][subBlockX + (i & 3)] = {mv_x, mv_y};
+                    subMbTypes[currFrameBuffer][subBlockY + (i >> 2)][subBlockX + (i & 3)] = SUBMB_TYPE_16x8;
                 }
             }
             //8x16
@@ -350,6 +537,7 @@ void MoveDetector::MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx)
                 for (i = 0; i < 8; i++)
                 {
                     mvGridCoords[currFrameBuffer][subBlockY + (i >> 1)][subBlockX + (i & 1)] = {mv_x, mv_y};
+                    subMbTypes[currFrameBuffer][subBlockY + (i >> 1)][subBlockX + (i & 1)] = SUBMB_TYPE_8x16;
                 }
             }
             //8x8
@@ -360,6 +548,7 @@ void MoveDetector::MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx)
                 for (i = 0; i < 4; i++)
                 {
                     mvGridCoords[currFrameBuffer][subBlockY + (i >> 1)][subBlockX + (i & 1)] = {mv_x, mv_y};
+                    subMbTypes[currFrameBuffer][subBlockY + (i >> 1)][subBlockX + (i & 1)] = SUBMB_TYPE_8x8;
                 }
             }
         }
@@ -368,30 +557,257 @@ void MoveDetector::MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx)
 
 void MoveDetector::MotionFieldProcessing()
 {
-    if (delayedFrameNumber >= 0) {
+    //frames are analysed in batches, one frame per worker with frameParallel, then tracked in order
+    pendingFrames.push_back({currFrameBuffer, delayedFrameNumber, AnalysisStride() / analysisStride});
+    if (pendingFrames.size() >= workspaces.size())
+        FlushPendingFrames();
+    currFrameBuffer = (currFrameBuffer + 1) % ringSize;
+}
+
+void MoveDetector::PrepareBufferedFrame(int bufferIndex)
+{
+    if (gridPooling > 1)
+        PoolBufferedFrame(bufferIndex);
+
+    //every frame is compensated once, when it enters the buffer
+    if (globalMotionCompensation)
+        CompensateGlobalMotion(bufferIndex);
+
+    if (usePyramid && pyramidFactor > 1)
+        BuildCoarseFrame(bufferIndex);
+}
+
+void MoveDetector::AnalyseFrame(frameWorkspace &ws)
+{
+    const int frameBuffer = ws.frameBuffer;
+    ws.degradation = {};
+    ws.pyramidFrames = 0;
+    ws.pyramidCells = 0.0;
+
+    //the analysis grid is only processed around the foreground found on the 16x16 field
+    if (usePyramid && pyramidFactor > 1)
+        CoarseForegroundProcess(ws);
+    else
+        ws.fineSpan.SetFull(nSectorsY, nSectorsX);
+
+    CalculateMagAng(mvGridCoords[BUFFER_CURR(frameBuffer)], ws.mvGridMag, ws.mvGridArg, ws.fineSpan);
+
+    // MorphologyProcess();
+    // SpatialConsistProcess();
+
+    TemporalConsistProcess(ws);
 
-        CalculateMagAng();
+    //most of the frame is moving: camera motion, nothing worth labelling or tracking
+    globalMotionFrame[BUFFER_CURR(frameBuffer)] = IsGlobalMotion(ws);
+    if (globalMotionFrame[BUFFER_CURR(frameBuffer)])
+    {
+        truncatedFrame[BUFFER_CURR(frameBuffer)] = false;
+        ws.degradation.globalMotionFrames++;
+        for (int i = 0; i < nSectorsY; i++)
+            for (int j = 0; j < nSectorsX; j++)
+                areaGridMarked[BUFFER_CURR(frameBuffer)][i][j] = 0;
+        for (int i = 0; i < MAX_CONNAREAS; i++)
+            areaBuffer[BUFFER_CURR(frameBuffer)][i] = {};
+    }
+    else
+        MorphologyProcess(ws);
+}
+
+void MoveDetector::FlushPendingFrames()
+{
+    const int frames = pendingFrames.size();
+
+    //a frame entering the ring only touches its own slot, the analysis reads the slots around it
+    RunTiles(frames, [&](int k) { PrepareBufferedFrame(BUFFER_NEXT(pendingFrames[k].frameBuffer)); });
+    RunTiles(frames, [&](int k) {
+        if (pendingFrames[k].delayedFrame < 0)
+            return;
+        workspaces[k].frameBuffer = pendingFrames[k].frameBuffer;
+        AnalyseFrame(workspaces[k]);
+    });
+
+    //the tracker carries state from frame to frame: hand the results over one at a time, in order
+    const int lastFrameBuffer = currFrameBuffer;
+    for (int k = 0; k < frames; k++)
+    {
+        const pendingFrame &pending = pendingFrames[k];
+        const frameWorkspace &ws = workspaces[k];
+        if (pending.delayedFrame < 0)
+            continue;
+        currFrameBuffer = pending.frameBuffer;
+
+        //frames ahead of the range only warm the tracker up, nothing is reported or counted for them;
+        //the motion data is that of the frame analysed before the newest one in the window
+        const int reportedFrame = slotFrameNumber[BUFFER_CURR(pending.frameBuffer)];
+        const bool warmUp = reportedFrame < rangeStart;
+        if (!warmUp)
+        {
+            degradation.globalMotionFrames += ws.degradation.globalMotionFrames;
+            degradation.areaOverflowFrames += ws.degradation.areaOverflowFrames;
+            degradation.areasDropped += ws.degradation.areasDropped;
+            pyramidFrames += ws.pyramidFrames;
+            pyramidCells += ws.pyramidCells;
+        }
 
-        // MorphologyProcess();
-        // SpatialConsistProcess();
+        //ids are drawn here so that they follow the frame order whatever order the analysis ran in
+        connectedArea *areas = areaBuffer[BUFFER_CURR(currFrameBuffer)];
+        for (int i = 0; i < MAX_CONNAREAS && areas[i].size > 0; i++)
+            areas[i].id = idRandom() % 30000 + 1;
 
-        TemporalConsistProcess();
-        MorphologyProcess();
-        
-        fprintf(stderr, "motion data for frame %d (output frame %d)\n", currFrameNumber - 1, delayedFrameNumber - AREABUFFER_SIZE + 1);
+        //output frames count reported frames only, so that a range numbers them like a whole-file run
+        if (warmUp)
+            warmUpFrames++;
+        else
+        {
+            MV_LOG(LOG_LEVEL_FRAME, logFile, "motion data for frame %d (output frame %d)\n", reportedFrame, pending.delayedFrame - AREABUFFER_SIZE + 1 - warmUpFrames);
+            reportedFrames++;
+        }
 
-        if (delayedFrameNumber >= AREABUFFER_SIZE - 3)
+        if (pending.delayedFrame >= AREABUFFER_SIZE - 3)
         {
             // TrackedAreasFiltering();
             TrackAreas();
-            if (movemask_std_flag)
-                WriteMapConsole();
 
-            if (movemask_file_flag)
-                WriteMaskFile(fvideomask_desc);
+            //trackers at both ends of the range, for stitching segments together
+            if (warmUp)
+            {
+                if (segmentIndex >= 0)
+                    headTrackers = trackedObjects;
+                continue;
+            }
+            if (segmentIndex >= 0)
+                tailTrackers = trackedObjects;
+            //single noisy areas do not count, only motion a tracker has picked up
+            lastReportedFrame = reportedFrame;
+            if (!trackedObjects.empty())
+            {
+                lastMotionFrame = lastReportedFrame;
+                if (recordDetections)
+                    detectedFrames.push_back(lastMotionFrame);
+            }
+
+            if (!resultRingName.empty())
+                PublishResults();
+            if (eventFile || eventOutput)
+                WriteEvents();
+            //the report of -c goes to the logger's thread, or to the --report stream, in one piece
+            if (movemask_std_flag && !reportStream)
+                reportStream = open_memstream(&reportStreamBuffer, &reportStreamSize);
+            if (movemask_std_flag && reportStream)
+            {
+                WriteMapConsole(reportStream);
+                if (reportOutput)
+                    PushStreamOutput(reportOutput.get(), reportStream, reportStreamBuffer, OutputQueue::EVENT);
+                else
+                {
+                    fflush(reportStream);
+                    Logger::Write(logFile, reportStreamBuffer, ftell(reportStream));
+                    rewind(reportStream);
+                }
+            }
+
+            //a grid mask only needs the labels, the colours are for y4m and the overlay
+            const Grid<int> &labels = areaGridMarked[BUFFER_OLDEST(currFrameBuffer)];
+            if (movemask_file_flag || !overlayFile.empty())
+                LabelMaskCells();
+            if ((movemask_file_flag && segmentIndex < 0 && maskFormat != MASK_FORMAT_GRID) || !overlayFile.empty())
+                RenderMask(labels, trackedObjects);
+            //a segment's tracker IDs are only settled once all segments are done, it keeps the labels;
+            //a subsampled frame stands for several at the rate of the header, it is written that often
+            for (int r = 0; movemask_file_flag && r < pending.maskRepeat; r++)
+            {
+                if (segmentIndex >= 0)
+                    WriteLabelFrame(fvideomask_desc);
+                else if (maskFormat == MASK_FORMAT_GRID)
+                    WriteGridFrame(fvideomask_desc, labels, trackedObjects);
+                else if (maskFormat == MASK_FORMAT_VIDEO)
+                    QueueMaskFrame();
+                else
+                    WriteFrameToFile(fvideomask_desc, maskFrameY, maskFrameU, maskFrameV);
+            }
+            if (maskOutput)
+                PushStreamOutput(maskOutput.get(), fvideomask_desc, maskStreamBuffer, OutputQueue::MASK);
+            if (!overlayFile.empty())
+                WriteOverlayFrames(lastReportedFrame);
         }
     }
-    currFrameBuffer = (currFrameBuffer + 1) % AREABUFFER_SIZE;
+    currFrameBuffer = lastFrameBuffer;
+    pendingFrames.clear();
+}
+
+static const float governorAlpha = 0.2f;    //weight of the newest frame in the load average
+static const float governorHigh = 1.0f;     //load above which the level is stepped down
+static const float governorLow = 0.6f;      //load below which the level is stepped back up
+static const int governorHoldDown = 3;      //frames over budget before stepping down
+static const int governorHoldUpMax = 64 * GOVERNOR_HOLD_UP;
+
+int MoveDetector::AnalysisStride() const
+{
+    return governorLevel >= GOVERNOR_LEVEL_SUBSAMPLED ? analysisStride * 2 : analysisStride;
+}
+
+void MoveDetector::UpdateGovernor(int64_t processingTime)
+{
+    governorLevelFrames[governorLevel]++;
+    if (!cpuBudget)
+        return;
+    governorLevelAge++;
+
+    //fraction of the budget used; analysed frames get the interval of every frame they stand for
+    float load = processingTime / (frameInterval * AnalysisStride() * cpuBudget / 100.0);
+    governorLoad = governorOverCount || governorUnderCount ? governorLoad + governorAlpha * (load - governorLoad) : load;
+
+    if (governorLoad > governorHigh)
+    {
+        governorUnderCount = 0;
+        if (++governorOverCount >= governorHoldDown && governorLevel < GOVERNOR_LEVELS - 1)
+            SetGovernorLevel(governorLevel + 1);
+    }
+    else if (governorLoad < governorLow)
+    {
+        governorOverCount = 0;
+        if (++governorUnderCount >= governorHoldUp && governorLevel > GOVERNOR_LEVEL_FULL)
+            SetGovernorLevel(governorLevel - 1);
+    }
+    else
+    {
+        governorOverCount = 0;
+        governorUnderCount = 0;
+    }
+}
+
+void MoveDetector::SetGovernorLevel(int level)
+{
+    MV_LOG(LOG_LEVEL_INFO, logFile, "governor: level %d -> %d (load %4.2f)\n", governorLevel, level, governorLoad);
+
+    //a quality step that did not hold makes the next attempt wait twice as long
+    if (level > governorLevel)
+    {
+        if (governorSteppedUp && governorLevelAge < governorHoldUp)
+            governorHoldUp = std::min(governorHoldUp * 2, governorHoldUpMax);
+        else
+            governorHoldUp = GOVERNOR_HOLD_UP;
+    }
+    governorSteppedUp = level < governorLevel;
+    governorLevelAge = 0;
+
+    //the two buffered frames still in the temporal window follow the grid resolution
+    int newPooling = level >= GOVERNOR_LEVEL_POOLED ? 2 : 1;
+    if (newPooling != gridPooling)
+    {
+        RescaleBufferedFrame(BUFFER_CURR(currFrameBuffer), gridPooling, newPooling);
+        RescaleBufferedFrame(BUFFER_PREV(currFrameBuffer), gridPooling, newPooling);
+        gridPooling = newPooling;
+        AllocAnalyzeBuffers();
+    }
+
+    governorLevel = level;
+    if (dec_ctx)
+        dec_ctx->skip_frame = AnalysisStride() > 1 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
+    governorChanges++;
+    governorOverCount = 0;
+    governorUnderCount = 0;
 }
 
 void MoveDetector::SkipDummyFrame()
@@ -401,126 +817,298 @@ void MoveDetector::SkipDummyFrame()
     //     WriteMaskFile(fvideomask_desc);
 }
 
-void MoveDetector::MainDec()
+//counters and clocks of a new stream; the ring is refilled from its first frames
+void MoveDetector::StartDecodeLoop(decodeLoop &loop)
 {
-    srand(time(NULL));
-    int ret;
+    //segments start in the same second, each draws its own IDs
+    idRandom.seed(time(NULL) + segmentIndex + 1);
     count = 0;
     sum = 0;
-    int got_frame, processed_frame;
+    loop = {1, 0, 0, 0, chrono::high_resolution_clock::now()};
+    currFrameNumber = 0;
+    lastDecodedFrame = 0;
+    lastAnalysedFrame = 0;
+
+    currFrameBuffer = 0;
+    delayedFrameNumber = 1 - 3;
+}
+
+//decodes one packet and analyses the frame it completes.
+//Returns 1 once the range or the performance test is done, a negative value on a decoding error
+int MoveDetector::DecodePacket(AVPacket &packet, decodeLoop &loop)
+{
+    int ret, got_frame;
+
+    if (perfTest || (packet.stream_index == video_stream_index && ((loop.packetNumber % packet_skip == 0) || (loop.packetNumber < 10))))
+    {
+        // avcodec_get_frame_defaults(frame);
+        got_frame = perfTest ? 1 : 0;
+
+        // ret = avcodec_decode_video2(dec_ctx, frame, &got_frame, &packet);
+        if (!perfTest)
+        {
+            ret = decode(dec_ctx, frame, &got_frame, &packet);
+            if (ret < 0)
+            {
+                av_log(NULL, AV_LOG_ERROR, "Error decoding video\n");
+                return ret;
+            }
+        }
+
+        AllocAnalyzeBuffers();
+
+        if (got_frame && (ret = AnalyseFrame(loop)) != 0)
+            return ret;
+    }
+    if (perfTest || packet.stream_index == video_stream_index)
+        ++loop.packetNumber;
+    return 0;
+}
+
+//numbers and analyses the frame the decoder returned, or reports it as skipped.
+//Returns 1 once the range or the performance test is done
+int MoveDetector::AnalyseFrame(decodeLoop &loop)
+{
+    if (!perfTest)
+    {
+        //a new playlist entry continues the numbering where the last one stopped
+        if (inputSwitched)
+        {
+            inputFrameOffset = lastDecodedFrame + 1 - frame->best_effort_timestamp / frame->pkt_duration;
+            inputSwitched = false;
+        }
+        currFrameNumber = frame->best_effort_timestamp / frame->pkt_duration + inputFrameOffset;
+    }
+    //the last analysed frame of the range is reported once the next analysed one is in the window
+    if (lastAnalysedFrame >= rangeEnd)
+        return 1;
+    if (!overlayFile.empty() && !perfTest && currFrameNumber >= rangeStart && currFrameNumber <= rangeEnd)
+        QueueOverlayFrame(frame, currFrameNumber);
+    //the seek lands on a keyframe, frames up to the warm-up are only decoded as references
+    if (currFrameNumber < rangeStart - WARMUP_FRAMES)
+    {
+        MV_LOG(LOG_LEVEL_FRAME, logFile, "decoding frame %d (packet no. %d), ahead of the warm-up\n", currFrameNumber, loop.packetNumber);
+    }
+    //every frame is decoded to keep references intact, only every n-th inter frame is analysed
+    else if (frame->pict_type != FF_I_TYPE && (loop.interFrames++ % AnalysisStride() == 0))
+    {
+        MV_LOG(LOG_LEVEL_FRAME, logFile, "processing frame %d (packet no. %d, %d frames with MVs processed, governor level %d), \n", currFrameNumber, loop.packetNumber, loop.processedFrames, governorLevel);
+
+        // multithread ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+        // ToDO: .............
+
+        // one thread ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+        if (!perfTest)
+        {
+            if (nSectors >= 0)
+                // MvScanFrame(loop.packetNumber, frame, dec_ctx);
+                throw std::runtime_error("Can only wheelchair with -g -1");
+            else
+                MvScanFrameH(loop.packetNumber, frame, dec_ctx);
+        }
+
+        //MVs span the distance to the previous decoded frame, analysed frames are further apart
+        if (AnalysisStride() > 1 && currFrameNumber > lastDecodedFrame)
+            mvFrameScale[BUFFER_NEXT(currFrameBuffer)] = (float)(currFrameNumber - lastAnalysedFrame) / (currFrameNumber - lastDecodedFrame);
+        else
+            mvFrameScale[BUFFER_NEXT(currFrameBuffer)] = 1.0f;
+        slotFrameNumber[BUFFER_NEXT(currFrameBuffer)] = currFrameNumber;
+        lastAnalysedFrame = currFrameNumber;
+
+        chrono::high_resolution_clock::time_point start_t_processing = chrono::high_resolution_clock::now();
+        MotionFieldProcessing();
+        chrono::high_resolution_clock::time_point end_t_processing = chrono::high_resolution_clock::now();
+        int64_t frame_processing = chrono::duration_cast<chrono::microseconds>(end_t_processing - start_t_processing).count();
+        loop.processingTime += frame_processing;
+        UpdateGovernor(frame_processing);
+
+        delayedFrameNumber++;
+        loop.processedFrames++;
+        if (perfTest && loop.processedFrames > 300)
+            return 1;
+        // if (movemask_file_flag)
+        // 	printf("Play mask file: mplayer -demuxer rawvideo -rawvideo w=%d:h=%d:format=y8 %s -loop 0 \n", output_width, output_height, mask_filename);
+    }
+    else
+    {
+        MV_LOG(LOG_LEVEL_FRAME, logFile, "skipping frame %d (packet no. %d, %d frames with MVs processed), \n", currFrameNumber, loop.packetNumber, loop.processedFrames);
+        if (currFrameNumber)
+        {
+            SkipDummyFrame();
+        }
+    }
+    lastDecodedFrame = currFrameNumber;
+    return 0;
+}
+
+//frames the decoder still holds back for reordering, analysed before it is flushed: a decoder that
+//restarts at a keyframe never returns them. Returns 1 if the range ended on one of them
+int MoveDetector::DrainDecoder(decodeLoop &loop)
+{
+    int ret = 0;
+    if (avcodec_send_packet(dec_ctx, NULL) >= 0)
+    {
+        while (ret == 0 && avcodec_receive_frame(dec_ctx, frame) >= 0)
+        {
+            AllocAnalyzeBuffers();
+            ret = AnalyseFrame(loop);
+        }
+    }
+    avcodec_flush_buffers(dec_ctx);
+    return ret;
+}
+
+//analyses the frames of an unfinished batch and prints the totals of the stream
+void MoveDetector::FinishDecodeLoop(decodeLoop &loop)
+{
+    if (!pendingFrames.empty())
+    {
+        chrono::high_resolution_clock::time_point start_t_processing = chrono::high_resolution_clock::now();
+        FlushPendingFrames();
+        chrono::high_resolution_clock::time_point end_t_processing = chrono::high_resolution_clock::now();
+        loop.processingTime += chrono::duration_cast<chrono::microseconds>(end_t_processing - start_t_processing).count();
+    }
+    processedFrames = loop.processedFrames;
+    //the summary goes after the frames' messages
+    Logger::Flush();
+
+    chrono::high_resolution_clock::time_point end_t = chrono::high_resolution_clock::now();
+    int64_t duration = chrono::duration_cast<chrono::microseconds>(end_t - loop.start).count();
+    fprintf(logFile, "Total frames processed: %d\n", loop.processedFrames);
+    fprintf(logFile, "Total execution time = %f sec\n", double(duration) / 1000000.0f);
+    fprintf(logFile, "MV processing time = %f sec (%4.2f percent of total time)\n", double(loop.processingTime) / 1000000.0f, (double)loop.processingTime / (double)duration * 100.0f);
+    fprintf(logFile, "Average FPS: %4.3f\n", (double)loop.processedFrames * 1000000.0f / double(duration));
+    fprintf(logFile, "Global motion frames: %d; area budget hit in %d frames (%d areas dropped); tracker budget hit in %d frames (%d trackers refused)\n",
+            degradation.globalMotionFrames, degradation.areaOverflowFrames, degradation.areasDropped,
+            degradation.trackerOverflowFrames, degradation.trackersRefused);
+    if (cpuBudget)
+        fprintf(logFile, "Governor: %d level changes; frames per level: %d full, %d pooled, %d subsampled, %d without spatial filter\n",
+                governorChanges, governorLevelFrames[GOVERNOR_LEVEL_FULL], governorLevelFrames[GOVERNOR_LEVEL_POOLED],
+                governorLevelFrames[GOVERNOR_LEVEL_SUBSAMPLED], governorLevelFrames[GOVERNOR_LEVEL_NO_SPATIAL]);
+    if (pyramidFrames)
+        fprintf(logFile, "Pyramid: %4.2f percent of the grid processed at full resolution\n", pyramidCells / pyramidFrames * 100.0);
+}
+
+void MoveDetector::MainDec()
+{
+    int ret;
+    decodeLoop loop;
 
     if (!frame)
     {
         perror("Could not allocate frame");
     }
 
+    if (!perfTest && fmt_ctx->streams[video_stream_index]->r_frame_rate.num > 0)
+        frameInterval = 1000000.0 / av_q2d(fmt_ctx->streams[video_stream_index]->r_frame_rate);
+
     // read all packets
-    int packet_n = 1;
-    currFrameNumber = 0;
-    processed_frame = 0;
-    int64_t duration_processing = 0;
+    StartDecodeLoop(loop);
 
-    currFrameBuffer = 0;
-    delayedFrameNumber = 1 - 3;
+    //segments leave the header to the file they are joined into
+    if (movemask_file_flag && segmentIndex < 0)
+        WriteMaskHeader(fvideomask_desc);
+    //a stream reader that connects later gets the header as well
+    if (maskOutput)
+    {
+        fflush(fvideomask_desc);
+        maskOutput->SetHeader(maskStreamBuffer, ftell(fvideomask_desc));
+        rewind(fvideomask_desc);
+    }
 
-    chrono::high_resolution_clock::time_point start_t = chrono::high_resolution_clock::now();
+    if (!clipDir.empty() && !perfTest)
+        StartClips();
 
-    if (movemask_file_flag && USE_YUV2MPEG2)
-        WriteMPEG2Header(fvideomask_desc);
+    checkpointPosition position = {};
+    chrono::high_resolution_clock::time_point checkpoint_t = loop.start;
+    if (resume && !perfTest && LoadCheckpoint(position) == 0)
+    {
+        //the ring and the trackers are as they were ahead of the checkpoint's keyframe
+        DropProbedPackets();
+        if (av_seek_frame(fmt_ctx, video_stream_index, position.keyTimestamp, AVSEEK_FLAG_BACKWARD) < 0)
+        {
+            fprintf(stderr, "cannot seek to the checkpoint in the input stream\n");
+            exit(0);
+        }
+        avcodec_flush_buffers(dec_ctx);
+        loop.packetNumber = position.packetNumber;
+        loop.interFrames = position.interFrames;
+        loop.processedFrames = position.processedFrames;
+        if (movemask_file_flag)
+        {
+            fflush(fvideomask_desc);
+            if (ftruncate(fileno(fvideomask_desc), position.maskOffset) < 0)
+                fprintf(stderr, "cannot truncate %s to the checkpoint\n", mask_filename);
+            fseek(fvideomask_desc, position.maskOffset, SEEK_SET);
+        }
+        MV_LOG(LOG_LEVEL_INFO, logFile, "resuming from checkpoint %s at frame %d\n", checkpointFile.c_str(), lastDecodedFrame + 1);
+    }
+    else if (rangeStart > 0 && !perfTest)
+    {
+        //av_seek_frame lands on the keyframe at or before the target
+        int64_t warmUpStart = std::max(rangeStart - WARMUP_FRAMES, (int64_t)0);
+        DropProbedPackets();
+        if (av_seek_frame(fmt_ctx, video_stream_index, FrameToTimestamp(warmUpStart), AVSEEK_FLAG_BACKWARD) < 0)
+            fprintf(stderr, "cannot seek to frame %lld, decoding from the start\n", (long long)warmUpStart);
+        avcodec_flush_buffers(dec_ctx);
+    }
 
     while (1)
     {
-        if (!perfTest && (ret = av_read_frame(fmt_ctx, &packet)) < 0)
+        if (!perfTest && (ret = ReadPacket(&packet)) < 0)
+        {
+            if (NextPlaylistInput(loop))
+                continue;
             break;
+        }
 
-        if (perfTest || (packet.stream_index == video_stream_index && ((packet_n % packet_skip == 0) || (packet_n < 10))))
+        //checkpoints are taken ahead of a keyframe, where decoding can restart on its own. A resumed run
+        //restarts the decoder there, so this one does too: the frames it holds back are analysed first
+        if (!perfTest && !checkpointFile.empty() && packet.stream_index == video_stream_index && (packet.flags & AV_PKT_FLAG_KEY) &&
+            chrono::high_resolution_clock::now() - checkpoint_t >= chrono::seconds(checkpointInterval))
         {
-            // avcodec_get_frame_defaults(frame);
-            got_frame = perfTest ? 1 : 0;
-
-            // ret = avcodec_decode_video2(dec_ctx, frame, &got_frame, &packet);
-            if (!perfTest)
-            {
-                ret = decode(dec_ctx, frame, &got_frame, &packet);
-                if (ret < 0)
-                {
-                    av_log(NULL, AV_LOG_ERROR, "Error decoding video\n");
-                    break;
-                }
-            }
-
-            AllocAnalyzeBuffers();
-
-            if (got_frame)
+            if (dec_ctx->has_b_frames > 0 && DrainDecoder(loop) != 0)
             {
-                if (!perfTest)
-                    currFrameNumber = frame->best_effort_timestamp / frame->pkt_duration;
-                if (frame->pict_type != FF_I_TYPE)
-                {
-                    fprintf(stderr, "processing frame %d (packet no. %d, %d frames with MVs processed), \n", currFrameNumber, packet_n, processed_frame);
-
-                    // multithread ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-                    // ToDO: .............
-
-                    // one thread ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-                    if (!perfTest)
-                    {
-                        if (nSectors >= 0)
-                            // MvScanFrame(packet_n, frame, dec_ctx);
-                            throw std::runtime_error("Can only wheelchair with -g -1");
-                        else
-                            MvScanFrameH(packet_n, frame, dec_ctx);
-                    }
-
-                    chrono::high_resolution_clock::time_point start_t_processing = chrono::high_resolution_clock::now();
-                    MotionFieldProcessing();
-                    chrono::high_resolution_clock::time_point end_t_processing = chrono::high_resolution_clock::now();
-                    duration_processing += chrono::duration_cast<chrono::microseconds>(end_t_processing - start_t_processing).count();
-
-                    delayedFrameNumber++;
-                    processed_frame++;
-                    if (perfTest && processed_frame > 300)
-                        break;
-                    // if (movemask_file_flag)
-                    // 	printf("Play mask file: mplayer -demuxer rawvideo -rawvideo w=%d:h=%d:format=y8 %s -loop 0 \n", output_width, output_height, mask_filename);
-                }
-                else
-                {
-                    fprintf(stderr, "skipping frame %d (packet no. %d, %d frames with MVs processed), \n", currFrameNumber, packet_n, processed_frame);
-                    if (currFrameNumber)
-                    {
-                        SkipDummyFrame();
-                    }
-                }
+                av_packet_unref(&packet);
+                break;
             }
+            if (!pendingFrames.empty())
+                FlushPendingFrames();
+            position = {packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts, loop.packetNumber, loop.interFrames, loop.processedFrames, 0};
+            SaveCheckpoint(position);
+            checkpoint_t = chrono::high_resolution_clock::now();
         }
-        ++packet_n;
+
+        ret = DecodePacket(packet, loop);
+        if (clipList)
+            ClipPacket(packet);
         if (!perfTest)
             av_packet_unref(&packet);
+        if (ret != 0)
+            break;
     }
+    FinishDecodeLoop(loop);
+    if (clipList)
+        FinishClips();
+    if (!overlayFile.empty() && !perfTest)
+        FinishOverlay();
+    if (maskVideo)
+        CloseMaskVideo();
+
+    //a finished run leaves nothing to resume
+    if (!checkpointFile.empty())
+        remove(checkpointFile.c_str());
 
-    chrono::high_resolution_clock::time_point end_t = chrono::high_resolution_clock::now();
-    int64_t duration = chrono::duration_cast<chrono::microseconds>( end_t - start_t ).count();
-    fprintf(stderr, "Total frames processed: %d\n", processed_frame);
-    fprintf(stderr, "Total execution time = %f sec\n", double(duration) / 1000000.0f);
-    fprintf(stderr, "MV processing time = %f sec (%4.2f percent of total time)\n", double(duration_processing) / 1000000.0f, (double)duration_processing / (double)duration * 100.0f);
-    fprintf(stderr, "Average FPS: %4.3f\n", (double)processed_frame * 1000000.0f / double(duration));
     if (!perfTest)
     {
-        fprintf(stderr, "Video resolution: %dx%d; Framerate: %2.2f\n", dec_ctx->width, dec_ctx->height,
+        fprintf(logFile, "Video resolution: %dx%d; Framerate: %2.2f\n", dec_ctx->width, dec_ctx->height,
                 (float)fmt_ctx->streams[video_stream_index]->r_frame_rate.num / fmt_ctx->streams[video_stream_index]->r_frame_rate.den);
-        fprintf(stderr, "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+        fprintf(logFile, "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
 
-        if (movemask_file_flag)
-            if (USE_YUV2MPEG2)
-                fprintf(stderr, "Play mask file: mplayer %s -loop 0 \n\n", mask_filename);
-            else
-                fprintf(stderr, "Play mask file: mplayer -demuxer rawvideo -rawvideo w=%d:h=%d:format=i420 %s -loop 0 \n\n", output_width, output_height, mask_filename);
+        if (movemask_file_flag && segmentIndex < 0 && !maskOutput)
+            PrintMaskHint();
 
-        if (dec_ctx)
-            avcodec_close(dec_ctx);
-        if (fmt_ctx)
-            avformat_close_input(&fmt_ctx);
+        CloseInput();
         if (frame)
             av_freep(&frame);
     }
@@ -532,8 +1120,26 @@ void MoveDetector::Help(void)
             "Usage: motion_detect [options] input_stream\n"
             "Options:\n\n"
             "  -c                      Write output map to console.\n\n"
-            "  -o <filename.y4m>       Write output map to filename.y4m.\n\n"
-            "  -p <n>                  Process only every n-th packet (default: 1).\n\n"
+            "  -o <filename.y4m>       Write output map to filename.y4m. \"-\" (stdout), unix:<path> or an existing\n"
+            "                          FIFO or socket make it a stream: frames are queued and written by a\n"
+            "                          thread of their own, a reader may connect and reconnect at any time.\n\n"
+            "  --mask-format <fmt>     Format of the -o file: y4m (default), or grid: a header with the grid,\n"
+            "                          cell and frame size, then a byte per grid cell for every frame\n"
+            "                          (0 no motion, 255 an area without tracker, 1..254 a value each live\n"
+            "                          tracker keeps while it lives, (ID - 1) %% 254 + 1 unless taken);\n"
+            "                          video: the y4m frames encoded to a video file, in the container of\n"
+            "                          its extension (e.g. mask.mkv), on a thread of its own.\n\n"
+            "  --mask-codec <name>     Encoder of --mask-format video (default: %s). FFV1 is lossless,\n"
+            "                          libx264 is run lossless, mpeg4 at quantiser 1.\n\n"
+            "  --unpack-mask <file>    Upscale the grid mask <file> to a y4m stream written to -o, then exit.\n\n"
+            "  -p <n>                  Decode only every n-th video packet (default: 1).\n"
+            "                          Breaks decoder references, prefer -n.\n\n"
+            "  -n <n>                  Decode every frame but analyse only every n-th inter frame (default: 1).\n"
+            "                          Non-reference frames are not decoded when n > 1.\n\n"
+            "  -j <n>                  Worker threads for the grid stages, each takes a horizontal tile\n"
+            "                          of the grid (default: %d).\n\n"
+            "  --frame-parallel        Have the -j workers analyse whole consecutive frames instead of tiles,\n"
+            "                          only the tracker runs frame by frame. Cannot be used with --cpu-budget.\n\n"
             "  -e <element>            Element to use for morphological closing.\n"
             "                          Can be a 3x3 <cross> (default) or a <square>.\n\n"
             "  -a <n>                  Alpha for MV preprocessing: interframe similarity threshold.\n"
@@ -542,15 +1148,239 @@ void MoveDetector::Help(void)
             "  -b <n>                  Beta for MV preprocessing: vector magnitude threshold.\n"
             "                          MVs with magnitude lower than Beta (in px) will be rejected (default: 4).\n\n"
             "  -s <n>                  Threshold for detected area sizes. Default: 0 blocks (no thresholding).\n"
-            "                          (Temporary solution against smaller local MV noise)\n\n");
+            "                          (Temporary solution against smaller local MV noise)\n\n"
+            "  --max-areas <n>         Maximum labelled areas per frame, the smallest ones are dropped\n"
+            "                          above it (default: %d).\n\n"
+            "  --max-trackers <n>      Maximum live trackers, new ones are only created for the largest\n"
+            "                          areas above it (default: %d).\n\n"
+            "  --max-fg <n>            Maximum foreground percentage of the frame. Frames above it are treated as\n"
+            "                          global motion: labelling and tracking are skipped (default: %d).\n\n",
+            MASK_CODEC, WORKER_THREADS, MAX_AREAS, MAX_TRACKERS, MAX_FG_PERCENT);
+    fprintf(stderr,
+            "  --gmc                   Estimate the dominant (camera) motion of every frame with a robust\n"
+            "                          affine fit and subtract it from the MVs before foreground detection.\n\n"
+            "  --cpu-budget <n>        Keep MV processing under n percent of the frame interval by stepping\n"
+            "                          through cheaper levels: 8x8 pooled grid, analysing every other frame,\n"
+            "                          skipping the spatial filter (default: 0, governor off).\n\n"
+            "  --pyramid               Detect foreground on a 16x16 pooled field first and run the full\n"
+            "                          4x4 pipeline only around it.\n\n"
+            "  --segments <n>          Cut the recording at keyframes into n segments and process them in\n"
+            "                          parallel, each warmed up on the GOP before it; a tracker that crosses\n"
+            "                          a cut keeps its ID in the report and the mask (default: 1).\n\n"
+            "  --triage                Classify every GOP from its packet sizes without decoding and analyse\n"
+            "                          only the active ones, with one GOP of margin on either side.\n"
+            "                          --segments sets how many ranges are analysed at once.\n\n"
+            "  --triage-sample         Also decode the first inter frame of every GOP and count its moving MVs.\n\n"
+            "  --triage-check          Run a full pass as well and report the recall of the triage against it.\n\n"
+            "  --from <pos>            Process from this position on: a frame number, or a time from the start\n"
+            "                          of the stream as [[hh:]mm:]ss[.fff] or <seconds>s. Decoding starts at the\n"
+            "                          keyframe before it and the %d frames ahead of it only warm the tracker up.\n\n"
+            "  --to <pos>              Stop before this position, same format as --from.\n\n"
+            "  --watch <dir>           Run as a daemon instead of processing input_stream: every recording\n"
+            "                          closed in or moved into <dir> is analysed and its report written to\n"
+            "                          <recording>.motion.txt. Can be given more than once.\n\n"
+            "  --watch-workers <n>     Recordings analysed at a time in watch mode, live inputs analysed at a\n"
+            "                          time in ingest mode (default: %d).\n\n"
+            "  --ingest <input>        Run as a daemon on live raw video streams instead of input_stream:\n"
+            "                          fifo:<path>, unix:<path> (a listening socket, every connection is a\n"
+            "                          camera) or udp:[<address>:]<port> (default address 127.0.0.1). Each\n"
+            "                          input gets its own detector and report <input>.motion.txt.\n"
+            "                          Can be given more than once.\n\n"
+            "  --ingest-threads <n>    I/O threads reading the live inputs (default: %d).\n\n"
+            "  --ingest-queue <n>      Packets queued per input: a FIFO or socket is not read further until\n"
+            "                          half of them are analysed, UDP packets are dropped up to the next\n"
+            "                          keyframe (default: %d).\n\n"
+            "  --ingest-codec <name>   Decoder of the live streams (default: h264).\n\n"
+            "  --follow                Keep reading a recording that is still being written: wait for new data\n"
+            "                          at its end and stop only when it is renamed or deleted (rotation) or\n"
+            "                          nothing is appended for --follow-idle seconds.\n\n"
+            "  --follow-idle <sec>     Idle timeout in follow mode (default: %d).\n\n"
+            "  --mmap                  Read local files through a memory mapping with readahead instead of\n"
+            "                          the file protocol; other inputs use the default I/O.\n\n"
+            "  --clips <dir>           Copy the stretches with active trackers, without re-encoding, to clip files\n"
+            "                          in <dir>, named after the input, and list their times in\n"
+            "                          <dir>/<input>.clips.txt. Clips start and end at keyframes.\n\n"
+            "  --clip-pre <sec>        Seconds kept ahead of the motion, at least (default: %d).\n\n"
+            "  --clip-post <sec>       Seconds without motion before a clip is closed (default: %d).\n\n"
+            "  --overlay <file>        Draw the mask on the decoded input frames and encode them to <file>, in\n"
+            "                          the same pass. Decodes the full picture, which costs time.\n\n"
+            "  --overlay-codec <name>  Encoder of the overlay (default: %s).\n\n"
+            "  --overlay-preset <name> Encoder preset of the overlay (default: %s).\n\n"
+            "  --stream-cache <dir>    Keep the stream parameters of every source (URL, or directory and extension\n"
+            "                          of recordings) in <dir>. A source seen before is opened with a short\n"
+            "                          probe and checked against its first frame, a mismatch probes again.\n\n"
+            "  --io-bench              Demux the input with the default I/O and with --mmap, report both\n"
+            "                          throughputs and exit.\n\n"
+            "  --checkpoint <file>     Save the analysis state to <file> at the first keyframe after every\n"
+            "                          --checkpoint-interval seconds; removed when the run completes.\n\n"
+            "  --checkpoint-interval <sec>  Time between checkpoints (default: %d).\n\n"
+            "  --resume                Continue from the checkpoint file where an interrupted run left off.\n"
+            "                          The mask file is cut back to the checkpoint; the console report goes\n"
+            "                          on from the checkpoint's frame.\n\n"
+            "  --report <target>       Write the per-frame report of -c to a stream instead, one message per\n"
+            "                          frame: \"-\" (stdout), unix:<path> or an existing FIFO or socket.\n\n"
+            "  --output-policy <p>     What a full stream queue does: block (the analysis waits for the reader),\n"
+            "                          drop-oldest (queued messages make room) or drop-masks (default: mask\n"
+            "                          frames make room, report frames are never dropped).\n\n"
+            "  --output-queue <MB>     Size of each stream queue (default: %d).\n\n"
+            "  --shm <name>            Publish the labels, areas and trackers of every frame to the shared memory\n"
+            "                          ring /dev/shm/<name>, for local readers (mv_shmring.h).\n\n"
+            "  --shm-slots <n>         Frames kept in the ring, at least 2 (default: %d).\n\n"
+            "  --events <target>       Write a record per frame with its areas and trackers (mv_events.h) to a\n"
+            "                          file, or to a stream as -o does.\n\n"
+            "  --events-format <fmt>   binary (default): length-prefixed fixed-width records, or json: the same\n"
+            "                          fields as one JSON object per line.\n\n"
+            "  --log-level <level>     error, warning, info (default), frame: a line for every decoded and reported\n"
+            "                          frame, or debug. Messages are written by a thread of their own.\n\n"
+            "  --playlist <file>       Process the recordings listed in <file> (one per line, m3u comments are\n"
+            "                          skipped) as one stream: the decoder, the MV history and the trackers\n"
+            "                          carry over from one recording to the next. Giving several input\n"
+            "                          streams does the same.\n\n",
+            WARMUP_FRAMES, WATCH_WORKERS, INGEST_THREADS, INGEST_QUEUE, FOLLOW_IDLE_SECONDS, CLIP_PRE_ROLL, CLIP_POST_ROLL,
+            OVERLAY_CODEC, OVERLAY_PRESET, CHECKPOINT_INTERVAL, OUTPUT_QUEUE_MB, SHM_SLOTS);
     fprintf(stderr, "Using libavcodec version %d.%d.%d \n", LIBAVCODEC_VERSION_MAJOR, LIBAVCODEC_VERSION_MINOR, LIBAVCODEC_VERSION_MICRO);
 }
 
-static const char *mvOptions = {"o:p:e:a:b:s:c"};
+static const char *mvOptions = {"o:p:n:j:e:a:b:s:c"};
+
+enum
+{
+    OPT_MAX_AREAS = 256,
+    OPT_MAX_TRACKERS,
+    OPT_MAX_FG,
+    OPT_GMC,
+    OPT_CPU_BUDGET,
+    OPT_PYRAMID,
+    OPT_FRAME_PARALLEL,
+    OPT_SEGMENTS,
+    OPT_TRIAGE,
+    OPT_TRIAGE_SAMPLE,
+    OPT_TRIAGE_CHECK,
+    OPT_FROM,
+    OPT_TO,
+    OPT_WATCH,
+    OPT_WATCH_WORKERS,
+    OPT_FOLLOW,
+    OPT_FOLLOW_IDLE,
+    OPT_PLAYLIST,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_RESUME,
+    OPT_MMAP,
+    OPT_IO_BENCH,
+    OPT_INGEST,
+    OPT_INGEST_THREADS,
+    OPT_INGEST_QUEUE,
+    OPT_INGEST_CODEC,
+    OPT_STREAM_CACHE,
+    OPT_CLIPS,
+    OPT_CLIP_PRE,
+    OPT_CLIP_POST,
+    OPT_OVERLAY,
+    OPT_OVERLAY_CODEC,
+    OPT_OVERLAY_PRESET,
+    OPT_MASK_FORMAT,
+    OPT_UNPACK_MASK,
+    OPT_MASK_CODEC,
+    OPT_REPORT,
+    OPT_OUTPUT_POLICY,
+    OPT_OUTPUT_QUEUE,
+    OPT_SHM,
+    OPT_SHM_SLOTS,
+    OPT_EVENTS,
+    OPT_EVENTS_FORMAT,
+    OPT_LOG_LEVEL
+};
+
+static const struct option mvLongOptions[] = {
+    {"max-areas", required_argument, NULL, OPT_MAX_AREAS},
+    {"max-trackers", required_argument, NULL, OPT_MAX_TRACKERS},
+    {"max-fg", required_argument, NULL, OPT_MAX_FG},
+    {"gmc", no_argument, NULL, OPT_GMC},
+    {"cpu-budget", required_argument, NULL, OPT_CPU_BUDGET},
+    {"pyramid", no_argument, NULL, OPT_PYRAMID},
+    {"frame-parallel", no_argument, NULL, OPT_FRAME_PARALLEL},
+    {"segments", required_argument, NULL, OPT_SEGMENTS},
+    {"triage", no_argument, NULL, OPT_TRIAGE},
+    {"triage-sample", no_argument, NULL, OPT_TRIAGE_SAMPLE},
+    {"triage-check", no_argument, NULL, OPT_TRIAGE_CHECK},
+    {"from", required_argument, NULL, OPT_FROM},
+    {"to", required_argument, NULL, OPT_TO},
+    {"watch", required_argument, NULL, OPT_WATCH},
+    {"watch-workers", required_argument, NULL, OPT_WATCH_WORKERS},
+    {"follow", no_argument, NULL, OPT_FOLLOW},
+    {"follow-idle", required_argument, NULL, OPT_FOLLOW_IDLE},
+    {"playlist", required_argument, NULL, OPT_PLAYLIST},
+    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+    {"checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+    {"resume", no_argument, NULL, OPT_RESUME},
+    {"mmap", no_argument, NULL, OPT_MMAP},
+    {"io-bench", no_argument, NULL, OPT_IO_BENCH},
+    {"ingest", required_argument, NULL, OPT_INGEST},
+    {"ingest-threads", required_argument, NULL, OPT_INGEST_THREADS},
+    {"ingest-queue", required_argument, NULL, OPT_INGEST_QUEUE},
+    {"ingest-codec", required_argument, NULL, OPT_INGEST_CODEC},
+    {"stream-cache", required_argument, NULL, OPT_STREAM_CACHE},
+    {"clips", required_argument, NULL, OPT_CLIPS},
+    {"clip-pre", required_argument, NULL, OPT_CLIP_PRE},
+    {"clip-post", required_argument, NULL, OPT_CLIP_POST},
+    {"overlay", required_argument, NULL, OPT_OVERLAY},
+    {"overlay-codec", required_argument, NULL, OPT_OVERLAY_CODEC},
+    {"overlay-preset", required_argument, NULL, OPT_OVERLAY_PRESET},
+    {"mask-format", required_argument, NULL, OPT_MASK_FORMAT},
+    {"unpack-mask", required_argument, NULL, OPT_UNPACK_MASK},
+    {"mask-codec", required_argument, NULL, OPT_MASK_CODEC},
+    {"report", required_argument, NULL, OPT_REPORT},
+    {"output-policy", required_argument, NULL, OPT_OUTPUT_POLICY},
+    {"output-queue", required_argument, NULL, OPT_OUTPUT_QUEUE},
+    {"shm", required_argument, NULL, OPT_SHM},
+    {"shm-slots", required_argument, NULL, OPT_SHM_SLOTS},
+    {"events", required_argument, NULL, OPT_EVENTS},
+    {"events-format", required_argument, NULL, OPT_EVENTS_FORMAT},
+    {"log-level", required_argument, NULL, OPT_LOG_LEVEL},
+    {NULL, 0, NULL, 0}};
+
+//--from/--to position: a frame number, or a time once the frame rate is known
+struct rangeBound
+{
+    bool set;
+    bool isTime;
+    double value;
+};
+
+//"1500" is a frame, "90s", "1:30" and "00:01:30.0" are times
+static bool ParseRangeBound(const char *arg, rangeBound &bound)
+{
+    double fields[3];
+    char *end;
+    int n = 0;
+
+    bound.set = true;
+    bound.isTime = strchr(arg, ':') || strchr(arg, '.') || strchr(arg, 's');
+    while (n < 3)
+    {
+        fields[n++] = strtod(arg, &end);
+        if (end == arg || fields[n - 1] < 0)
+            return false;
+        if (*end != ':')
+            break;
+        arg = end + 1;
+    }
+    if ((*end == 's' && n == 1 && end[1] == '\0') || *end == '\0')
+    {
+        bound.value = 0;
+        for (int i = 0; i < n; i++)
+            bound.value = bound.value * 60 + fields[i];
+        return bound.isTime || bound.value == (int64_t)bound.value;
+    }
+    return false;
+}
 
 void Initialize(int argc, char **argv)
 {
     MoveDetector movedec;
+    rangeBound from = {}, to = {};
+    const char *unpackMask = NULL;
 
     // movedec.AllocBuffers();
 
@@ -562,7 +1392,7 @@ void Initialize(int argc, char **argv)
 
     int opt;
 
-    while ((opt = getopt(argc, argv, mvOptions)) != -1)
+    while ((opt = getopt_long(argc, argv, mvOptions, mvLongOptions, NULL)) != -1)
     {
         switch (opt)
         {
@@ -580,17 +1410,9 @@ void Initialize(int argc, char **argv)
         // }
         case 'o':
         {
-            char *gout_filename = optarg;
-            strncpy(movedec.mask_filename, gout_filename, MAX_FILENAME);
-            if ((movedec.fvideomask_desc = fopen(gout_filename, "wb")) == NULL)
-            {
-                fprintf(stderr, "Error while opening mask videostream  %s\n", gout_filename);
-                movedec.movemask_file_flag = 0;
-            }
-            else
-            {
-                movedec.movemask_file_flag = 1;
-            }
+            //opened once all options are known, a resumed run keeps what is already in the file
+            strncpy(movedec.mask_filename, optarg, MAX_FILENAME - 1);
+            movedec.movemask_file_flag = 1;
             break;
         }
         case 's':
@@ -613,6 +1435,30 @@ void Initialize(int argc, char **argv)
             movedec.packet_skip = atoi(optarg);
             break;
         }
+        case 'n':
+        {
+            int stride = atoi(optarg);
+            if (stride < 1)
+            {
+                fprintf(stderr, "analysis stride must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.analysisStride = stride;
+            break;
+        }
+        case 'j':
+        {
+            int threads = atoi(optarg);
+            if (threads < 1)
+            {
+                fprintf(stderr, "number of threads must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.workerThreads = threads;
+            break;
+        }
         // case 't':
         // {
         //     movedec.binThreshold = atoi(optarg);
@@ -651,60 +1497,595 @@ void Initialize(int argc, char **argv)
             movedec.beta = (float)beta;
             break;
         }
-        }
-    }
-    char *gfilename = argv[optind];
-    if (!gfilename)
-    {
-        fprintf(stderr, "No input stream provided\n");
-        exit(0);
-    }
-    if (movedec.OpenVideoFile(gfilename) < 0)
-    {
-        if (strcmp(gfilename, "perftest") == 0)            
+        case OPT_MAX_AREAS:
         {
-            fprintf(stderr, "Performing a performance test for a 1280x720 empty stream \n");
-            movedec.perfTest = true;
+            int maxAreas = atoi(optarg);
+            if ((maxAreas < 1) || (maxAreas > MAX_CONNAREAS - 1))
+            {
+                fprintf(stderr, "max-areas must be in (1..%d)\n", MAX_CONNAREAS - 1);
+                movedec.Help();
+                exit(0);
+            }
+            movedec.maxAreas = maxAreas;
+            break;
         }
-        else
+        case OPT_MAX_TRACKERS:
         {
-            fprintf(stderr, "Error while opening orig videostream %s\n", gfilename);
-            movedec.Help();
-            exit(0);
+            int maxTrackers = atoi(optarg);
+            if (maxTrackers < 1)
+            {
+                fprintf(stderr, "max-trackers must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.maxTrackers = maxTrackers;
+            break;
         }
-    }
-    movedec.nSectors = -1;
-    movedec.MainDec();
-    movedec.Close();
-}
-
-int main(int argc, char **argv)
-{
-    //FIXME: stop storing massive arrays on stack
-    //seriously. disgusting.
-
-    fprintf(stderr, "Increasing stack size...\n");
-
-    const rlim_t kStackSize = 64 * 1024 * 1024; // 64 MB
-    struct rlimit rl;
-    int result;
-
-    result = getrlimit(RLIMIT_STACK, &rl);
-    if (result == 0)
-    {
-        if (rl.rlim_cur < kStackSize)
+        case OPT_MAX_FG:
+        {
+            int maxFg = atoi(optarg);
+            if ((maxFg > 100) || (maxFg < 1))
+            {
+                fprintf(stderr, "max-fg must be in (1..100)\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.maxFgFraction = (float)maxFg / 100.0f;
+            break;
+        }
+        case OPT_GMC:
+        {
+            movedec.globalMotionCompensation = true;
+            break;
+        }
+        case OPT_CPU_BUDGET:
+        {
+            int budget = atoi(optarg);
+            if ((budget > 100) || (budget < 1))
+            {
+                fprintf(stderr, "cpu-budget must be in (1..100)\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.cpuBudget = budget;
+            break;
+        }
+        case OPT_PYRAMID:
+        {
+            movedec.usePyramid = true;
+            break;
+        }
+        case OPT_FRAME_PARALLEL:
+        {
+            movedec.frameParallel = true;
+            break;
+        }
+        case OPT_SEGMENTS:
+        {
+            int segments = atoi(optarg);
+            if (segments < 1)
+            {
+                fprintf(stderr, "number of segments must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.segments = segments;
+            break;
+        }
+        case OPT_TRIAGE:
+        {
+            movedec.triage = true;
+            break;
+        }
+        case OPT_TRIAGE_SAMPLE:
+        {
+            movedec.triage = true;
+            movedec.triageSample = true;
+            break;
+        }
+        case OPT_TRIAGE_CHECK:
+        {
+            movedec.triage = true;
+            movedec.triageCheck = true;
+            break;
+        }
+        case OPT_FROM:
+        case OPT_TO:
+        {
+            if (!ParseRangeBound(optarg, opt == OPT_FROM ? from : to))
+            {
+                fprintf(stderr, "%s must be a frame number or a time as [[hh:]mm:]ss[.fff]\n", opt == OPT_FROM ? "from" : "to");
+                movedec.Help();
+                exit(0);
+            }
+            break;
+        }
+        case OPT_WATCH:
+        {
+            movedec.watchDirs.push_back(optarg);
+            break;
+        }
+        case OPT_WATCH_WORKERS:
+        {
+            int watchWorkers = atoi(optarg);
+            if (watchWorkers < 1)
+            {
+                fprintf(stderr, "watch-workers must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.watchWorkers = watchWorkers;
+            break;
+        }
+        case OPT_FOLLOW:
+        {
+            movedec.follow = true;
+            break;
+        }
+        case OPT_FOLLOW_IDLE:
+        {
+            int idle = atoi(optarg);
+            if (idle < 1)
+            {
+                fprintf(stderr, "follow-idle must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.followIdle = idle;
+            break;
+        }
+        case OPT_PLAYLIST:
+        {
+            if (movedec.LoadPlaylist(optarg) <= 0)
+            {
+                fprintf(stderr, "cannot read recordings from playlist %s\n", optarg);
+                movedec.Help();
+                exit(0);
+            }
+            break;
+        }
+        case OPT_CHECKPOINT:
+        {
+            movedec.checkpointFile = optarg;
+            break;
+        }
+        case OPT_CHECKPOINT_INTERVAL:
+        {
+            int interval = atoi(optarg);
+            if (interval < 1)
+            {
+                fprintf(stderr, "checkpoint-interval must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.checkpointInterval = interval;
+            break;
+        }
+        case OPT_RESUME:
+        {
+            movedec.resume = true;
+            break;
+        }
+        case OPT_MMAP:
+        {
+            movedec.useMmap = true;
+            break;
+        }
+        case OPT_IO_BENCH:
+        {
+            movedec.ioBench = true;
+            break;
+        }
+        case OPT_INGEST:
+        {
+            movedec.ingestSpecs.push_back(optarg);
+            break;
+        }
+        case OPT_INGEST_THREADS:
+        {
+            int threads = atoi(optarg);
+            if (threads < 1)
+            {
+                fprintf(stderr, "ingest-threads must be greater than 0\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.ingestThreads = threads;
+            break;
+        }
+        case OPT_INGEST_QUEUE:
+        {
+            int queue = atoi(optarg);
+            if (queue < 2)
+            {
+                fprintf(stderr, "ingest-queue must be greater than 1\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.ingestQueue = queue;
+            break;
+        }
+        case OPT_INGEST_CODEC:
+        {
+            movedec.ingestCodec = optarg;
+            break;
+        }
+        case OPT_STREAM_CACHE:
+        {
+            if (access(optarg, W_OK | X_OK) < 0)
+            {
+                fprintf(stderr, "stream-cache %s is not a writable directory\n", optarg);
+                movedec.Help();
+                exit(0);
+            }
+            movedec.streamCache = optarg;
+            break;
+        }
+        case OPT_CLIPS:
+        {
+            if (access(optarg, W_OK | X_OK) < 0)
+            {
+                fprintf(stderr, "clips %s is not a writable directory\n", optarg);
+                movedec.Help();
+                exit(0);
+            }
+            movedec.clipDir = optarg;
+            break;
+        }
+        case OPT_CLIP_PRE:
+        case OPT_CLIP_POST:
+        {
+            double seconds = atof(optarg);
+            if (seconds < 0)
+            {
+                fprintf(stderr, "%s cannot be negative\n", opt == OPT_CLIP_PRE ? "clip-pre" : "clip-post");
+                movedec.Help();
+                exit(0);
+            }
+            (opt == OPT_CLIP_PRE ? movedec.clipPreRoll : movedec.clipPostRoll) = seconds;
+            break;
+        }
+        case OPT_OVERLAY:
+        {
+            movedec.overlayFile = optarg;
+            break;
+        }
+        case OPT_OVERLAY_CODEC:
+        {
+            movedec.overlayCodec = optarg;
+            break;
+        }
+        case OPT_OVERLAY_PRESET:
+        {
+            movedec.overlayPreset = optarg;
+            break;
+        }
+        case OPT_MASK_FORMAT:
+        {
+            if (strcmp(optarg, "y4m") == 0)
+                movedec.maskFormat = MASK_FORMAT_Y4M;
+            else if (strcmp(optarg, "grid") == 0)
+                movedec.maskFormat = MASK_FORMAT_GRID;
+            else if (strcmp(optarg, "video") == 0)
+                movedec.maskFormat = MASK_FORMAT_VIDEO;
+            else
+            {
+                fprintf(stderr, "mask-format must be y4m, grid or video\n");
+                movedec.Help();
+                exit(0);
+            }
+            break;
+        }
+        case OPT_UNPACK_MASK:
+        {
+            unpackMask = optarg;
+            break;
+        }
+        case OPT_MASK_CODEC:
+        {
+            movedec.maskCodec = optarg;
+            break;
+        }
+        case OPT_REPORT:
         {
-            rl.rlim_cur = kStackSize;
-            result = setrlimit(RLIMIT_STACK, &rl);
-            if (result != 0)
+            if (!OutputQueue::IsStreamTarget(optarg))
             {
-                fprintf(stderr, "setrlimit returned result = %d\n", result);
-                return result;
+                fprintf(stderr, "report %s is not stdout, unix:<path>, a FIFO or a socket\n", optarg);
+                movedec.Help();
+                exit(0);
             }
+            movedec.reportTarget = optarg;
+            movedec.movemask_std_flag = 1;
+            break;
+        }
+        case OPT_OUTPUT_POLICY:
+        {
+            if (strcmp(optarg, "block") == 0)
+                movedec.outputPolicy = OutputQueue::BLOCK;
+            else if (strcmp(optarg, "drop-oldest") == 0)
+                movedec.outputPolicy = OutputQueue::DROP_OLDEST;
+            else if (strcmp(optarg, "drop-masks") == 0)
+                movedec.outputPolicy = OutputQueue::DROP_MASKS;
+            else
+            {
+                fprintf(stderr, "output-policy must be block, drop-oldest or drop-masks\n");
+                movedec.Help();
+                exit(0);
+            }
+            break;
+        }
+        case OPT_OUTPUT_QUEUE:
+        {
+            int megabytes = atoi(optarg);
+            if (megabytes < 1)
+            {
+                fprintf(stderr, "output-queue must be at least 1 MB\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.outputQueueBytes = (size_t)megabytes << 20;
+            break;
+        }
+        case OPT_SHM:
+        {
+            movedec.resultRingName = optarg;
+            break;
+        }
+        case OPT_SHM_SLOTS:
+        {
+            int slots = atoi(optarg);
+            //a reader takes the newest slot while the writer fills the next one
+            if (slots < 2)
+            {
+                fprintf(stderr, "shm-slots must be at least 2\n");
+                movedec.Help();
+                exit(0);
+            }
+            movedec.resultRingSlots = slots;
+            break;
+        }
+        case OPT_EVENTS:
+        {
+            movedec.eventTarget = optarg;
+            break;
+        }
+        case OPT_EVENTS_FORMAT:
+        {
+            if (strcmp(optarg, "binary") == 0)
+                movedec.eventFormat = EVENT_FORMAT_BINARY;
+            else if (strcmp(optarg, "json") == 0)
+                movedec.eventFormat = EVENT_FORMAT_JSON;
+            else
+            {
+                fprintf(stderr, "events-format must be binary or json\n");
+                movedec.Help();
+                exit(0);
+            }
+            break;
+        }
+        case OPT_LOG_LEVEL:
+        {
+            int level = Logger::LevelFromName(optarg);
+            if (level < 0)
+            {
+                fprintf(stderr, "log-level must be error, warning, info, frame or debug\n");
+                movedec.Help();
+                exit(0);
+            }
+            Logger::SetLevel(level);
+            break;
+        }
+        }
+    }
+    //the governor changes the grid under frames that are still being analysed
+    if (movedec.frameParallel && movedec.cpuBudget)
+    {
+        fprintf(stderr, "frame-parallel cannot be combined with cpu-budget\n");
+        movedec.Help();
+        exit(0);
+    }
+    //triage picks its own ranges
+    if (movedec.triage && (from.set || to.set))
+    {
+        fprintf(stderr, "from/to cannot be combined with triage\n");
+        movedec.Help();
+        exit(0);
+    }
+    if (movedec.resume && movedec.checkpointFile.empty())
+    {
+        fprintf(stderr, "resume needs the checkpoint file\n");
+        movedec.Help();
+        exit(0);
+    }
+    //segments join their mask files, a checkpoint truncates it; neither works on an encoded stream
+    if (movedec.maskFormat == MASK_FORMAT_VIDEO && (movedec.triage || movedec.segments > 1 || !movedec.checkpointFile.empty()))
+    {
+        fprintf(stderr, "mask-format video cannot be combined with segments, triage or checkpoints\n");
+        movedec.Help();
+        exit(0);
+    }
+    //a stream can neither be cut back, nor joined from parts, nor rewound
+    const bool maskStream = movedec.movemask_file_flag && OutputQueue::IsStreamTarget(movedec.mask_filename);
+    if (maskStream && (movedec.maskFormat == MASK_FORMAT_VIDEO || movedec.triage || movedec.segments > 1 ||
+                       !movedec.checkpointFile.empty() || unpackMask))
+    {
+        fprintf(stderr, "a stream -o cannot be combined with mask-format video, segments, triage, checkpoints or unpack-mask\n");
+        movedec.Help();
+        exit(0);
+    }
+    //the report stream is the one of a single detector
+    if (!movedec.reportTarget.empty() && (movedec.triage || movedec.segments > 1 || !movedec.watchDirs.empty() ||
+                                          !movedec.ingestSpecs.empty() || movedec.reportTarget == movedec.mask_filename))
+    {
+        fprintf(stderr, "report cannot be combined with segments, triage, watch or ingest, nor share the target of -o\n");
+        movedec.Help();
+        exit(0);
+    }
+    //one ring is written by one detector, frame by frame
+    if (!movedec.resultRingName.empty() && (movedec.triage || movedec.segments > 1 || !movedec.watchDirs.empty() ||
+                                            !movedec.ingestSpecs.empty()))
+    {
+        fprintf(stderr, "shm cannot be combined with segments, triage, watch or ingest\n");
+        movedec.Help();
+        exit(0);
+    }
+    //a resumed run would repeat the records after the checkpoint
+    const bool eventStream = !movedec.eventTarget.empty() && OutputQueue::IsStreamTarget(movedec.eventTarget.c_str());
+    if (!movedec.eventTarget.empty() && (movedec.triage || movedec.segments > 1 || !movedec.watchDirs.empty() ||
+                                         !movedec.ingestSpecs.empty() || movedec.resume || movedec.eventTarget == movedec.mask_filename ||
+                                         movedec.eventTarget == movedec.reportTarget))
+    {
+        fprintf(stderr, "events cannot be combined with segments, triage, watch, ingest or resume, nor share the target of -o or report\n");
+        movedec.Help();
+        exit(0);
+    }
+    if (maskStream || !movedec.reportTarget.empty())
+        movedec.OpenStreamOutputs(maskStream);
+    if (!movedec.eventTarget.empty() && movedec.OpenEvents(eventStream) < 0)
+        exit(0);
+    //the mask video is opened by its muxer
+    if (movedec.movemask_file_flag && movedec.maskFormat != MASK_FORMAT_VIDEO && !maskStream)
+    {
+        const char *mode = movedec.resume && access(movedec.mask_filename, F_OK) == 0 ? "r+b" : "wb";
+        if ((movedec.fvideomask_desc = fopen(movedec.mask_filename, mode)) == NULL)
+        {
+            fprintf(stderr, "Error while opening mask videostream  %s\n", movedec.mask_filename);
+            movedec.movemask_file_flag = 0;
         }
     }
+    //a conversion of an earlier run's output, no input stream is read
+    if (unpackMask)
+    {
+        if (!movedec.movemask_file_flag)
+        {
+            fprintf(stderr, "unpack-mask needs the output file (-o)\n");
+            movedec.Help();
+            exit(0);
+        }
+        movedec.UnpackGridMask(unpackMask, movedec.fvideomask_desc);
+        movedec.Close();
+        return;
+    }
+    //the packets read to check the cache are only replayed to a straight run
+    if (!movedec.streamCache.empty() && (movedec.triage || movedec.segments > 1))
+    {
+        fprintf(stderr, "stream-cache cannot be combined with segments or triage\n");
+        movedec.Help();
+        exit(0);
+    }
+    //the other modes open the input again or need its full length
+    if (movedec.follow && (movedec.triage || movedec.segments > 1 || !movedec.watchDirs.empty() || movedec.useMmap))
+    {
+        fprintf(stderr, "follow cannot be combined with watch, segments, triage or mmap\n");
+        movedec.Help();
+        exit(0);
+    }
+    //clips and the overlay are written in one sequential pass over one input
+    if (!movedec.clipDir.empty() && (movedec.triage || movedec.segments > 1 || !movedec.checkpointFile.empty()))
+    {
+        fprintf(stderr, "clips cannot be combined with segments, triage or checkpoints\n");
+        movedec.Help();
+        exit(0);
+    }
+    if (!movedec.overlayFile.empty() && (movedec.triage || movedec.segments > 1 || !movedec.checkpointFile.empty() ||
+                                         !movedec.watchDirs.empty() || !movedec.ingestSpecs.empty()))
+    {
+        fprintf(stderr, "overlay cannot be combined with segments, triage, checkpoints, watch or ingest\n");
+        movedec.Help();
+        exit(0);
+    }
+    movedec.nSectors = -1;
+    //ingest mode: live streams without a container, there is nothing to seek or cut
+    if (!movedec.ingestSpecs.empty())
+    {
+        if (!movedec.watchDirs.empty() || movedec.follow || movedec.triage || movedec.segments > 1 || from.set || to.set ||
+            movedec.movemask_file_flag || !movedec.checkpointFile.empty() || !movedec.clipDir.empty())
+        {
+            fprintf(stderr, "ingest cannot be combined with watch, follow, -o, segments, triage, from/to, checkpoints or clips\n");
+            movedec.Help();
+            exit(0);
+        }
+        movedec.MainIngest();
+        movedec.Close();
+        return;
+    }
+    //watch mode: every recording is a plain whole-file run
+    if (!movedec.watchDirs.empty())
+    {
+        if (movedec.triage || movedec.segments > 1 || from.set || to.set || movedec.movemask_file_flag)
+        {
+            fprintf(stderr, "watch cannot be combined with -o, segments, triage or from/to\n");
+            movedec.Help();
+            exit(0);
+        }
+        movedec.MainWatch();
+        movedec.Close();
+        return;
+    }
+    //several input streams are a playlist as well, ahead of the --playlist entries
+    movedec.playlist.insert(movedec.playlist.begin(), argv + optind, argv + argc);
+    if (movedec.playlist.size() > 1 && (movedec.triage || movedec.segments > 1 || movedec.follow || from.set || to.set ||
+                                        !movedec.clipDir.empty()))
+    {
+        fprintf(stderr, "a playlist cannot be combined with segments, triage, follow, from/to or clips\n");
+        movedec.Help();
+        exit(0);
+    }
+    //checkpoints hold the state of one detector on one input
+    if (!movedec.checkpointFile.empty() && (movedec.playlist.size() > 1 || movedec.triage || movedec.segments > 1))
+    {
+        fprintf(stderr, "checkpoint cannot be combined with a playlist, segments or triage\n");
+        movedec.Help();
+        exit(0);
+    }
+    const char *gfilename = movedec.playlist.empty() ? NULL : movedec.playlist[0].c_str();
+    if (!gfilename)
+    {
+        fprintf(stderr, "No input stream provided\n");
+        exit(0);
+    }
+    if (movedec.OpenVideoFile(gfilename) < 0)
+    {
+        if (strcmp(gfilename, "perftest") == 0)            
+        {
+            fprintf(stderr, "Performing a performance test for a 1280x720 empty stream \n");
+            movedec.perfTest = true;
+        }
+        else
+        {
+            fprintf(stderr, "Error while opening orig videostream %s\n", gfilename);
+            movedec.Help();
+            exit(0);
+        }
+    }
+    if (!movedec.perfTest)
+    {
+        if (from.set)
+            movedec.rangeStart = from.isTime ? movedec.SecondsToFrame(from.value) : (int64_t)from.value;
+        if (to.set)
+            movedec.rangeEnd = to.isTime ? movedec.SecondsToFrame(to.value) : (int64_t)to.value;
+        if (movedec.rangeEnd <= movedec.rangeStart)
+        {
+            fprintf(stderr, "to must be after from\n");
+            movedec.Help();
+            exit(0);
+        }
+    }
+    if (movedec.ioBench && !movedec.perfTest)
+        movedec.MainIOBench(gfilename);
+    else if (movedec.triage && !movedec.perfTest)
+        movedec.MainDecTriage(gfilename);
+    else if (movedec.segments > 1 && !movedec.perfTest)
+        movedec.MainDecSegments(gfilename);
+    else
+        movedec.MainDec();
+    movedec.Close();
+}
 
+int main(int argc, char **argv)
+{
     Initialize(argc, argv);
+    Logger::Stop();
 
     return 0;
 }
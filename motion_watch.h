@@ -2,12 +2,24 @@
 #define MOTION_WATCH_H_
 
 #include <iostream>
+#include <chrono>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/resource.h>
 #include <vector>
 #include <list>
+#include <map>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+
+#include "mv_grid.h"
+#include "mv_threadpool.h"
+#include "mv_outqueue.h"
+#include "mv_shmring.h"
+#include "mv_events.h"
+#include "mv_log.h"
 
 extern "C"
 {
@@ -39,17 +51,41 @@ extern "C"
 #define CODEC_TYPE_VIDEO AVMEDIA_TYPE_VIDEO
 
 // program defines
-#define MAX_MAP_SIDE 500
 #define MAX_FILENAME 600
 #define MAX_CONNAREAS 1000
 #define AREABUFFER_SIZE 3
 #define USE_YUV2MPEG2 1
+#define MASK_FORMAT_Y4M 0
+#define MASK_FORMAT_GRID 1
+#define MASK_FORMAT_VIDEO 2
+#define MASK_CODEC "ffv1"
+#define GRID_MASK_MAGIC "MVGRID1"
 
 //default values
 #define BIN_THRESHOLD 10
 //#define CONSIST_THRESHOLD 10
 #define PACKET_SKIP 1
+#define ANALYSIS_STRIDE 1
 #define USE_SQUARE 0
+#define MAX_AREAS 250
+#define MAX_TRACKERS 64
+#define MAX_FG_PERCENT 60
+#define WORKER_THREADS 1
+#define WARMUP_FRAMES 8
+#define WATCH_WORKERS 4
+#define FOLLOW_IDLE_SECONDS 30
+#define INGEST_THREADS 2
+#define INGEST_QUEUE 64
+#define CLIP_PRE_ROLL 3
+#define OVERLAY_CODEC "libx264"
+#define OVERLAY_PRESET "veryfast"
+#define CLIP_POST_ROLL 5
+#define CHECKPOINT_INTERVAL 60
+#define OUTPUT_QUEUE_MB 16
+#define SHM_SLOTS 8
+#define EVENT_FORMAT_BINARY 0
+#define EVENT_FORMAT_JSON 1
+#define EVENT_BUFFER_KB 256
 
 //why even use enums?
 #define MORPH_OP_ERODE 0
@@ -77,16 +113,29 @@ extern "C"
 #define TRACKERSTATUS_LOST 16
 #define TRACKERSTATUS_MERGE 32
 
+#define GOVERNOR_HOLD_UP 50
+#define GOVERNOR_LEVELS 4
+#define GOVERNOR_LEVEL_FULL 0
+#define GOVERNOR_LEVEL_POOLED 1
+#define GOVERNOR_LEVEL_SUBSAMPLED 2
+#define GOVERNOR_LEVEL_NO_SPATIAL 3
+
+#define PYRAMID_BLOCK_SIZE 16
+
+//slots of the MV ring; the ring holds ringSize frames, AREABUFFER_SIZE of them form the temporal window
 #define BUFFER_NEXT(a) a
-#define BUFFER_CURR(a) (((a - 1) % AREABUFFER_SIZE) + AREABUFFER_SIZE) % AREABUFFER_SIZE
-#define BUFFER_PREV(a) (((a - 2) % AREABUFFER_SIZE) + AREABUFFER_SIZE) % AREABUFFER_SIZE
-#define BUFFER_OFFSET(a, b) (((a - (1 + b)) % AREABUFFER_SIZE) + AREABUFFER_SIZE) % AREABUFFER_SIZE
-#define BUFFER_OLDEST(a) (((a + 1) % AREABUFFER_SIZE) + AREABUFFER_SIZE) % AREABUFFER_SIZE
+#define BUFFER_CURR(a) (((a - 1) % ringSize) + ringSize) % ringSize
+#define BUFFER_PREV(a) (((a - 2) % ringSize) + ringSize) % ringSize
+#define BUFFER_OFFSET(a, b) (((a - (1 + b)) % ringSize) + ringSize) % ringSize
+#define BUFFER_OLDEST(a) BUFFER_OFFSET(a, AREABUFFER_SIZE - 2)
 
 #define ROLLINGAVG(oldv, newv, lastsize) (newv + lastsize * oldv) / (lastsize + 1)
 
 using namespace std;
 
+//the encoding thread of a mask video, mv_maskvideo.cpp
+struct maskEncoder;
+
 class MoveDetector
 {
 
@@ -104,6 +153,31 @@ class MoveDetector
         float x, y;
     };
 
+    //cells of a grid that a processing stage visits: [colBegin, colEnd) of every row
+    struct gridSpan
+    {
+        int rows, cols;
+        std::vector<int> colBegin;
+        std::vector<int> colEnd;
+
+        void SetFull(int r, int c)
+        {
+            rows = r;
+            cols = c;
+            colBegin.resize(r);
+            colEnd.resize(r);
+            for (int i = 0; i < r; i++)
+            {
+                colBegin[i] = 0;
+                colEnd[i] = c;
+            }
+        }
+        bool Contains(int x, int y) const
+        {
+            return y >= 0 && y < rows && x >= colBegin[y] && x < colEnd[y];
+        }
+    };
+
     struct connectedArea
     {
 		int id;
@@ -126,6 +200,25 @@ class MoveDetector
         int appearances;
     };
 
+    // dominant camera motion in a frame, in pixels per cell offset from the grid centre:
+    // mvX = a[0] + a[1] * x + a[2] * y, mvY = a[3] + a[4] * x + a[5] * y
+    struct globalMotionModel
+    {
+        float a[6];
+        float inlierRatio;
+        bool applied;
+    };
+
+    // what was thrown away to keep a frame inside its work budget
+    struct degradationCounters
+    {
+        int areaOverflowFrames;
+        int areasDropped;
+        int trackerOverflowFrames;
+        int trackersRefused;
+        int globalMotionFrames;
+    };
+
     struct trackedObject
     {
         int trackerID;
@@ -184,32 +277,157 @@ class MoveDetector
         }
     };
 
+    // per-frame report, stderr unless a segment run buffers it
+    FILE *logFile;
+
     // debug file
 	FILE *fvideo_desc;
 	FILE *fvideomask_desc;
 	char mask_filename[MAX_FILENAME];
+    int maskFormat;
+    std::string maskCodec;
+    maskEncoder *maskVideo;
 	int movemask_file_flag;
 	int movemask_std_flag;
 
-	// memory
-	//int mvGridSum[MAX_MAP_SIDE][MAX_MAP_SIDE];
-	float mvGridArg[MAX_MAP_SIDE][MAX_MAP_SIDE];
-	float mvGridMag[MAX_MAP_SIDE][MAX_MAP_SIDE];
-	//coordinate mvGridCoords[MAX_MAP_SIDE][MAX_MAP_SIDE];
+    // streaming outputs: -o and --report to stdout, a FIFO or a Unix socket are written through a memory
+    // stream into a bounded queue, a writer thread of its own feeds the reader
+    std::unique_ptr<OutputQueue> maskOutput;
+    std::unique_ptr<OutputQueue> reportOutput;
+    std::string reportTarget;
+    OutputQueue::Policy outputPolicy;
+    size_t outputQueueBytes;
+    char *maskStreamBuffer;
+    size_t maskStreamSize;
+    FILE *reportStream;
+    char *reportStreamBuffer;
+    size_t reportStreamSize;
+
+    // shared memory ring: the labels, areas and trackers of every reported frame for local readers
+    std::string resultRingName;
+    int resultRingSlots;
+    std::unique_ptr<ShmRingWriter> resultRing;
+    bool resultRingFailed;
+    int resultRingFrames;
+    int resultRingSkipped;
+
+    // event stream: a record per reported frame with its areas and trackers, binary or JSON lines, to a
+    // file through a large stdio buffer or to a stream through an OutputQueue
+    std::string eventTarget;
+    int eventFormat;
+    FILE *eventFile;
+    std::unique_ptr<OutputQueue> eventOutput;
+    std::vector<char> eventRecord;
+    bool eventHeaderWritten;
+    int eventFrames;
+    int64_t eventBytes;
+
+    struct projectionBand
+    {
+        int rowBegin;
+        int rowEnd;
+        Grid<int> count;
+        Grid<coordinateF> sum;
+    };
+
+    // everything the per-frame stages write apart from the frame's own ring slot,
+    // one per frame that is analysed concurrently
+    struct frameWorkspace
+    {
+        int frameBuffer;
+        gridSpan fineSpan;
+        gridSpan coarseSpan;
+
+        Grid<float> mvGridArg;
+        Grid<float> mvGridMag;
+        Grid<coordinateF> bwProjected;
+        Grid<coordinateF> fwProjected;
+        Grid<float> similarityBW;
+        Grid<float> similarityFW;
+        Grid<float> similarityBWFW;
+        Grid<int> areaFgMarked;
+
+        // scratch
+        Grid<int> mvMask;
+        Grid<int> mvMaskTemp;
+        Grid<int> markedTemp;
+        Grid<int> holeLabels;
+        std::vector<int> labelParent;
+        std::vector<int> labelRemap;
+        std::vector<projectionBand> projectionBands;
+
+        Grid<float> coarseGridArg;
+        Grid<float> coarseGridMag;
+        Grid<coordinateF> coarseBwProjected;
+        Grid<coordinateF> coarseFwProjected;
+        Grid<float> coarseSimilarityBW;
+        Grid<float> coarseSimilarityFW;
+        Grid<float> coarseSimilarityBWFW;
+        Grid<int> coarseFgMarked;
+
+        // counted for this frame only, summed up by the tracker stage
+        degradationCounters degradation;
+        long pyramidFrames;
+        double pyramidCells;
+    };
+
+    // demux-only summary of a GOP for triage
+    struct gopInfo
+    {
+        int64_t startFrame;
+        int64_t endFrame;
+        int interPackets;
+        int64_t interBytes;
+        float movingFraction;
+        bool active;
+    };
 
-    int areaGridMarked[AREABUFFER_SIZE][MAX_MAP_SIDE][MAX_MAP_SIDE];
-    connectedArea areaBuffer[AREABUFFER_SIZE][MAX_CONNAREAS];
-    coordinate mvGridCoords[AREABUFFER_SIZE][MAX_MAP_SIDE][MAX_MAP_SIDE];
-    int subMbTypes[AREABUFFER_SIZE][MAX_MAP_SIDE][MAX_MAP_SIDE];
+    // frame handed to the analysis, waiting for its batch to be flushed
+    struct pendingFrame
+    {
+        int frameBuffer;
+        int delayedFrame;
+        int maskRepeat;     //mask frames written for it, the headers hold the rate of analysisStride
+    };
 
-    coordinateF bwProjected[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    coordinateF fwProjected[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    float similarityBW[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    float similarityFW[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    float similarityBWFW[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    int areaFgMarked[MAX_MAP_SIDE][MAX_MAP_SIDE];
+	// MV ring, sized by AllocAnalyzeBuffers() for the unpooled grid
+    int ringSize;
+    std::vector<Grid<int>> areaGridMarked;
+    Grid<connectedArea> areaBuffer;
+    std::vector<Grid<coordinate>> mvGridCoords;
+    std::vector<Grid<int>> subMbTypes;
+
+    Grid<uint8_t> maskFrameY;
+    Grid<uint8_t> maskFrameU;
+    Grid<uint8_t> maskFrameV;
+    // cell value of every live tracker in a grid mask, kept for as long as it lives
+    std::map<int, uint8_t> gridValues;
+
+    // tile-parallel grid stages, or whole frames in parallel with frameParallel
+    int workerThreads;
+    bool frameParallel;
+    std::unique_ptr<ThreadPool> workers;
+    std::vector<frameWorkspace> workspaces;
+    std::vector<pendingFrame> pendingFrames;
+
+    // coarse-to-fine pyramid: 16x16 field pooled from the analysis grid
+    bool usePyramid;
+    int pyramidFactor;
+    long pyramidFrames;
+    double pyramidCells;
+    std::vector<Grid<coordinate>> mvCoarseCoords;
 
     list<trackedObject> trackedObjects;
+    //area ids, per detector so that segments do not share it and a checkpoint can store it
+    std::minstd_rand idRandom;
+    //not vector<bool>: slots are written by frames analysed concurrently
+    std::vector<char> globalMotionFrame;
+    //more areas than maxAreas were labelled, the smallest were dropped
+    std::vector<char> truncatedFrame;
+    std::vector<globalMotionModel> globalMotion;
+    std::vector<float> mvFrameScale;
+    //decoded frame number of the MVs in each slot; with a stride or a skipped I-frame it is not the slot before's + 1
+    std::vector<int> slotFrameNumber;
 
     int currFrameBuffer;
     int delayedFrameNumber;
@@ -237,6 +455,27 @@ class MoveDetector
     float beta;
     int sizeThreshold;
 
+    // per-frame work budgets
+    int maxAreas;
+    int maxTrackers;
+    float maxFgFraction;
+    degradationCounters degradation;
+    bool globalMotionCompensation;
+
+    // CPU-budget governor
+    int cpuBudget;
+    int governorLevel;
+    float governorLoad;
+    int governorOverCount;
+    int governorUnderCount;
+    int governorChanges;
+    int governorHoldUp;
+    int governorLevelAge;
+    bool governorSteppedUp;
+    int governorLevelFrames[GOVERNOR_LEVELS];
+    double frameInterval;
+    int gridPooling;
+
     int mb_stride;
 	int mv_sample_log2;
 	int mv_stride;
@@ -255,54 +494,282 @@ class MoveDetector
 	int count;
 	double sum;
 	int packet_skip;
+	int analysisStride;
+	int lastDecodedFrame;
+	int lastAnalysedFrame;
 	int useSquareElement;
 	int binThreshold;
     bool perfTest;
+    int processedFrames;
+
+    // frames [rangeStart, rangeEnd) are reported; decoding starts at the keyframe before
+    // rangeStart - WARMUP_FRAMES and analysis at that frame, so the temporal window and
+    // the tracker are warm by rangeStart
+    int64_t rangeStart;
+    int64_t rangeEnd;
+
+    // GOP-parallel run: the recording is cut at keyframes into segments, each with its own detector
+    int segments;
+    int segmentIndex;
+    int warmUpFrames;
+    int reportedFrames;
+    list<trackedObject> headTrackers;
+    list<trackedObject> tailTrackers;
+    //tracker IDs of a segment that continue a tracker of the one before, and the ID they are joined under
+    std::map<int, int> stitchedIDs;
+
+    // triage: only GOPs that look active from their packet sizes are decoded
+    bool triage;
+    bool triageSample;
+    bool triageCheck;
+    bool recordDetections;
+    std::vector<int> detectedFrames;
+
+    // follow mode: the input is read through an AVIOContext that waits for appended data at EOF
+    struct followInput
+    {
+        int fd;
+        int notifyFd;
+        int idleSeconds;
+        bool rotated;
+    };
+    bool follow;
+    int followIdle;
+    followInput followSource;
+    AVIOContext *followIO;
+
+    // local input read from a memory mapping instead of the file protocol
+    bool useMmap;
+    bool ioBench;
+    AVIOContext *mmapIO;
+
+    // clips: the active stretches of the input remuxed to files of their own, keyframe to keyframe
+    std::string clipDir;
+    double clipPreRoll;
+    double clipPostRoll;
+    int lastReportedFrame;
+    int lastMotionFrame;
+    FILE *clipList;
+    AVFormatContext *clipCtx;
+    std::string clipBase;
+    std::string clipExtension;
+    std::string clipFile;
+    std::vector<int> clipStreamMap;
+    std::deque<AVPacket *> clipBuffer;
+    std::deque<int64_t> clipBufferKeys;
+    int64_t clipPreFrames;
+    int64_t clipPostFrames;
+    int64_t clipStartTs;
+    int64_t clipLastTs;
+    int clipCoveredFrame;
+    int clipCount;
+    int64_t clipBytes;
+    int64_t clipInputBytes;
+    double clipSeconds;
+
+    // overlay: the mask drawn on the decoded source frames and encoded in the same pass
+    std::string overlayFile;
+    std::string overlayCodec;
+    std::string overlayPreset;
+    AVFormatContext *overlayCtx;
+    AVCodecContext *overlayEnc;
+    std::deque<std::pair<int, AVFrame *>> overlayFrames;
+    bool overlayFailed;
+    int overlayCount;
+    int overlaySkipped;
+
+    // stream parameter cache: sources opened before skip most of the probing
+    std::string streamCache;
+    AVCodecParameters *cachedParams;
+    AVRational cachedFrameRate;
+    std::string cachedDemuxer;
+    std::deque<AVPacket *> probedPackets;
+
+    // playlist: consecutive recordings run through one decoder and detector, frame numbers continue
+    std::vector<std::string> playlist;
+    size_t playlistIndex;
+    int64_t inputFrameOffset;
+    bool inputSwitched;
+
+    // checkpoint/resume: the analysis state at a keyframe, with the counters of MainDec's loop
+    struct checkpointPosition
+    {
+        int64_t keyTimestamp;
+        int packetNumber;
+        int interFrames;
+        int processedFrames;
+        int64_t maskOffset;
+    };
+    // counters of one decode loop over a stream, MainDec's and those of the ingest workers
+    struct decodeLoop
+    {
+        int packetNumber;
+        int interFrames;
+        int processedFrames;
+        int64_t processingTime;
+        std::chrono::high_resolution_clock::time_point start;
+    };
+    std::string checkpointFile;
+    int checkpointInterval;
+    bool resume;
+
+    // watch-folder daemon: new recordings are queued to detectors that are reused from file to file
+    std::vector<std::string> watchDirs;
+    int watchWorkers;
+
+    // live ingestion: raw streams from FIFOs and sockets, read by a few epoll threads and analysed
+    // by the watch workers, a detector per input
+    std::vector<std::string> ingestSpecs;
+    int ingestThreads;
+    int ingestQueue;
+    std::string ingestCodec;
 
     // funcs
     void SetFileParams(char *gfilename, int gsector_size, char *gout_filename, int gsensivity, int gamplify);
-    void WriteMaskFile(FILE *file);
-    void WriteFrameToFile(FILE *file, uint8_t Y[][MAX_MAP_SIDE], uint8_t U[][MAX_MAP_SIDE], uint8_t V[][MAX_MAP_SIDE]);
+    void LabelMaskCells();
+    void RenderMask(const Grid<int> &labels, const list<trackedObject> &trackers);
+    void WriteFrameToFile(FILE *file, Grid<uint8_t> &Y, Grid<uint8_t> &U, Grid<uint8_t> &V);
     void WriteMPEG2Header(FILE *file);
-    void WriteMapConsole();
+    void WriteGridHeader(FILE *file);
+    void AssignGridValues(const list<trackedObject> &trackers);
+    void WriteGridFrame(FILE *file, const Grid<int> &cells, const list<trackedObject> &trackers);
+    void WriteMaskHeader(FILE *file);
+    void PrintMaskHint();
+    int OpenMaskVideo();
+    void QueueMaskFrame();
+    void CloseMaskVideo();
+    int UnpackGridMask(const char *filename, FILE *out);
+    void WriteMapConsole(FILE *file);
+    void OpenStreamOutputs(bool maskStream);
+    void PushStreamOutput(OutputQueue *queue, FILE *stream, char *&buffer, OutputQueue::Kind kind);
+    void CloseStreamOutputs();
+    void PublishResults();
+    void CloseResultRing();
+    static resultArea AreaRecord(const connectedArea &a);
+    static resultTracker TrackerRecord(const trackedObject &t);
+    int OpenEvents(bool stream);
+    void WriteEventHeader();
+    void WriteEvents();
+    void CloseEvents();
     void Help(void);
 	void AllocBuffers(void);
 	void AllocAnalyzeBuffers(void);
 	int OpenVideoFile(const char *filename);
+    int OpenInputStream(const char *filename, bool cached);
+    void CloseInput();
+    std::string StreamCacheFile(const char *filename);
+    void CachedProbeOptions(AVDictionary **options);
+    bool LoadStreamParams(const char *filename);
+    void SaveStreamParams(const char *filename);
+    void ApplyStreamParams(AVStream *st);
+    bool CheckStreamParams();
+    int ReadPacket(AVPacket *packet);
+    void DropProbedPackets();
+    int OpenDecoder(AVCodec *dec, const AVCodecParameters *par);
+    int LoadPlaylist(const char *filename);
+    bool NextPlaylistInput(decodeLoop &loop);
+    int SaveCheckpoint(checkpointPosition &position);
+    int LoadCheckpoint(checkpointPosition &position);
     int decode(AVCodecContext *avctx, AVFrame *frame, int *got_frame, AVPacket *pkt);
 
     void MainDec();
+    void StartDecodeLoop(decodeLoop &loop);
+    int DecodePacket(AVPacket &packet, decodeLoop &loop);
+    int AnalyseFrame(decodeLoop &loop);
+    int DrainDecoder(decodeLoop &loop);
+    void FinishDecodeLoop(decodeLoop &loop);
+    void MainDecSegments(const char *filename);
+    void MainDecTriage(const char *filename);
+    void CopySettings(const MoveDetector &other);
+    void ResetStreamState();
+    void MainWatch();
+    void ProcessWatchedFile(const std::string &path);
+    void MainIngest();
+    int OpenFollowInput(const char *filename);
+    void CloseFollowInput();
+    AVIOContext *OpenMappedInput(const char *filename);
+    void CloseMappedInput(AVIOContext *&io);
+    int OpenInputFormat(const char *filename, AVFormatContext *&ctx, AVIOContext *&io, AVDictionary **options);
+    void MainIOBench(const char *filename);
+    int64_t SecondsToFrame(double seconds);
     void MvScanFrame(int index, AVFrame *pict, AVCodecContext *ctx);
     void MvScanFrameH(int index, AVFrame *pict, AVCodecContext *ctx);
 
     void Close(void);
+    int AnalysisStride() const;
 
   private:
     void MotionFieldProcessing();
-
-    void CalculateMagAng();
-    void MorphologyProcess();
-    void ErodeDilate(int kernelSize, int operation, int (*inputArray)[MAX_MAP_SIDE], int (*outputArray)[MAX_MAP_SIDE]);
-	void DetectConnectedAreas(int (*inputArray)[MAX_MAP_SIDE], int (*outputArray)[MAX_MAP_SIDE]);
-    void DetectConnectedAreas2(int (*inputArray)[MAX_MAP_SIDE], int (*outputArray)[MAX_MAP_SIDE]);
-    void ProcessConnectedAreas(int (*markedAreas)[MAX_MAP_SIDE], connectedArea (&processedAreas)[MAX_CONNAREAS]);
+    void FlushPendingFrames();
+    void PrepareBufferedFrame(int bufferIndex);
+    void AnalyseFrame(frameWorkspace &ws);
+
+    int TileCount(int rows) const;
+    void RunTiles(int tiles, const std::function<void(int)> &job);
+    void ForEachTile(int rows, const std::function<void(int, int)> &job);
+    void CalculateMagAng(Grid<coordinate> &mvGrid, Grid<float> &mag, Grid<float> &arg, const gridSpan &span);
+    void MorphologyProcess(frameWorkspace &ws);
+    void ErodeDilate(int kernelSize, int operation, Grid<int> &inputArray, Grid<int> &outputArray, const gridSpan &span);
+	void DetectConnectedAreas(Grid<int> &inputArray, Grid<int> &outputArray);
+    int DetectConnectedAreas2(frameWorkspace &ws, Grid<int> &inputArray, Grid<int> &outputArray, const gridSpan &span);
+    int LimitConnectedAreas(frameWorkspace &ws, Grid<int> &markedAreas, int labelsCount);
+    bool IsGlobalMotion(frameWorkspace &ws);
+    void ProcessConnectedAreas(frameWorkspace &ws, Grid<int> &markedAreas, connectedArea *processedAreas);
 
     void TrackAreas();
     void TrackedAreasFiltering();
     //void SpatialConsistProcess();
 
-    void TemporalConsistProcess();
-    void ProjectMVectors(coordinate mVectors[][MAX_MAP_SIDE], coordinateF projected[][MAX_MAP_SIDE], int projectionDir = 1);
-    void CalculateSimilarity(coordinate currentMV[][MAX_MAP_SIDE], coordinateF projectedMV[][MAX_MAP_SIDE], float metricOut[][MAX_MAP_SIDE]);
-    void CalculateSimilarity(coordinateF currentMV[][MAX_MAP_SIDE], coordinateF projectedMV[][MAX_MAP_SIDE], float metricOut[][MAX_MAP_SIDE]);
-    void DetectForeground();
-    void SpatialFilter(int marked[][MAX_MAP_SIDE]);
+    bool EstimateGlobalMotion(int bufferIndex, globalMotionModel &model);
+    void CompensateGlobalMotion(int bufferIndex);
+
+    void TemporalConsistProcess(frameWorkspace &ws);
+    void ProjectMVectors(frameWorkspace &ws, Grid<coordinate> &mVectors, Grid<coordinateF> &projected, const gridSpan &span, int projectionDir = 1, float mvScale = 1.0f);
+    void CalculateSimilarity(Grid<coordinate> &currentMV, Grid<coordinateF> &projectedMV, Grid<float> &metricOut, const gridSpan &span);
+    void CalculateSimilarity(Grid<coordinateF> &currentMV, Grid<coordinateF> &projectedMV, Grid<float> &metricOut, const gridSpan &span);
+    void DetectForeground(Grid<float> &similarityFW, Grid<float> &similarityBW, Grid<float> &similarityBWFW,
+                          Grid<coordinateF> &fwProjected, Grid<float> &mvGridMag, Grid<int> &areaFgMarked, const gridSpan &span);
+    void SpatialFilter(frameWorkspace &ws, Grid<int> &marked, const gridSpan &span);
+
+    void BuildCoarseFrame(int bufferIndex);
+    void CoarseForegroundProcess(frameWorkspace &ws);
+
+    void UpdateGovernor(int64_t processingTime);
+    void SetGovernorLevel(int level);
+    void PoolBufferedFrame(int bufferIndex);
+    void RescaleBufferedFrame(int bufferIndex, int fromPooling, int toPooling);
+
+    int64_t FrameToTimestamp(int64_t frameNumber);
+    int64_t TimestampToFrame(int64_t timestamp);
+    int64_t StreamTimeUs(int64_t frameNumber);
+    int FindSegmentStarts(std::vector<int64_t> &starts);
+    int64_t RunSegments(const char *filename, const std::vector<int64_t> &starts, const std::vector<int64_t> &ends,
+                        int threads, std::vector<std::unique_ptr<MoveDetector>> &parts);
+    void StitchSegments(std::vector<std::unique_ptr<MoveDetector>> &parts);
+    void WriteLabelFrame(FILE *file);
+    void AppendLabelFrames(FILE *from, const std::map<int, int> &stitchedIDs);
+    void ScanGops(std::vector<gopInfo> &gops);
+    float SampleGopMotion(AVPacket *keyPacket, AVPacket *interPacket);
+    void ClassifyGops(std::vector<gopInfo> &gops);
+    void StartClips();
+    int StartClip();
+    void WriteClipPacket(const AVPacket &packet);
+    void EndClip(int64_t endTs);
+    void ClipPacket(const AVPacket &packet);
+    void FinishClips();
+    int OpenOverlay(const AVFrame *picture);
+    void CloseOverlay();
+    void QueueOverlayFrame(const AVFrame *picture, int frameNumber);
+    void DrawOverlay(AVFrame *picture);
+    void EncodeOverlayFrame(AVFrame *picture);
+    void WriteOverlayFrames(int reportedFrame);
+    void FinishOverlay();
 
     void PrepareFrameBuffers();
     void SkipDummyFrame();
 
-    void inline ValidateCoordinate(coordinate c);
-    float inline CalculateIoUofBoxes(coordinate b1U, coordinate b1B, coordinate b2U, coordinate b2B);
+    void inline ValidateCoordinate(coordinate &c);
+    float CalculateIoUofBoxes(coordinate b1U, coordinate b1B, coordinate b2U, coordinate b2B);
 };
 
 #endif /* MOTION_WATCH_H_ */
@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "motion_watch.h"
+
+//raw structs: a checkpoint is only read back on the machine and build that wrote it
+static const char checkpointMagic[4] = {'M', 'V', 'C', 'K'};
+static const int checkpointVersion = 4;
+
+struct checkpointHeader
+{
+    char magic[4];
+    int version;
+    int areaSize;
+    int trackerSize;
+    int nBlocksX, nBlocksY;
+    int ringSize;
+    int rows, cols;
+    int analysisStride;
+    int packetSkip;
+    int frameParallel;
+};
+
+template <typename T>
+static void Put(FILE *file, const T &value)
+{
+    fwrite(&value, sizeof(T), 1, file);
+}
+
+template <typename T>
+static bool Get(FILE *file, T &value)
+{
+    return fread(&value, sizeof(T), 1, file) == 1;
+}
+
+template <typename T>
+static void PutGrid(FILE *file, const Grid<T> &grid)
+{
+    fwrite(grid.Data(), sizeof(T), (size_t)grid.Rows() * grid.Cols(), file);
+}
+
+template <typename T>
+static bool GetGrid(FILE *file, Grid<T> &grid)
+{
+    size_t count = (size_t)grid.Rows() * grid.Cols();
+    return fread(grid.Data(), sizeof(T), count, file) == count;
+}
+
+template <typename T>
+static void PutVector(FILE *file, const std::vector<T> &values)
+{
+    fwrite(values.data(), sizeof(T), values.size(), file);
+}
+
+template <typename T>
+static bool GetVector(FILE *file, std::vector<T> &values)
+{
+    return fread(values.data(), sizeof(T), values.size(), file) == values.size();
+}
+
+//written to a temporary file and renamed over the last checkpoint, so a crash leaves one of the two whole
+int MoveDetector::SaveCheckpoint(checkpointPosition &position)
+{
+    const std::string tempName = checkpointFile + ".tmp";
+    FILE *file = fopen(tempName.c_str(), "wb");
+    if (!file)
+    {
+        fprintf(stderr, "cannot write checkpoint %s: %s\n", tempName.c_str(), strerror(errno));
+        return -1;
+    }
+
+    position.maskOffset = 0;
+    if (movemask_file_flag)
+    {
+        fflush(fvideomask_desc);
+        position.maskOffset = ftell(fvideomask_desc);
+    }
+
+    checkpointHeader header = {{}, checkpointVersion, (int)sizeof(connectedArea), (int)sizeof(trackedObject), nBlocksX, nBlocksY, ringSize,
+                               areaGridMarked[0].Rows(), areaGridMarked[0].Cols(), analysisStride, packet_skip, frameParallel};
+    memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+    Put(file, header);
+    Put(file, position);
+
+    Put(file, currFrameBuffer);
+    Put(file, delayedFrameNumber);
+    Put(file, currFrameNumber);
+    Put(file, lastDecodedFrame);
+    Put(file, lastAnalysedFrame);
+    Put(file, warmUpFrames);
+    Put(file, reportedFrames);
+    Put(file, degradation);
+    Put(file, pyramidFrames);
+    Put(file, pyramidCells);
+    Put(file, idRandom);
+
+    Put(file, governorLevel);
+    Put(file, governorLoad);
+    Put(file, governorOverCount);
+    Put(file, governorUnderCount);
+    Put(file, governorChanges);
+    Put(file, governorHoldUp);
+    Put(file, governorLevelAge);
+    Put(file, governorSteppedUp);
+    Put(file, governorLevelFrames);
+    Put(file, gridPooling);
+
+    //MV ring
+    for (int i = 0; i < ringSize; i++)
+    {
+        PutGrid(file, areaGridMarked[i]);
+        PutGrid(file, mvGridCoords[i]);
+        PutGrid(file, subMbTypes[i]);
+        PutGrid(file, mvCoarseCoords[i]);
+    }
+    PutGrid(file, areaBuffer);
+    PutVector(file, globalMotionFrame);
+    PutVector(file, truncatedFrame);
+    PutVector(file, globalMotion);
+    PutVector(file, mvFrameScale);
+    PutVector(file, slotFrameNumber);
+
+    //trackers point at areas of the ring, stored as slot indices
+    Put(file, (int)trackedObjects.size());
+    for (auto &tracker : trackedObjects)
+    {
+        trackedObject copy = tracker;
+        int area = tracker.candidateArea ? (int)(tracker.candidateArea - areaBuffer.Data()) : -1;
+        copy.candidateArea = NULL;
+        Put(file, copy);
+        Put(file, area);
+    }
+
+    //the grid mask values of live trackers, a resumed mask gives them the same ones
+    Put(file, (int)gridValues.size());
+    for (auto &value : gridValues)
+    {
+        Put(file, value.first);
+        Put(file, value.second);
+    }
+
+    fflush(file);
+    bool failed = ferror(file) || fsync(fileno(file)) < 0;
+    fclose(file);
+    if (failed || rename(tempName.c_str(), checkpointFile.c_str()) < 0)
+    {
+        fprintf(stderr, "cannot write checkpoint %s: %s\n", checkpointFile.c_str(), strerror(errno));
+        remove(tempName.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int MoveDetector::LoadCheckpoint(checkpointPosition &position)
+{
+    FILE *file = fopen(checkpointFile.c_str(), "rb");
+    if (!file)
+    {
+        fprintf(stderr, "no checkpoint %s, starting from the beginning\n", checkpointFile.c_str());
+        return -1;
+    }
+
+    AllocAnalyzeBuffers();
+    checkpointHeader header, expected = {{}, checkpointVersion, (int)sizeof(connectedArea), (int)sizeof(trackedObject), nBlocksX, nBlocksY, ringSize,
+                                         areaGridMarked[0].Rows(), areaGridMarked[0].Cols(), analysisStride, packet_skip, frameParallel};
+    memcpy(expected.magic, checkpointMagic, sizeof(expected.magic));
+    if (!Get(file, header) || memcmp(&header, &expected, sizeof(header)))
+    {
+        fprintf(stderr, "checkpoint %s does not match this stream and these options, starting from the beginning\n", checkpointFile.c_str());
+        fclose(file);
+        return -1;
+    }
+
+    bool ok = Get(file, position) &&
+              Get(file, currFrameBuffer) && Get(file, delayedFrameNumber) && Get(file, currFrameNumber) &&
+              Get(file, lastDecodedFrame) && Get(file, lastAnalysedFrame) && Get(file, warmUpFrames) && Get(file, reportedFrames) &&
+              Get(file, degradation) && Get(file, pyramidFrames) && Get(file, pyramidCells) && Get(file, idRandom) &&
+              Get(file, governorLevel) && Get(file, governorLoad) && Get(file, governorOverCount) && Get(file, governorUnderCount) &&
+              Get(file, governorChanges) && Get(file, governorHoldUp) && Get(file, governorLevelAge) && Get(file, governorSteppedUp) &&
+              Get(file, governorLevelFrames) && Get(file, gridPooling);
+    for (int i = 0; ok && i < ringSize; i++)
+        ok = GetGrid(file, areaGridMarked[i]) && GetGrid(file, mvGridCoords[i]) && GetGrid(file, subMbTypes[i]) && GetGrid(file, mvCoarseCoords[i]);
+    ok = ok && GetGrid(file, areaBuffer) && GetVector(file, globalMotionFrame) && GetVector(file, truncatedFrame) &&
+         GetVector(file, globalMotion) && GetVector(file, mvFrameScale) && GetVector(file, slotFrameNumber);
+
+    int trackers = 0;
+    ok = ok && Get(file, trackers);
+    trackedObjects.clear();
+    for (int i = 0; ok && i < trackers; i++)
+    {
+        trackedObject tracker;
+        int area;
+        ok = Get(file, tracker) && Get(file, area) && area < ringSize * MAX_CONNAREAS;
+        tracker.candidateArea = area >= 0 ? areaBuffer.Data() + area : NULL;
+        trackedObjects.push_back(tracker);
+    }
+
+    int values = 0;
+    ok = ok && Get(file, values);
+    gridValues.clear();
+    for (int i = 0; ok && i < values; i++)
+    {
+        int trackerID;
+        uint8_t value;
+        ok = Get(file, trackerID) && Get(file, value);
+        gridValues[trackerID] = value;
+    }
+    fclose(file);
+
+    //the state is half overwritten by now, starting over silently would give wrong output
+    if (!ok)
+    {
+        fprintf(stderr, "checkpoint %s is damaged, remove it to start from the beginning\n", checkpointFile.c_str());
+        exit(0);
+    }
+    return 0;
+}
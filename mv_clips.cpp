@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <math.h>
+
+#include "motion_watch.h"
+
+static const char *clipListSuffix = ".clips.txt";
+static const char *clipFallbackExtension = ".mkv";   //for inputs whose own container cannot be written
+
+static std::string BaseName(const char *url)
+{
+    std::string name = url;
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos)
+        name = name.substr(slash + 1);
+    size_t dot = name.rfind('.');
+    return dot != std::string::npos && dot > 0 ? name.substr(0, dot) : name;
+}
+
+//packets as seconds from the start of the recording
+static double StreamSeconds(const AVStream *st, int64_t timestamp)
+{
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    return (timestamp - start) * av_q2d(st->time_base);
+}
+
+void MoveDetector::StartClips()
+{
+    const char *url = fmt_ctx->url ? fmt_ctx->url : "input";
+    clipBase = clipDir + "/" + BaseName(url);
+    const char *dot = strrchr(url, '.');
+    clipExtension = dot && !strchr(dot, '/') && av_guess_format(NULL, url, NULL) ? dot : clipFallbackExtension;
+
+    const std::string listName = clipBase + clipListSuffix;
+    if ((clipList = fopen(listName.c_str(), "w")) == NULL)
+    {
+        fprintf(stderr, "cannot write %s: %s, no clips are cut\n", listName.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(clipList, "# clip start end (seconds from the start of the recording)\n");
+
+    //video and audio are copied, subtitles and data streams are left out
+    clipStreamMap.assign(fmt_ctx->nb_streams, -1);
+    for (unsigned i = 0, n = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        AVMediaType type = fmt_ctx->streams[i]->codecpar->codec_type;
+        if (type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO)
+            clipStreamMap[i] = n++;
+    }
+    const double fps = av_q2d(fmt_ctx->streams[video_stream_index]->r_frame_rate);
+    clipPreFrames = lround(clipPreRoll * fps);
+    clipPostFrames = lround(clipPostRoll * fps);
+    clipCount = 0;
+    clipBytes = 0;
+    clipInputBytes = 0;
+    clipSeconds = 0.0;
+    clipStartTs = AV_NOPTS_VALUE;
+    clipLastTs = AV_NOPTS_VALUE;
+    clipCoveredFrame = -1;
+}
+
+int MoveDetector::StartClip()
+{
+    char index[32];
+    snprintf(index, sizeof(index), ".clip%03d", clipCount + 1);
+    const std::string clipName = clipBase + index + clipExtension;
+
+    if (avformat_alloc_output_context2(&clipCtx, NULL, NULL, clipName.c_str()) < 0 || !clipCtx)
+    {
+        fprintf(stderr, "cannot create clip %s\n", clipName.c_str());
+        return -1;
+    }
+    for (unsigned i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+        if (clipStreamMap[i] < 0)
+            continue;
+        AVStream *st = avformat_new_stream(clipCtx, NULL);
+        if (!st || avcodec_parameters_copy(st->codecpar, fmt_ctx->streams[i]->codecpar) < 0)
+        {
+            avformat_free_context(clipCtx);
+            clipCtx = NULL;
+            return -1;
+        }
+        //the tag of the input container may mean something else in the output one
+        st->codecpar->codec_tag = 0;
+        st->time_base = fmt_ctx->streams[i]->time_base;
+    }
+    if ((!(clipCtx->oformat->flags & AVFMT_NOFILE) && avio_open(&clipCtx->pb, clipName.c_str(), AVIO_FLAG_WRITE) < 0) ||
+        avformat_write_header(clipCtx, NULL) < 0)
+    {
+        fprintf(stderr, "cannot write clip %s\n", clipName.c_str());
+        if (!(clipCtx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&clipCtx->pb);
+        avformat_free_context(clipCtx);
+        clipCtx = NULL;
+        return -1;
+    }
+    clipFile = clipName;
+    clipCount++;
+
+    //the pre-roll starts at a keyframe, the clip's timestamps start at 0 there
+    const AVPacket *first = clipBuffer.front();
+    clipStartTs = first->dts != AV_NOPTS_VALUE ? first->dts : first->pts;
+    for (AVPacket *packet : clipBuffer)
+    {
+        WriteClipPacket(*packet);
+        av_packet_free(&packet);
+    }
+    clipBuffer.clear();
+    clipBufferKeys.clear();
+    return 0;
+}
+
+void MoveDetector::WriteClipPacket(const AVPacket &packet)
+{
+    const AVStream *in = fmt_ctx->streams[packet.stream_index];
+    const AVStream *out = clipCtx->streams[clipStreamMap[packet.stream_index]];
+    const AVStream *video = fmt_ctx->streams[video_stream_index];
+    const int64_t offset = av_rescale_q(clipStartTs, video->time_base, in->time_base);
+
+    //audio from ahead of the first keyframe has nothing to go with
+    if (packet.dts != AV_NOPTS_VALUE && packet.dts < offset)
+        return;
+
+    AVPacket copy;
+    if (av_packet_ref(&copy, &packet) < 0)
+        return;
+    if (copy.pts != AV_NOPTS_VALUE)
+        copy.pts = av_rescale_q(copy.pts - offset, in->time_base, out->time_base);
+    if (copy.dts != AV_NOPTS_VALUE)
+        copy.dts = av_rescale_q(copy.dts - offset, in->time_base, out->time_base);
+    copy.duration = av_rescale_q(copy.duration, in->time_base, out->time_base);
+    copy.stream_index = clipStreamMap[packet.stream_index];
+    copy.pos = -1;
+    clipBytes += copy.size;
+    //takes the reference over
+    if (av_interleaved_write_frame(clipCtx, &copy) < 0)
+        fprintf(stderr, "cannot write to clip %s\n", clipFile.c_str());
+}
+
+//the clip ends ahead of the keyframe at endTs (video time base), or at the end of the stream
+void MoveDetector::EndClip(int64_t endTs)
+{
+    av_write_trailer(clipCtx);
+    if (!(clipCtx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&clipCtx->pb);
+    avformat_free_context(clipCtx);
+    clipCtx = NULL;
+
+    const AVStream *video = fmt_ctx->streams[video_stream_index];
+    double start = StreamSeconds(video, clipStartTs), end = StreamSeconds(video, endTs);
+    //the list sits next to the clips
+    fprintf(clipList, "%s %.3f %.3f\n", clipFile.c_str() + clipDir.size() + 1, start, end);
+    fflush(clipList);
+    MV_LOG(LOG_LEVEL_INFO, logFile, "clip %s: %.3f - %.3f sec\n", clipFile.c_str(), start, end);
+    clipSeconds += end - start;
+    clipCoveredFrame = lastMotionFrame;
+}
+
+//called for every packet after it is decoded, so the motion data is as new as it gets
+void MoveDetector::ClipPacket(const AVPacket &packet)
+{
+    if (packet.stream_index >= (int)clipStreamMap.size() || clipStreamMap[packet.stream_index] < 0)
+        return;
+    clipInputBytes += packet.size;
+
+    const int64_t ts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+    const bool key = packet.stream_index == video_stream_index && (packet.flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE;
+    if (packet.stream_index == video_stream_index && ts != AV_NOPTS_VALUE)
+        clipLastTs = ts + packet.duration;
+
+    //a clip closes at the first keyframe once post-roll frames without trackers have been analysed
+    if (clipCtx && key && lastReportedFrame - lastMotionFrame >= clipPostFrames)
+        EndClip(ts);
+    if (!clipCtx && lastMotionFrame > clipCoveredFrame && !clipBuffer.empty() && StartClip() < 0)
+        clipCoveredFrame = lastMotionFrame;
+    if (clipCtx)
+    {
+        WriteClipPacket(packet);
+        return;
+    }
+
+    //the pre-roll buffer holds whole GOPs: it starts at the newest keyframe that is at least
+    //clipPreFrames ahead of the newest analysed frame
+    if (!key && clipBufferKeys.empty())
+        return;
+    clipBuffer.push_back(av_packet_clone(&packet));
+    if (key)
+        clipBufferKeys.push_back(TimestampToFrame(ts));
+    while (clipBufferKeys.size() > 1 && clipBufferKeys[1] <= lastReportedFrame - clipPreFrames)
+    {
+        clipBufferKeys.pop_front();
+        do
+        {
+            av_packet_free(&clipBuffer.front());
+            clipBuffer.pop_front();
+        } while (!(clipBuffer.front()->stream_index == video_stream_index && (clipBuffer.front()->flags & AV_PKT_FLAG_KEY)));
+    }
+}
+
+void MoveDetector::FinishClips()
+{
+    if (clipCtx)
+        EndClip(clipLastTs);
+    for (AVPacket *packet : clipBuffer)
+        av_packet_free(&packet);
+    clipBuffer.clear();
+    clipBufferKeys.clear();
+    fclose(clipList);
+    clipList = NULL;
+
+    const AVStream *video = fmt_ctx->streams[video_stream_index];
+    double total = clipLastTs != AV_NOPTS_VALUE ? StreamSeconds(video, clipLastTs) : 0.0;
+    fprintf(logFile, "Clips: %d written to %s*%s, %4.1f of %4.1f sec kept (%4.1f percent of the packet data)\n",
+            clipCount, clipBase.c_str(), clipExtension.c_str(), clipSeconds, total,
+            clipInputBytes ? (double)clipBytes / clipInputBytes * 100.0 : 0.0);
+}
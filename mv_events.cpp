@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <stdarg.h>
+
+#include "motion_watch.h"
+
+static void AppendBytes(std::vector<char> &out, const void *data, size_t size)
+{
+    out.insert(out.end(), (const char *)data, (const char *)data + size);
+}
+
+static void AppendText(std::vector<char> &out, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n > 0)
+        out.insert(out.end(), line, line + std::min(n, (int)sizeof(line) - 1));
+}
+
+int MoveDetector::OpenEvents(bool stream)
+{
+    eventHeaderWritten = false;
+    eventFrames = 0;
+    eventBytes = 0;
+    if (stream)
+    {
+        eventOutput.reset(new OutputQueue(eventTarget, outputPolicy, outputQueueBytes));
+        return 0;
+    }
+    if ((eventFile = fopen(eventTarget.c_str(), "wb")) == NULL)
+    {
+        fprintf(stderr, "cannot write the events to %s: %s\n", eventTarget.c_str(), strerror(errno));
+        return -1;
+    }
+    //records are small, the disk sees large writes
+    setvbuf(eventFile, NULL, _IOFBF, EVENT_BUFFER_KB << 10);
+    return 0;
+}
+
+//on the first frame, when the analysed size is known; a stream reader that connects later gets it as well
+void MoveDetector::WriteEventHeader()
+{
+    eventStreamHeader header = {};
+    memcpy(header.magic, EVENT_STREAM_MAGIC, sizeof(EVENT_STREAM_MAGIC));
+    header.version = EVENT_STREAM_VERSION;
+    header.headerSize = sizeof(header);
+    header.width = output_width;
+    header.height = output_height;
+    header.rateNum = fmt_ctx ? fmt_ctx->streams[video_stream_index]->r_frame_rate.num : 0;
+    header.rateDen = fmt_ctx ? fmt_ctx->streams[video_stream_index]->r_frame_rate.den : 1;
+
+    eventRecord.clear();
+    if (eventFormat == EVENT_FORMAT_JSON)
+        AppendText(eventRecord, "{\"magic\":\"%s\",\"version\":%u,\"width\":%d,\"height\":%d,\"rateNum\":%d,\"rateDen\":%d}\n",
+                   EVENT_STREAM_MAGIC, header.version, header.width, header.height, header.rateNum, header.rateDen);
+    else
+        AppendBytes(eventRecord, &header, sizeof(header));
+
+    if (eventOutput)
+        eventOutput->SetHeader(eventRecord.data(), eventRecord.size());
+    else
+        fwrite(eventRecord.data(), 1, eventRecord.size(), eventFile);
+    eventBytes += eventRecord.size();
+    eventHeaderWritten = true;
+}
+
+//the reported frame's areas and trackers as one record
+void MoveDetector::WriteEvents()
+{
+    if (!eventHeaderWritten)
+        WriteEventHeader();
+
+    const int oldest = BUFFER_OLDEST(currFrameBuffer);
+    const connectedArea *detectedAreas = areaBuffer[oldest];
+    eventFrame header = {};
+    header.frameNumber = lastReportedFrame;
+    header.streamTimeUs = StreamTimeUs(lastReportedFrame);
+    header.rows = nSectorsY;
+    header.cols = nSectorsX;
+    header.cellWidth = output_block_size * mbPerSectorX;
+    header.cellHeight = output_block_size * mbPerSectorY;
+    header.flags = globalMotionFrame[oldest] ? RESULT_FRAME_GLOBAL_MOTION : 0;
+    if (truncatedFrame[oldest])
+        header.flags |= RESULT_FRAME_TRUNCATED;
+    while (header.areaCount < areaBuffer.Cols() && detectedAreas[header.areaCount].id != 0)
+        header.areaCount++;
+    header.trackerCount = trackedObjects.size();
+
+    eventRecord.clear();
+    if (eventFormat == EVENT_FORMAT_JSON)
+    {
+        AppendText(eventRecord, "{\"type\":\"frame\",\"frameNumber\":%lld,\"streamTimeUs\":%lld,\"rows\":%d,\"cols\":%d,"
+                                "\"cellWidth\":%d,\"cellHeight\":%d,\"flags\":%d,\"areas\":[",
+                   (long long)header.frameNumber, (long long)header.streamTimeUs, header.rows, header.cols,
+                   header.cellWidth, header.cellHeight, header.flags);
+        for (int i = 0; i < header.areaCount; i++)
+        {
+            const resultArea a = AreaRecord(detectedAreas[i]);
+            AppendText(eventRecord, "%s{\"id\":%d,\"areaID\":%d,\"size\":%d,\"centroidX\":%.2f,\"centroidY\":%.2f,\"directionX\":%.2f,"
+                                    "\"directionY\":%.2f,\"directionMag\":%.2f,\"directionAng\":%.2f,\"boxLeft\":%d,"
+                                    "\"boxTop\":%d,\"boxRight\":%d,\"boxBottom\":%d,\"tracked\":%d}",
+                       i ? "," : "", a.id, a.areaID, a.size, a.centroidX, a.centroidY, a.directionX, a.directionY, a.directionMag,
+                       a.directionAng, a.boxLeft, a.boxTop, a.boxRight, a.boxBottom, a.tracked);
+        }
+        AppendText(eventRecord, "],\"trackers\":[");
+        int n = 0;
+        for (auto &object : trackedObjects)
+        {
+            const resultTracker t = TrackerRecord(object);
+            AppendText(eventRecord, "%s{\"trackerID\":%d,\"areaID\":%d,\"size\":%d,\"centerX\":%d,\"centerY\":%d,"
+                                    "\"directionX\":%d,\"directionY\":%d,\"boxLeft\":%d,\"boxTop\":%d,\"boxRight\":%d,"
+                                    "\"boxBottom\":%d,\"iou\":%.3f,\"status\":%d,\"lifeTime\":%d,\"aliveFor\":%d}",
+                       n++ ? "," : "", t.trackerID, t.areaID, t.size, t.centerX, t.centerY, t.directionX, t.directionY,
+                       t.boxLeft, t.boxTop, t.boxRight, t.boxBottom, t.iou, t.status, t.lifeTime, t.aliveFor);
+        }
+        AppendText(eventRecord, "]}\n");
+    }
+    else
+    {
+        eventRecordHeader record;
+        record.size = sizeof(record) + sizeof(header) + header.areaCount * sizeof(resultArea) + header.trackerCount * sizeof(resultTracker);
+        record.type = EVENT_RECORD_FRAME;
+        eventRecord.reserve(record.size);
+        AppendBytes(eventRecord, &record, sizeof(record));
+        AppendBytes(eventRecord, &header, sizeof(header));
+        for (int i = 0; i < header.areaCount; i++)
+        {
+            const resultArea a = AreaRecord(detectedAreas[i]);
+            AppendBytes(eventRecord, &a, sizeof(a));
+        }
+        for (auto &object : trackedObjects)
+        {
+            const resultTracker t = TrackerRecord(object);
+            AppendBytes(eventRecord, &t, sizeof(t));
+        }
+    }
+
+    if (eventOutput)
+        eventOutput->Push(OutputQueue::EVENT, eventRecord.data(), eventRecord.size());
+    else
+        fwrite(eventRecord.data(), 1, eventRecord.size(), eventFile);
+    eventBytes += eventRecord.size();
+    eventFrames++;
+}
+
+void MoveDetector::CloseEvents()
+{
+    fprintf(logFile, "Events: %d frames, %4.2f MB of %s records to %s\n", eventFrames, eventBytes / 1048576.0,
+            eventFormat == EVENT_FORMAT_JSON ? "JSON" : "binary", eventTarget.c_str());
+    if (eventOutput)
+    {
+        eventOutput->Finish();
+        eventOutput->PrintStats(logFile);
+        eventOutput.reset();
+    }
+    if (eventFile)
+        fclose(eventFile);
+    eventFile = NULL;
+}
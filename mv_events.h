@@ -0,0 +1,48 @@
+#ifndef MV_EVENTS_H
+#define MV_EVENTS_H
+
+#include <stdint.h>
+
+#include "mv_records.h"
+
+//--events: the stream header, then one record per reported frame, every record prefixed with its size so
+//that readers skip the types they do not know. Native byte order (little-endian on the hosts we run on),
+//no padding. --events-format json writes the same fields with the same names, one JSON object per line.
+
+#define EVENT_STREAM_MAGIC "MVEVENT"
+#define EVENT_STREAM_VERSION 2
+
+#define EVENT_RECORD_FRAME 1
+
+struct eventStreamHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;        //later versions append fields
+    int32_t width, height;      //of the analysed video
+    int32_t rateNum, rateDen;   //frame rate the frame numbers count in
+};
+
+struct eventRecordHeader
+{
+    uint32_t size;              //of the whole record, this header included
+    uint32_t type;
+};
+
+//EVENT_RECORD_FRAME, followed by areaCount resultArea and trackerCount resultTracker
+struct eventFrame
+{
+    int64_t frameNumber;
+    int64_t streamTimeUs;
+    int32_t rows, cols;         //of the grid the area and tracker coordinates are in
+    int32_t cellWidth, cellHeight;      //pixels per grid cell
+    int32_t flags;              //RESULT_FRAME_*
+    int32_t areaCount;
+    int32_t trackerCount;
+    int32_t reserved;
+};
+
+static_assert(sizeof(eventStreamHeader) == 32 && sizeof(eventRecordHeader) == 8 && sizeof(eventFrame) == 48,
+              "records are read as they are laid out");
+
+#endif
@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "motion_watch.h"
+
+static const int followBufferSize = 65536;
+
+//a short read at the end of the file waits for the writer instead of ending the stream
+static int FollowRead(void *opaque, uint8_t *buf, int size)
+{
+    MoveDetector::followInput *input = (MoveDetector::followInput *)opaque;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true)
+    {
+        ssize_t n = read(input->fd, buf, size);
+        if (n > 0)
+            return n;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        //a rotated file gets no more data, what was written before the rename has been read by now
+        if (input->rotated)
+            return AVERROR_EOF;
+
+        //events that arrived since the last wait are still queued, so an append is never missed
+        struct pollfd waitFor = {input->notifyFd, POLLIN, 0};
+        int ready = poll(&waitFor, 1, input->idleSeconds * 1000);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        if (ready == 0)
+        {
+            fprintf(stderr, "follow: nothing appended for %d sec, stopping\n", input->idleSeconds);
+            return AVERROR_EOF;
+        }
+        ssize_t length = read(input->notifyFd, events, sizeof(events));
+        for (char *p = events; length > 0 && p < events + length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+            {
+                fprintf(stderr, "follow: recording rotated, reading what is left\n");
+                input->rotated = true;
+            }
+        }
+    }
+}
+
+static int64_t FollowSeek(void *opaque, int64_t offset, int whence)
+{
+    MoveDetector::followInput *input = (MoveDetector::followInput *)opaque;
+
+    //the size is not known while the file grows
+    if (whence & AVSEEK_SIZE)
+        return -1;
+    off_t position = lseek(input->fd, offset, whence & ~AVSEEK_FORCE);
+    return position < 0 ? AVERROR(errno) : position;
+}
+
+int MoveDetector::OpenFollowInput(const char *filename)
+{
+    followSource = {-1, -1, followIdle, false};
+    if ((followSource.fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "follow: cannot open %s: %s\n", filename, strerror(errno));
+        return AVERROR(errno);
+    }
+    //the watch is set before the first read, appends from then on are all seen
+    followSource.notifyFd = inotify_init1(IN_CLOEXEC);
+    if (followSource.notifyFd < 0 ||
+        inotify_add_watch(followSource.notifyFd, filename, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) < 0)
+    {
+        fprintf(stderr, "follow: cannot watch %s: %s\n", filename, strerror(errno));
+        CloseFollowInput();
+        return AVERROR(errno);
+    }
+
+    unsigned char *buffer = (unsigned char *)av_malloc(followBufferSize);
+    if (!buffer || !(followIO = avio_alloc_context(buffer, followBufferSize, 0, &followSource, FollowRead, NULL, FollowSeek)))
+    {
+        av_free(buffer);
+        CloseFollowInput();
+        return AVERROR(ENOMEM);
+    }
+    if (!(fmt_ctx = avformat_alloc_context()))
+    {
+        CloseFollowInput();
+        return AVERROR(ENOMEM);
+    }
+    fmt_ctx->pb = followIO;
+    fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    return 0;
+}
+
+//after avformat_close_input, which leaves a custom AVIOContext to its owner
+void MoveDetector::CloseFollowInput()
+{
+    if (followIO)
+    {
+        av_freep(&followIO->buffer);
+        avio_context_free(&followIO);
+    }
+    if (followSource.notifyFd >= 0)
+        close(followSource.notifyFd);
+    if (followSource.fd >= 0)
+        close(followSource.fd);
+    followSource.notifyFd = -1;
+    followSource.fd = -1;
+}
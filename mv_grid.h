@@ -0,0 +1,57 @@
+#ifndef MV_GRID_H
+#define MV_GRID_H
+
+#include <algorithm>
+#include <vector>
+
+//row-major 2D buffer sized at runtime; grid[i][j] addresses row i, column j
+template <typename T>
+class Grid
+{
+  public:
+    Grid() : rows(0), cols(0) {}
+
+    //reallocates and clears the buffer, no-op if the size is unchanged
+    void Resize(int newRows, int newCols)
+    {
+        if (newRows == rows && newCols == cols)
+            return;
+        rows = newRows;
+        cols = newCols;
+        data.assign((size_t)rows * cols, T());
+    }
+
+    //only grows, keeps the row stride of a larger buffer
+    void Reserve(int newRows, int newCols)
+    {
+        if (newRows > rows || newCols > cols)
+            Resize(std::max(rows, newRows), std::max(cols, newCols));
+    }
+
+    void Clear()
+    {
+        std::fill(data.begin(), data.end(), T());
+    }
+
+    void ClearRows(int rowBegin, int rowEnd)
+    {
+        std::fill(data.begin() + (size_t)rowBegin * cols, data.begin() + (size_t)rowEnd * cols, T());
+    }
+
+    T *operator[](int row) { return &data[(size_t)row * cols]; }
+    const T *operator[](int row) const { return &data[(size_t)row * cols]; }
+
+    int Rows() const { return rows; }
+    int Cols() const { return cols; }
+
+    //the whole buffer, for checkpoints
+    T *Data() { return data.data(); }
+    const T *Data() const { return data.data(); }
+
+  private:
+    int rows;
+    int cols;
+    std::vector<T> data;
+};
+
+#endif
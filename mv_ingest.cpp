@@ -0,0 +1,632 @@
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "motion_watch.h"
+
+static const int ingestReadSize = 65536;        //bytes taken from one input per wake-up, a busy input cannot starve the rest
+static const int ingestBatch = 8;               //packets a worker analyses before the other inputs get their turn
+static const int ingestStatsInterval = 10;      //seconds between the per-input statistics
+static const char *ingestReportSuffix = ".motion.txt";
+
+//read by the I/O threads as well; a lock-free atomic can be stored from a signal handler
+static std::atomic<int> ingestStopping(0);
+
+static void IngestSignal(int)
+{
+    ingestStopping = 1;
+}
+
+enum ingestKind
+{
+    INGEST_FIFO,
+    INGEST_LISTEN,
+    INGEST_UNIX,
+    INGEST_UDP
+};
+
+//one camera: read and cut into packets by an I/O thread, analysed by whichever worker takes it
+struct ingestInput
+{
+    ingestKind kind;
+    std::string label;
+    int fd;
+    int epollFd;
+
+    //I/O thread only
+    AVCodecContext *parserCtx;
+    AVCodecParserContext *parser;
+    int64_t nextPts;
+    bool waitKey;
+    int connections;
+
+    //shared, under lock
+    std::mutex lock;
+    std::deque<AVPacket *> packets;
+    int width, height;
+    bool scheduled;
+    bool paused;
+    bool ended;
+    bool finished;
+    bool failed;
+    int64_t bytes, received, analysed, dropped, pauses, kernelDrops;
+    size_t peakQueue;
+
+    //the worker that holds the input
+    std::unique_ptr<MoveDetector> detector;
+    MoveDetector::decodeLoop loop;
+};
+
+struct ingestHub
+{
+    MoveDetector *settings;
+    AVCodec *codec;
+    size_t queueLimit;
+    std::vector<int> epollFds;
+    std::atomic<unsigned> nextEpoll;
+
+    std::mutex inputsLock;
+    std::list<std::unique_ptr<ingestInput>> inputs;
+
+    //inputs with packets to analyse or a stream to finish, each queued once
+    std::mutex readyLock;
+    std::condition_variable ready;
+    std::deque<ingestInput *> readyInputs;
+    bool closed;
+};
+
+static void Schedule(ingestHub &hub, ingestInput *input)
+{
+    {
+        std::lock_guard<std::mutex> guard(hub.readyLock);
+        hub.readyInputs.push_back(input);
+    }
+    hub.ready.notify_one();
+}
+
+static ingestInput *AddInput(ingestHub &hub, ingestKind kind, const std::string &label, int fd)
+{
+    std::unique_ptr<ingestInput> input(new ingestInput());
+    input->kind = kind;
+    input->label = label;
+    input->fd = fd;
+    input->epollFd = hub.epollFds[hub.nextEpoll++ % hub.epollFds.size()];
+    input->waitKey = true;
+    if (kind != INGEST_LISTEN)
+    {
+        input->parserCtx = avcodec_alloc_context3(hub.codec);
+        input->parser = av_parser_init(hub.codec->id);
+        if (!input->parserCtx || !input->parser)
+        {
+            fprintf(stderr, "ingest: no %s parser for %s\n", hub.codec->name, label.c_str());
+            avcodec_free_context(&input->parserCtx);
+            av_parser_close(input->parser);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = input.get();
+    if (epoll_ctl(input->epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        fprintf(stderr, "ingest: cannot poll %s: %s\n", label.c_str(), strerror(errno));
+        avcodec_free_context(&input->parserCtx);
+        av_parser_close(input->parser);
+        close(fd);
+        return NULL;
+    }
+    std::lock_guard<std::mutex> guard(hub.inputsLock);
+    hub.inputs.push_back(std::move(input));
+    return hub.inputs.back().get();
+}
+
+//fifo:<path>, unix:<path> (listening, every connection is a camera) or udp:[<address>:]<port>
+static bool OpenIngestSpec(ingestHub &hub, const std::string &spec)
+{
+    size_t colon = spec.find(':');
+    std::string kind = spec.substr(0, colon), target = colon == std::string::npos ? "" : spec.substr(colon + 1);
+    if (target.empty())
+    {
+        fprintf(stderr, "ingest: %s is not fifo:<path>, unix:<path> or udp:[<address>:]<port>\n", spec.c_str());
+        return false;
+    }
+
+    if (kind == "fifo")
+    {
+        //non-blocking open does not wait for the writer
+        int fd = open(target.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+        {
+            fprintf(stderr, "ingest: cannot open %s: %s\n", target.c_str(), strerror(errno));
+            return false;
+        }
+        return AddInput(hub, INGEST_FIFO, target, fd) != NULL;
+    }
+    if (kind == "unix")
+    {
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (target.size() >= sizeof(address.sun_path))
+        {
+            fprintf(stderr, "ingest: socket path %s is too long\n", target.c_str());
+            return false;
+        }
+        strcpy(address.sun_path, target.c_str());
+        unlink(target.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0)
+        {
+            fprintf(stderr, "ingest: cannot listen on %s: %s\n", target.c_str(), strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        return AddInput(hub, INGEST_LISTEN, target, fd) != NULL;
+    }
+    if (kind == "udp")
+    {
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        size_t portColon = target.rfind(':');
+        std::string host = portColon == std::string::npos ? "127.0.0.1" : target.substr(0, portColon);
+        int port = atoi(target.c_str() + (portColon == std::string::npos ? 0 : portColon + 1));
+        address.sin_port = htons(port);
+        if (port <= 0 || port > 65535 || inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+        {
+            fprintf(stderr, "ingest: %s is not an IPv4 address and port\n", target.c_str());
+            return false;
+        }
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        //datagrams the socket buffer had no room for are counted by the kernel
+        int on = 1;
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0 ||
+            bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            fprintf(stderr, "ingest: cannot bind %s: %s\n", target.c_str(), strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        return AddInput(hub, INGEST_UDP, "udp-" + host + "-" + std::to_string(port), fd) != NULL;
+    }
+    fprintf(stderr, "ingest: unknown input type %s\n", kind.c_str());
+    return false;
+}
+
+//a stream input that is full stops being read, so its writer blocks; datagrams cannot wait and are dropped
+static void QueuePacket(ingestHub &hub, ingestInput *input, const uint8_t *data, int size)
+{
+    int64_t pts = input->nextPts++;
+    bool key = input->parser->key_frame == 1;
+
+    std::lock_guard<std::mutex> guard(input->lock);
+    input->received++;
+    if (input->kind == INGEST_UDP && input->packets.size() >= hub.queueLimit)
+    {
+        input->waitKey = true;
+        input->dropped++;
+        return;
+    }
+    //the decoder needs a keyframe, with the picture size, to start and to recover from a gap
+    if (input->waitKey && !(key && input->parser->width > 0))
+    {
+        input->dropped++;
+        return;
+    }
+    input->waitKey = false;
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet || av_new_packet(packet, size) < 0)
+    {
+        av_packet_free(&packet);
+        input->dropped++;
+        input->waitKey = true;
+        return;
+    }
+    memcpy(packet->data, data, size);
+    packet->pts = pts;
+    packet->dts = pts;
+    packet->duration = 1;
+    packet->stream_index = 0;
+    if (key)
+        packet->flags |= AV_PKT_FLAG_KEY;
+    if (!input->width)
+    {
+        input->width = input->parser->width;
+        input->height = input->parser->height;
+    }
+    input->packets.push_back(packet);
+    input->peakQueue = std::max(input->peakQueue, input->packets.size());
+
+    if (input->kind != INGEST_UDP && !input->paused && input->packets.size() >= hub.queueLimit)
+    {
+        struct epoll_event event = {};
+        event.data.ptr = input;
+        epoll_ctl(input->epollFd, EPOLL_CTL_MOD, input->fd, &event);
+        input->paused = true;
+        input->pauses++;
+    }
+    if (!input->scheduled)
+    {
+        input->scheduled = true;
+        Schedule(hub, input);
+    }
+}
+
+//a NULL buffer drains the parser at the end of the stream
+static void ParseBytes(ingestHub &hub, ingestInput *input, const uint8_t *data, int size)
+{
+    do
+    {
+        uint8_t *out;
+        int outSize;
+        int used = av_parser_parse2(input->parser, input->parserCtx, &out, &outSize, data, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        if (used < 0)
+            break;
+        data += used;
+        size -= used;
+        if (outSize > 0)
+            QueuePacket(hub, input, out, outSize);
+    } while (size > 0);
+}
+
+//the input is marked ended before its descriptor is closed: a worker resuming a paused input checks that
+//under the lock, it never touches a closed descriptor or one the kernel has handed to a new connection
+static void EndInput(ingestHub &hub, ingestInput *input)
+{
+    if (input->kind != INGEST_LISTEN)
+        ParseBytes(hub, input, NULL, 0);
+
+    int fd;
+    {
+        std::lock_guard<std::mutex> guard(input->lock);
+        fd = input->fd;
+        input->fd = -1;
+        input->ended = true;
+        if (!input->scheduled && input->kind != INGEST_LISTEN)
+        {
+            input->scheduled = true;
+            Schedule(hub, input);
+        }
+    }
+    epoll_ctl(input->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    if (input->kind == INGEST_LISTEN)
+        unlink(input->label.c_str());
+}
+
+static void ReadInput(ingestHub &hub, ingestInput *input)
+{
+    uint8_t buffer[ingestReadSize + AV_INPUT_BUFFER_PADDING_SIZE];
+
+    if (input->kind == INGEST_LISTEN)
+    {
+        int fd;
+        while ((fd = accept4(input->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        {
+            std::string label = input->label + "." + std::to_string(++input->connections);
+            if (AddInput(hub, INGEST_UNIX, label, fd))
+                fprintf(stderr, "ingest: %s connected\n", label.c_str());
+        }
+        return;
+    }
+
+    if (input->kind == INGEST_UDP)
+    {
+        //one datagram at a time, until the socket is empty or the read size is used up
+        for (int total = 0; total < ingestReadSize;)
+        {
+            char control[CMSG_SPACE(sizeof(uint32_t))];
+            struct iovec vector = {buffer, ingestReadSize};
+            struct msghdr message = {};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            ssize_t n = recvmsg(input->fd, &message, 0);
+            if (n < 0)
+                return;
+            for (struct cmsghdr *c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c))
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+                {
+                    uint32_t drops;
+                    memcpy(&drops, CMSG_DATA(c), sizeof(drops));
+                    std::lock_guard<std::mutex> guard(input->lock);
+                    input->kernelDrops = drops;
+                }
+            {
+                std::lock_guard<std::mutex> guard(input->lock);
+                input->bytes += n;
+            }
+            memset(buffer + n, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+            ParseBytes(hub, input, buffer, n);
+            total += n;
+        }
+        return;
+    }
+
+    ssize_t n = read(input->fd, buffer, ingestReadSize);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        fprintf(stderr, "ingest: %s %s\n", input->label.c_str(), n == 0 ? "closed" : strerror(errno));
+        EndInput(hub, input);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(input->lock);
+        input->bytes += n;
+    }
+    memset(buffer + n, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    ParseBytes(hub, input, buffer, n);
+}
+
+static void IngestIOLoop(ingestHub &hub, int epollFd)
+{
+    struct epoll_event events[64];
+    while (!ingestStopping)
+    {
+        //woken up now and then to notice the stop
+        int n = epoll_wait(epollFd, events, 64, 500);
+        for (int i = 0; i < n; i++)
+            ReadInput(hub, (ingestInput *)events[i].data.ptr);
+    }
+}
+
+//the detector is created at the first keyframe, when the picture size is known
+static bool StartIngestStream(ingestHub &hub, ingestInput *input, int width, int height)
+{
+    std::unique_ptr<MoveDetector> detector(new MoveDetector());
+    detector->CopySettings(*hub.settings);
+    //inputs are analysed in parallel, not the tiles of one frame
+    detector->workerThreads = 1;
+    detector->frameParallel = false;
+    detector->video_stream_index = 0;
+
+    AVCodecParameters *par = avcodec_parameters_alloc();
+    if (!par)
+        return false;
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id = hub.codec->id;
+    par->width = width;
+    par->height = height;
+    int ret = detector->OpenDecoder(hub.codec, par);
+    avcodec_parameters_free(&par);
+    if (ret < 0)
+    {
+        fprintf(stderr, "ingest: cannot open the decoder for %s\n", input->label.c_str());
+        return false;
+    }
+
+    const std::string reportName = input->label + ingestReportSuffix;
+    if ((detector->logFile = fopen(reportName.c_str(), "w")) == NULL)
+    {
+        fprintf(stderr, "ingest: cannot write %s, %s is reported to stderr\n", reportName.c_str(), input->label.c_str());
+        detector->logFile = stderr;
+    }
+    detector->StartDecodeLoop(input->loop);
+    input->detector = std::move(detector);
+    return true;
+}
+
+static void FinishIngestStream(ingestInput *input)
+{
+    MoveDetector *detector = input->detector.get();
+    if (!detector)
+        return;
+    detector->FinishDecodeLoop(input->loop);
+    avcodec_free_context(&detector->dec_ctx);
+    av_freep(&detector->frame);
+    Logger::Flush();
+    if (detector->logFile != stderr)
+        fclose(detector->logFile);
+    fprintf(stderr, "ingest: %s ended, %d frames analysed\n", input->label.c_str(), detector->processedFrames);
+    input->detector.reset();
+}
+
+//a batch of the input's packets; the input goes back to the end of the queue while it has more
+static void ServeInput(ingestHub &hub, ingestInput *input)
+{
+    for (int i = 0; i < ingestBatch; i++)
+    {
+        AVPacket *packet;
+        int width, height;
+        {
+            std::lock_guard<std::mutex> guard(input->lock);
+            if (input->packets.empty())
+                break;
+            packet = input->packets.front();
+            input->packets.pop_front();
+            if (input->paused && !input->ended && input->packets.size() <= hub.queueLimit / 2)
+            {
+                struct epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.ptr = input;
+                epoll_ctl(input->epollFd, EPOLL_CTL_MOD, input->fd, &event);
+                input->paused = false;
+            }
+            width = input->width;
+            height = input->height;
+        }
+
+        if (!input->failed && (input->detector || StartIngestStream(hub, input, width, height)))
+        {
+            //a damaged packet of a live stream costs that frame only
+            input->detector->DecodePacket(*packet, input->loop);
+            std::lock_guard<std::mutex> guard(input->lock);
+            input->analysed++;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> guard(input->lock);
+            input->failed = true;
+            input->dropped++;
+        }
+        av_packet_free(&packet);
+    }
+
+    bool finish = false;
+    {
+        std::lock_guard<std::mutex> guard(input->lock);
+        if (!input->packets.empty())
+        {
+            Schedule(hub, input);
+            return;
+        }
+        finish = input->ended && !input->finished;
+        input->finished = input->ended;
+        input->scheduled = false;
+    }
+    if (finish)
+        FinishIngestStream(input);
+}
+
+static void PrintIngestStats(ingestHub &hub)
+{
+    std::lock_guard<std::mutex> inputsGuard(hub.inputsLock);
+    for (auto &input : hub.inputs)
+    {
+        if (input->kind == INGEST_LISTEN)
+            continue;
+        std::lock_guard<std::mutex> guard(input->lock);
+        fprintf(stderr, "ingest: %s (%s): %lld packets in (%lld KB), %lld analysed, %d queued (peak %d), %lld dropped, paused %lld times, %lld kernel drops\n",
+                input->label.c_str(), input->ended ? "ended" : "live", (long long)input->received, (long long)input->bytes / 1024,
+                (long long)input->analysed, (int)input->packets.size(), (int)input->peakQueue, (long long)input->dropped,
+                (long long)input->pauses, (long long)input->kernelDrops);
+    }
+}
+
+static bool AllInputsFinished(ingestHub &hub)
+{
+    std::lock_guard<std::mutex> inputsGuard(hub.inputsLock);
+    for (auto &input : hub.inputs)
+    {
+        std::lock_guard<std::mutex> guard(input->lock);
+        if (input->kind == INGEST_LISTEN || !input->finished)
+            return false;
+    }
+    return true;
+}
+
+//live inputs multiplexed on a few epoll threads; complete packets go to a pool of detector workers
+void MoveDetector::MainIngest()
+{
+    ingestHub hub;
+    hub.settings = this;
+    hub.codec = avcodec_find_decoder_by_name(ingestCodec.c_str());
+    hub.queueLimit = ingestQueue;
+    hub.nextEpoll = 0;
+    hub.closed = false;
+    if (!hub.codec)
+    {
+        fprintf(stderr, "ingest: unknown decoder %s\n", ingestCodec.c_str());
+        return;
+    }
+    for (int i = 0; i < ingestThreads; i++)
+    {
+        int fd = epoll_create1(EPOLL_CLOEXEC);
+        if (fd < 0)
+        {
+            fprintf(stderr, "cannot create an epoll instance: %s\n", strerror(errno));
+            for (int epollFd : hub.epollFds)
+                close(epollFd);
+            return;
+        }
+        hub.epollFds.push_back(fd);
+    }
+    bool opened = true;
+    for (auto &spec : ingestSpecs)
+        opened = opened && OpenIngestSpec(hub, spec);
+
+    struct sigaction action = {};
+    action.sa_handler = IngestSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    //a writer that goes away must not end the daemon
+    signal(SIGPIPE, SIG_IGN);
+    if (!opened)
+        ingestStopping = 1;
+
+    std::vector<std::thread> workerPool, ioThreads;
+    for (int i = 0; i < watchWorkers; i++)
+    {
+        workerPool.emplace_back([&hub]() {
+            while (true)
+            {
+                ingestInput *input;
+                {
+                    std::unique_lock<std::mutex> guard(hub.readyLock);
+                    hub.ready.wait(guard, [&] { return hub.closed || !hub.readyInputs.empty(); });
+                    if (hub.readyInputs.empty())
+                        return;
+                    input = hub.readyInputs.front();
+                    hub.readyInputs.pop_front();
+                }
+                ServeInput(hub, input);
+            }
+        });
+    }
+    for (int fd : hub.epollFds)
+        ioThreads.emplace_back(IngestIOLoop, std::ref(hub), fd);
+    if (opened)
+        fprintf(stderr, "ingesting %d inputs on %d I/O threads with %d workers, reports are written to <input>%s\n",
+                (int)ingestSpecs.size(), ingestThreads, watchWorkers, ingestReportSuffix);
+
+    //runs until a signal, or until every input has ended when none of them accepts new cameras
+    chrono::steady_clock::time_point stats_t = chrono::steady_clock::now();
+    while (!ingestStopping && !AllInputsFinished(hub))
+    {
+        this_thread::sleep_for(chrono::milliseconds(200));
+        if (chrono::steady_clock::now() - stats_t >= chrono::seconds(ingestStatsInterval))
+        {
+            PrintIngestStats(hub);
+            stats_t = chrono::steady_clock::now();
+        }
+    }
+    ingestStopping = 1;
+    for (auto &thread : ioThreads)
+        thread.join();
+
+    //what was read is still analysed, then every stream is finished
+    std::vector<ingestInput *> open;
+    {
+        std::lock_guard<std::mutex> guard(hub.inputsLock);
+        for (auto &input : hub.inputs)
+            if (input->fd >= 0)
+                open.push_back(input.get());
+    }
+    for (ingestInput *input : open)
+        EndInput(hub, input);
+    {
+        std::lock_guard<std::mutex> guard(hub.readyLock);
+        hub.closed = true;
+    }
+    hub.ready.notify_all();
+    for (auto &thread : workerPool)
+        thread.join();
+
+    PrintIngestStats(hub);
+    for (auto &input : hub.inputs)
+    {
+        for (AVPacket *packet : input->packets)
+            av_packet_free(&packet);
+        av_parser_close(input->parser);
+        avcodec_free_context(&input->parserCtx);
+    }
+    for (int fd : hub.epollFds)
+        close(fd);
+    fprintf(stderr, "ingest stopped\n");
+}
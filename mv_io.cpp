@@ -1,4 +1,5 @@
 #include "motion_watch.h"
+#include <errno.h>
 #include <sstream>
 #include <string>
 
@@ -112,11 +113,47 @@ HsvColor RgbToHsv(RgbColor rgb)
 }
 
 int MoveDetector::OpenVideoFile(const char *video_name)
+{
+    //MainDec frees the frame, a reused detector needs a new one
+    if (!frame && !(frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if (streamCache.empty())
+        return OpenInputStream(video_name, false);
+
+    //a source opened before needs only a short probe, the rest of its parameters are cached
+    chrono::high_resolution_clock::time_point open_t = chrono::high_resolution_clock::now();
+    bool cached = LoadStreamParams(video_name);
+    int ret = OpenInputStream(video_name, cached);
+    if (cached && (ret < 0 || !CheckStreamParams()))
+    {
+        fprintf(stderr, "cached stream parameters of %s do not match, probing again\n", video_name);
+        CloseInput();
+        cached = false;
+        ret = OpenInputStream(video_name, false);
+    }
+    if (ret < 0)
+        return ret;
+    if (!cached)
+        SaveStreamParams(video_name);
+    fprintf(stderr, "%s opened in %4.1f ms%s\n", video_name,
+            chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - open_t).count() / 1000.0,
+            cached ? " with cached stream parameters" : "");
+    return 0;
+}
+
+int MoveDetector::OpenInputStream(const char *video_name, bool cached)
 {
     int ret;
     AVCodec *dec;
+    AVDictionary *options = NULL;
 
-    if ((ret = avformat_open_input(&fmt_ctx, video_name, NULL, NULL)) < 0) {
+    if (follow && (ret = OpenFollowInput(video_name)) < 0)
+        return ret;
+    if (cached)
+        CachedProbeOptions(&options);
+    ret = OpenInputFormat(video_name, fmt_ctx, mmapIO, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
         av_log(NULL, AV_LOG_INFO, "FFMpeg: cannot open input file\n");
         return ret;
     }
@@ -131,13 +168,37 @@ int MoveDetector::OpenVideoFile(const char *video_name)
         return ret;
     }
     video_stream_index = ret;
+    if (cached)
+        ApplyStreamParams(fmt_ctx->streams[video_stream_index]);
+    return OpenDecoder(dec, fmt_ctx->streams[video_stream_index]->codecpar);
+}
+
+//the decoder and the demuxer with its I/O; the frame stays
+void MoveDetector::CloseInput()
+{
+    DropProbedPackets();
+    if (dec_ctx)
+        avcodec_free_context(&dec_ctx);
+    if (fmt_ctx)
+        avformat_close_input(&fmt_ctx);
+    if (followIO)
+        CloseFollowInput();
+    if (mmapIO)
+        CloseMappedInput(mmapIO);
+}
+
+//par comes from the demuxer, or from the parser for a raw live stream
+int MoveDetector::OpenDecoder(AVCodec *dec, const AVCodecParameters *par)
+{
+    int ret;
+
     dec_ctx = avcodec_alloc_context3(NULL);
     if (!dec_ctx)
     {
         av_log(NULL, AV_LOG_INFO, "FFMpeg: cannot allocate a AVCodecContext\n");
-        return ret;
+        return AVERROR(ENOMEM);
     }
-    ret = avcodec_parameters_to_context(dec_ctx, fmt_ctx->streams[video_stream_index]->codecpar);
+    ret = avcodec_parameters_to_context(dec_ctx, par);
     if (ret) {
         av_log(NULL, AV_LOG_INFO, "FFMpeg: context is NULL, exiting..\n");
         return ret;
@@ -149,18 +210,105 @@ int MoveDetector::OpenVideoFile(const char *video_name)
         throw std::runtime_error("Failed to open codec");
     }
 
+    //references are still decoded, so skipped frames do not break the MVs of analysed ones
+    if (analysisStride > 1)
+        dec_ctx->skip_frame = AVDISCARD_NONREF;
+
     if (AV_CODEC_ID_H264 == dec_ctx->codec_id)
     {    
         dec_ctx->flags2 |= AV_CODEC_FLAG2_CHUNKS;
         dec_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
-        dec_ctx->flags |= AV_CODEC_FLAG_GRAY;
-        dec_ctx->skip_loop_filter = AVDISCARD_ALL;
-        dec_ctx->skip_idct = AVDISCARD_ALL;
+        //the overlay is drawn on the picture, which needs its chroma and residuals
+        if (overlayFile.empty())
+        {
+            dec_ctx->flags |= AV_CODEC_FLAG_GRAY;
+            dec_ctx->skip_loop_filter = AVDISCARD_ALL;
+            dec_ctx->skip_idct = AVDISCARD_ALL;
+        }
     }
 
     return 0;
 }
 
+//one recording per line, '#' lines (m3u) are skipped; relative paths are taken from the playlist's directory
+int MoveDetector::LoadPlaylist(const char *filename)
+{
+    FILE *list = fopen(filename, "r");
+    if (!list)
+        return -1;
+    std::string base = filename;
+    base = base.find('/') != std::string::npos ? base.substr(0, base.rfind('/') + 1) : "";
+
+    char line[MAX_FILENAME];
+    while (fgets(line, sizeof(line), list))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        playlist.push_back(line[0] == '/' || strstr(line, "://") ? std::string(line) : base + line);
+    }
+    fclose(list);
+    return playlist.size();
+}
+
+//switches to the next recording of the playlist; the decoder, the MV ring and the trackers carry on.
+//Returns false at the end of the list
+bool MoveDetector::NextPlaylistInput(decodeLoop &loop)
+{
+    //the frames the decoder holds back belong to this recording and are numbered before the next one's
+    if (playlistIndex + 1 < playlist.size() && DrainDecoder(loop) != 0)
+        return false;
+    while (playlistIndex + 1 < playlist.size())
+    {
+        const char *filename = playlist[++playlistIndex].c_str();
+        AVFormatContext *next = NULL;
+        AVIOContext *nextIO = NULL;
+        AVCodec *dec;
+
+        if (OpenInputFormat(filename, next, nextIO, NULL) < 0 || avformat_find_stream_info(next, NULL) < 0)
+        {
+            fprintf(stderr, "playlist: cannot open %s, skipped\n", filename);
+            if (next)
+                avformat_close_input(&next);
+            CloseMappedInput(nextIO);
+            continue;
+        }
+        int stream = av_find_best_stream(next, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+        AVCodecParameters *par = stream >= 0 ? next->streams[stream]->codecpar : NULL;
+        //the analysis grids are sized for the first recording
+        if (!par || par->codec_id != dec_ctx->codec_id || par->width != dec_ctx->width || par->height != dec_ctx->height)
+        {
+            fprintf(stderr, "playlist: %s does not match the first recording, skipped\n", filename);
+            avformat_close_input(&next);
+            CloseMappedInput(nextIO);
+            continue;
+        }
+        const AVCodecParameters *prev = fmt_ctx->streams[video_stream_index]->codecpar;
+        bool newHeaders = par->extradata_size != prev->extradata_size ||
+                          (par->extradata_size && memcmp(par->extradata, prev->extradata, par->extradata_size));
+
+        avformat_close_input(&fmt_ctx);
+        CloseMappedInput(mmapIO);
+        fmt_ctx = next;
+        mmapIO = nextIO;
+        video_stream_index = stream;
+        //the recording starts on a keyframe, the drained decoder goes on unless the stream headers changed
+        if (newHeaders)
+        {
+            avcodec_free_context(&dec_ctx);
+            if (OpenDecoder(dec, par) < 0)
+            {
+                fprintf(stderr, "playlist: cannot open the decoder for %s, stopping\n", filename);
+                return false;
+            }
+        }
+        inputSwitched = true;
+        MV_LOG(LOG_LEVEL_INFO, logFile, "==== Playlist %d/%d: %s ====\n", (int)playlistIndex + 1, (int)playlist.size(), filename);
+        return true;
+    }
+    return false;
+}
+
 int MoveDetector::decode(AVCodecContext *avctx, AVFrame *frame, int *got_frame, AVPacket *pkt)
 {
     int ret;
@@ -189,21 +337,191 @@ void MoveDetector::Close(void)
 {
     if (dec_ctx)  avcodec_close(dec_ctx);
     if (fmt_ctx)  avformat_close_input(&fmt_ctx);
+    if (followIO) CloseFollowInput();
+    if (mmapIO)   CloseMappedInput(mmapIO);
+    DropProbedPackets();
+    avcodec_parameters_free(&cachedParams);
     if (frame)    av_freep(&frame);
-    if (movemask_file_flag) fclose(fvideomask_desc);
+    if (maskOutput || reportOutput) CloseStreamOutputs();
+    if (resultRing) CloseResultRing();
+    if (eventFile || eventOutput) CloseEvents();
+    if (fvideomask_desc) fclose(fvideomask_desc);
 }
 
-void MoveDetector::WriteMaskFile(FILE *filemask) {
+//-o and --report to a stream: both are written to memory streams, every frame's bytes become one queued message
+void MoveDetector::OpenStreamOutputs(bool maskStream)
+{
+    if (maskStream)
+    {
+        maskOutput.reset(new OutputQueue(mask_filename, outputPolicy, outputQueueBytes));
+        fvideomask_desc = open_memstream(&maskStreamBuffer, &maskStreamSize);
+    }
+    if (!reportTarget.empty())
+        reportOutput.reset(new OutputQueue(reportTarget, outputPolicy, outputQueueBytes));
+}
 
-	int i, j;
+//what was written to the memory stream since the last call; the stream starts over for the next message
+void MoveDetector::PushStreamOutput(OutputQueue *queue, FILE *stream, char *&buffer, OutputQueue::Kind kind)
+{
+    fflush(stream);
+    long size = ftell(stream);
+    if (size > 0)
+        queue->Push(kind, buffer, size);
+    rewind(stream);
+}
+
+void MoveDetector::CloseStreamOutputs()
+{
+    if (maskOutput)
+    {
+        maskOutput->Finish();
+        maskOutput->PrintStats(logFile);
+        maskOutput.reset();
+        fclose(fvideomask_desc);
+        fvideomask_desc = NULL;
+        free(maskStreamBuffer);
+        maskStreamBuffer = NULL;
+    }
+    if (reportOutput)
+    {
+        reportOutput->Finish();
+        reportOutput->PrintStats(logFile);
+        reportOutput.reset();
+    }
+}
+
+resultArea MoveDetector::AreaRecord(const connectedArea &a)
+{
+    return {a.id, a.areaID, a.size, a.centroidX, a.centroidY, a.directionX, a.directionY, a.directionMag, a.directionAng,
+            a.boundBoxU.x, a.boundBoxU.y, a.boundBoxB.x, a.boundBoxB.y, a.isTracked};
+}
+
+resultTracker MoveDetector::TrackerRecord(const trackedObject &t)
+{
+    return {t.trackerID, t.id, t.size, t.center.x, t.center.y, t.direction.x, t.direction.y,
+            t.boundBoxU.x, t.boundBoxU.y, t.boundBoxB.x, t.boundBoxB.y, t.iou, t.currStatus, t.lifeTime, t.aliveFor};
+}
+
+//the reported frame into the shared memory ring, created on the first frame when the grid size is known
+void MoveDetector::PublishResults()
+{
+    if (!resultRing)
+    {
+        if (resultRingFailed)
+            return;
+        resultRing.reset(new ShmRingWriter());
+        if (resultRing->Create(resultRingName.c_str(), resultRingSlots, areaGridMarked[0].Rows(), areaGridMarked[0].Cols(),
+                               areaBuffer.Cols(), maxTrackers) < 0)
+        {
+            fprintf(stderr, "cannot create the shared memory ring %s: %s\n", resultRingName.c_str(), strerror(errno));
+            resultRing.reset();
+            resultRingFailed = true;
+            return;
+        }
+    }
+    //a later playlist entry with a larger grid than the first one
+    const shmRingHeader *ring = resultRing->Header();
+    if (nSectorsY > (int)ring->maxRows || nSectorsX > (int)ring->maxCols)
+    {
+        resultRingSkipped++;
+        return;
+    }
+
+    int32_t *labels;
+    resultArea *areas;
+    resultTracker *trackers;
+    shmFrameHeader *header = resultRing->BeginFrame(&labels, &areas, &trackers);
+    const int oldest = BUFFER_OLDEST(currFrameBuffer);
+    header->frameNumber = lastReportedFrame;
+    header->streamTimeUs = StreamTimeUs(lastReportedFrame);
+    header->rows = nSectorsY;
+    header->cols = nSectorsX;
+    header->cellWidth = output_block_size * mbPerSectorX;
+    header->cellHeight = output_block_size * mbPerSectorY;
+    header->flags = globalMotionFrame[oldest] ? RESULT_FRAME_GLOBAL_MOTION : 0;
+    if (truncatedFrame[oldest])
+        header->flags |= RESULT_FRAME_TRUNCATED;
+    for (int i = 0; i < nSectorsY; i++)
+        memcpy(labels + (size_t)i * nSectorsX, areaGridMarked[oldest][i], nSectorsX * sizeof(int32_t));
+
+    const connectedArea *detectedAreas = areaBuffer[oldest];
+    int n = 0;
+    for (; n < areaBuffer.Cols() && detectedAreas[n].id != 0; n++)
+    {
+        areas[n] = AreaRecord(detectedAreas[n]);
+    }
+    header->areaCount = n;
+
+    n = 0;
+    for (auto &t : trackedObjects)
+    {
+        if (n == (int)ring->maxTrackers)
+        {
+            header->flags |= RESULT_FRAME_TRUNCATED;
+            break;
+        }
+        trackers[n++] = TrackerRecord(t);
+    }
+    header->trackerCount = n;
+    resultRing->EndFrame();
+    resultRingFrames++;
+}
+
+void MoveDetector::CloseResultRing()
+{
+    fprintf(logFile, "Shared memory ring %s: %d frames published", resultRingName.c_str(), resultRingFrames);
+    if (resultRingSkipped)
+        fprintf(logFile, ", %d frames with a larger grid left out", resultRingSkipped);
+    fprintf(logFile, "\n");
+    resultRing.reset();
+}
+
+//cells of the oldest frame in the ring: 0 without motion, -1 in an area no tracker follows, the tracker's ID otherwise
+void MoveDetector::LabelMaskCells()
+{
+    int i, j;
     int u = 0;
+    connectedArea *detectedAreas = areaBuffer[BUFFER_OLDEST(currFrameBuffer)];
+
+    while (detectedAreas[u].id > 0)
+    {
+        for (i = 0; i < nSectorsY; i++)
+        {
+            for (j = 0; j < nSectorsX; j++)
+            {
+                if (areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j])
+                {
+                    if (areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j] == detectedAreas[u].areaID)
+                    {
+                        areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j] = -1;
+                        if (detectedAreas[u].isTracked)
+                        {
+                            for (auto &tracker : trackedObjects)
+                            {
+                                if (tracker.id == detectedAreas[u].id && tracker.currStatus & (TRACKERSTATUS_TRACKING | TRACKERSTATUS_INTOFRAME | TRACKERSTATUS_LOST))
+                                {
+                                    areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j] = tracker.trackerID;
+                                    break;
+                                }
+                            }                            
+                        }
+                    }
+                }
+            }
+        }
+        u++;
+    }
+}
+
+//labelled cells and the trackers on them into maskFrameY/U/V, a colour per grid cell
+void MoveDetector::RenderMask(const Grid<int> &labels, const list<trackedObject> &trackers) {
+
+	int i, j;
     int sector_x, sector_y;
     //uint8_t tmp_table2d_sum[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    uint8_t outFrameY[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    uint8_t outFrameU[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    uint8_t outFrameV[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    uint8_t boundBoxType[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    connectedArea *detectedAreas = areaBuffer[BUFFER_OLDEST(currFrameBuffer)];
+    Grid<uint8_t> &outFrameY = maskFrameY;
+    Grid<uint8_t> &outFrameU = maskFrameU;
+    Grid<uint8_t> &outFrameV = maskFrameV;
 
     // for (sector_y = 0; sector_y < nSectorsY; sector_y++)
     // {
@@ -284,41 +602,11 @@ void MoveDetector::WriteMaskFile(FILE *filemask) {
     if (!amplify_yuv)
         amplify_yuv = 1;
 
-    const uint8_t boxY = 255;
     HsvColor currColorHSV;
     RgbColor currColorRGB;
     currColorHSV.s = 255;
     currColorHSV.v = 255;
 
-    while (detectedAreas[u].id > 0)
-    {
-        for (i = 0; i < nSectorsY; i++)
-        {
-            for (j = 0; j < nSectorsX; j++)
-            {
-                if (areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j])
-                {
-                    if (areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j] == detectedAreas[u].areaID)
-                    {
-                        areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j] = -1;
-                        if (detectedAreas[u].isTracked)
-                        {
-                            for (auto &tracker : trackedObjects)
-                            {
-                                if (tracker.id == detectedAreas[u].id && tracker.currStatus & (TRACKERSTATUS_TRACKING | TRACKERSTATUS_INTOFRAME | TRACKERSTATUS_LOST))
-                                {
-                                    areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][i][j] = tracker.trackerID;
-                                    break;
-                                }
-                            }                            
-                        }
-                    }
-                }
-            }
-        }
-        u++;
-    }
-
     for (sector_y = 0; sector_y < nSectorsY; sector_y++)
     {
         for (j = 0; j < mbPerSectorY * output_block_size; j++)
@@ -331,15 +619,15 @@ void MoveDetector::WriteMaskFile(FILE *filemask) {
                     outFrameU[sector_y][sector_x] = (uint8_t)128;
                     outFrameV[sector_y][sector_x] = (uint8_t)128;
 
-                    if (areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][sector_y][sector_x] > 0)
+                    if (labels[sector_y][sector_x] > 0)
                     {
-                        currColorHSV.h = areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][sector_y][sector_x] % 255;
+                        currColorHSV.h = labels[sector_y][sector_x] % 255;
                         currColorRGB = HsvToRgb(currColorHSV);
                         outFrameY[sector_y][sector_x] = (uint8_t)(CRGB2Y(currColorRGB.r,currColorRGB.g,currColorRGB.b));
                         outFrameU[sector_y][sector_x] = (uint8_t)(CRGB2Cb(currColorRGB.r, currColorRGB.g, currColorRGB.b));
                         outFrameV[sector_y][sector_x] = (uint8_t)(CRGB2Cr(currColorRGB.r, currColorRGB.g, currColorRGB.b));
                     }
-                    else if (areaGridMarked[BUFFER_OLDEST(currFrameBuffer)][sector_y][sector_x] == -1)
+                    else if (labels[sector_y][sector_x] == -1)
                     {
                         outFrameY[sector_y][sector_x] = (uint8_t)255;
                     }
@@ -353,13 +641,18 @@ void MoveDetector::WriteMaskFile(FILE *filemask) {
             }
         }
     }
-    for (auto const &i : trackedObjects)
+    //a lost tracker moves on with its last direction and can leave the grid: its marks stay on the border cells
+    auto cellRow = [this](int y) { return std::min(std::max(y / output_block_size, 0), nSectorsY - 1); };
+    auto cellCol = [this](int x) { return std::min(std::max(x / output_block_size, 0), nSectorsX - 1); };
+    for (auto const &i : trackers)
     {
         currColorHSV.h = ((i.trackerID % 255) + 128) % 255;
         currColorRGB = HsvToRgb(currColorHSV);
-        uint8_t *y = &outFrameU[int(i.center.y / output_block_size)][int(i.center.x / output_block_size)];
-        uint8_t *u = &outFrameU[int(i.center.y / output_block_size)][int(i.center.x / output_block_size)];
-        uint8_t *v = &outFrameV[int(i.center.y / output_block_size)][int(i.center.x / output_block_size)];
+        const int centerRow = cellRow(i.center.y);
+        const int centerCol = cellCol(i.center.x);
+        uint8_t *y = &outFrameU[centerRow][centerCol];
+        uint8_t *u = &outFrameU[centerRow][centerCol];
+        uint8_t *v = &outFrameV[centerRow][centerCol];
         *y = (uint8_t)(CRGB2Y(currColorRGB.r, currColorRGB.g, currColorRGB.b) - 128);
         *u = (uint8_t)(CRGB2Cb(currColorRGB.r, currColorRGB.g, currColorRGB.b));
         *v = (uint8_t)(CRGB2Cr(currColorRGB.r, currColorRGB.g, currColorRGB.b));
@@ -427,36 +720,36 @@ void MoveDetector::WriteMaskFile(FILE *filemask) {
             }
         }
 
-        for (int u = i.boundBoxU.y / output_block_size; u < i.boundBoxB.y / output_block_size; u += output_block_size)
+        const int top = cellRow(i.boundBoxU.y), bottom = cellRow(i.boundBoxB.y);
+        const int left = cellCol(i.boundBoxU.x), right = cellCol(i.boundBoxB.x);
+        for (int u = top; u < bottom; u += output_block_size)
         {
-            outFrameY[u][i.boundBoxU.x / output_block_size] = boxColorY;
-            outFrameU[u][i.boundBoxU.x / output_block_size] = boxColorU;
-            outFrameV[u][i.boundBoxU.x / output_block_size] = boxColorV;
+            outFrameY[u][left] = boxColorY;
+            outFrameU[u][left] = boxColorU;
+            outFrameV[u][left] = boxColorV;
         }
-        for (int u = i.boundBoxU.y / output_block_size; u < i.boundBoxB.y / output_block_size; u += output_block_size)
+        for (int u = top; u < bottom; u += output_block_size)
         {
-            outFrameY[u][i.boundBoxB.x / output_block_size] = boxColorY;
-            outFrameU[u][i.boundBoxB.x / output_block_size] = boxColorU;
-            outFrameV[u][i.boundBoxB.x / output_block_size] = boxColorV;
+            outFrameY[u][right] = boxColorY;
+            outFrameU[u][right] = boxColorU;
+            outFrameV[u][right] = boxColorV;
         }
-        for (int u = i.boundBoxU.x / output_block_size; u < i.boundBoxB.x / output_block_size; u += output_block_size)
+        for (int u = left; u < right; u += output_block_size)
         {
-            outFrameY[i.boundBoxU.y / output_block_size][u] = boxColorY;
-            outFrameU[i.boundBoxU.y / output_block_size][u] = boxColorU;
-            outFrameV[i.boundBoxU.y / output_block_size][u] = boxColorV;
+            outFrameY[top][u] = boxColorY;
+            outFrameU[top][u] = boxColorU;
+            outFrameV[top][u] = boxColorV;
         }
-        for (int u = i.boundBoxU.x / output_block_size; u < i.boundBoxB.x / output_block_size; u += output_block_size)
+        for (int u = left; u < right; u += output_block_size)
         {
-            outFrameY[i.boundBoxB.y / output_block_size][u] = boxColorY;
-            outFrameU[i.boundBoxB.y / output_block_size][u] = boxColorU;
-            outFrameV[i.boundBoxB.y / output_block_size][u] = boxColorV;
+            outFrameY[bottom][u] = boxColorY;
+            outFrameU[bottom][u] = boxColorU;
+            outFrameV[bottom][u] = boxColorV;
         }
     }
-
-    WriteFrameToFile(filemask, outFrameY, outFrameU, outFrameV);
 }
 
-void MoveDetector::WriteFrameToFile(FILE *filemask, uint8_t Y[][MAX_MAP_SIDE], uint8_t U[][MAX_MAP_SIDE], uint8_t V[][MAX_MAP_SIDE])
+void MoveDetector::WriteFrameToFile(FILE *filemask, Grid<uint8_t> &Y, Grid<uint8_t> &U, Grid<uint8_t> &V)
 {
     const unsigned char frameheader[] = {0x46, 0x52, 0x41, 0x4D, 0x45, 0x0A};
     if (USE_YUV2MPEG2)
@@ -510,15 +803,168 @@ void MoveDetector::WriteMPEG2Header(FILE *file)
     ostringstream header;
     const unsigned char spacer = {0x20};
     const unsigned char framespacer = {0x0A};
-    header << "YUV4MPEG2" << spacer << "W" << dec_ctx->coded_width << spacer << "H" << dec_ctx->coded_height << spacer;
-    header << "F" << fmt_ctx->streams[video_stream_index]->r_frame_rate.num << ":" << fmt_ctx->streams[video_stream_index]->r_frame_rate.den << spacer;
+    //the size written by WriteFrameToFile, the coded size of the stream can be larger or not known yet
+    AllocAnalyzeBuffers();
+    header << "YUV4MPEG2" << spacer << "W" << output_width << spacer << "H" << output_height << spacer;
+    header << "F" << fmt_ctx->streams[video_stream_index]->r_frame_rate.num << ":" << fmt_ctx->streams[video_stream_index]->r_frame_rate.den * analysisStride << spacer;
     header << "Ip" << spacer << "A1:1" << spacer << "C420" << framespacer;
     fwrite((const void *)(header.str().c_str()), sizeof(char), header.str().size(), file);
 }
 
-void MoveDetector::WriteMapConsole()
+//a grid mask file is a text header line, then "FRAME\n" and a byte per cell, row by row, for every frame:
+//0 without motion, 255 in an area no tracker follows, 1..254 the value of the tracker on the cell. A tracker
+//keeps its value while it lives, no two live trackers share one; it is (ID - 1) % 254 + 1 unless another
+//live tracker already holds that, then the next free one
+void MoveDetector::WriteGridHeader(FILE *file)
 {
-    int i, j;
+    //pooled governor levels are written at the full grid resolution, so the size holds for the whole file
+    AllocAnalyzeBuffers();
+    AVRational rate = fmt_ctx->streams[video_stream_index]->r_frame_rate;
+    fprintf(file, "%s W%d H%d C%d:%d S%d:%d F%d:%d\n", GRID_MASK_MAGIC, nSectorsX * gridPooling, nSectorsY * gridPooling,
+            output_block_size * mbPerSectorX / gridPooling, output_block_size * mbPerSectorY / gridPooling,
+            input_width, input_height, rate.num, rate.den * analysisStride);
+}
+
+void MoveDetector::AssignGridValues(const list<trackedObject> &trackers)
+{
+    bool used[256] = {};
+    std::map<int, uint8_t> live;
+    for (auto &tracker : trackers)
+    {
+        auto found = gridValues.find(tracker.trackerID);
+        if (found != gridValues.end() && !used[found->second])
+        {
+            live[tracker.trackerID] = found->second;
+            used[found->second] = true;
+        }
+    }
+    for (auto &tracker : trackers)
+    {
+        if (live.count(tracker.trackerID))
+            continue;
+        //more live trackers than values: the last ones share
+        int value = (tracker.trackerID - 1) % 254 + 1;
+        for (int k = 0; k < 254 && used[value]; k++)
+            value = value % 254 + 1;
+        live[tracker.trackerID] = value;
+        used[value] = true;
+    }
+    gridValues.swap(live);
+}
+
+void MoveDetector::WriteGridFrame(FILE *file, const Grid<int> &cells, const list<trackedObject> &trackers)
+{
+    AssignGridValues(trackers);
+    const int cols = nSectorsX * gridPooling;
+    std::vector<uint8_t> row(cols);
+
+    fputs("FRAME\n", file);
+    for (int y = 0; y < nSectorsY * gridPooling; y++)
+    {
+        for (int x = 0; x < cols; x++)
+        {
+            int label = cells[y / gridPooling][x / gridPooling];
+            if (label > 0)
+            {
+                auto found = gridValues.find(label);
+                row[x] = found != gridValues.end() ? found->second : (label - 1) % 254 + 1;
+            }
+            else
+                row[x] = label < 0 ? 255 : 0;
+        }
+        fwrite(row.data(), 1, cols, file);
+    }
+}
+
+void MoveDetector::WriteMaskHeader(FILE *file)
+{
+    if (maskFormat == MASK_FORMAT_VIDEO)
+    {
+        //the analysis goes on without the mask
+        if (OpenMaskVideo() < 0)
+            movemask_file_flag = 0;
+    }
+    else if (maskFormat == MASK_FORMAT_GRID)
+        WriteGridHeader(file);
+    else if (USE_YUV2MPEG2)
+        WriteMPEG2Header(file);
+}
+
+void MoveDetector::PrintMaskHint()
+{
+    if (maskFormat == MASK_FORMAT_GRID)
+        fprintf(stderr, "Unpack mask file: motion_detect --unpack-mask %s -o mask.y4m \n\n", mask_filename);
+    else if (USE_YUV2MPEG2 || maskFormat == MASK_FORMAT_VIDEO)
+        fprintf(stderr, "Play mask file: mplayer %s -loop 0 \n\n", mask_filename);
+    else
+        fprintf(stderr, "Play mask file: mplayer -demuxer rawvideo -rawvideo w=%d:h=%d:format=i420 %s -loop 0 \n\n", output_width, output_height, mask_filename);
+}
+
+//a grid mask file back to a y4m stream in the colours of -o
+int MoveDetector::UnpackGridMask(const char *filename, FILE *out)
+{
+    FILE *in = fopen(filename, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "cannot open %s\n", filename);
+        return -1;
+    }
+    char magic[16] = {};
+    int cols = 0, rows = 0, cellWidth = 0, cellHeight = 0, width = 0, height = 0, rateNum = 0, rateDen = 0;
+    if (fscanf(in, "%15s W%d H%d C%d:%d S%d:%d F%d:%d", magic, &cols, &rows, &cellWidth, &cellHeight, &width, &height, &rateNum, &rateDen) != 9 ||
+        strcmp(magic, GRID_MASK_MAGIC) || fgetc(in) != '\n' || cols <= 0 || rows <= 0 || cellWidth <= 0 || cellHeight <= 0)
+    {
+        fprintf(stderr, "%s is not a grid mask file\n", filename);
+        fclose(in);
+        return -1;
+    }
+
+    //chroma is subsampled, cells of an odd size are rounded up
+    cellWidth += cellWidth & 1;
+    cellHeight += cellHeight & 1;
+    const int outWidth = cols * cellWidth, outHeight = rows * cellHeight;
+    fprintf(out, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420\n", outWidth, outHeight, rateNum, rateDen);
+
+    //colour of every cell value, as in RenderMask
+    uint8_t lutY[256], lutU[256], lutV[256];
+    for (int value = 0; value < 256; value++)
+    {
+        HsvColor hsv = {(unsigned char)(value % 255), 255, 255};
+        RgbColor rgb = HsvToRgb(hsv);
+        lutY[value] = value == 0 ? 32 : value == 255 ? 255 : CRGB2Y(rgb.r, rgb.g, rgb.b);
+        lutU[value] = value == 0 || value == 255 ? 128 : CRGB2Cb(rgb.r, rgb.g, rgb.b);
+        lutV[value] = value == 0 || value == 255 ? 128 : CRGB2Cr(rgb.r, rgb.g, rgb.b);
+    }
+
+    std::vector<uint8_t> cells((size_t)cols * rows), line(outWidth);
+    char frameHeader[8];
+    int frames = 0;
+    while (fread(frameHeader, 1, 6, in) == 6 && !memcmp(frameHeader, "FRAME\n", 6) && fread(cells.data(), 1, cells.size(), in) == cells.size())
+    {
+        fputs("FRAME\n", out);
+        const uint8_t *lut[3] = {lutY, lutU, lutV};
+        for (int plane = 0; plane < 3; plane++)
+        {
+            const int shift = plane ? 1 : 0;
+            const int planeWidth = outWidth >> shift, cw = cellWidth >> shift, ch = cellHeight >> shift;
+            for (int y = 0; y < rows; y++)
+            {
+                for (int x = 0; x < planeWidth; x++)
+                    line[x] = lut[plane][cells[(size_t)y * cols + x / cw]];
+                for (int k = 0; k < ch; k++)
+                    fwrite(line.data(), 1, planeWidth, out);
+            }
+        }
+        frames++;
+    }
+    fclose(in);
+    fprintf(stderr, "%d frames of %dx%d cells unpacked to %dx%d\n", frames, cols, rows, outWidth, outHeight);
+    return 0;
+}
+
+void MoveDetector::WriteMapConsole(FILE *file)
+{
+    int i;
     // fprintf(stderr, "\n\n ==== 2D MAP ====\n");
 
     // for (i = 0; i < nSectorsY; i++)
@@ -638,17 +1084,25 @@ void MoveDetector::WriteMapConsole()
 
     // fprintf(stdout, "\n");
 
-    fprintf(stderr, "---- Detected areas ---- \n");
+    fprintf(file, "---- Detected areas ---- \n");
     int currId = 1;
     i = 0;
 
     connectedArea *detectedAreas = areaBuffer[BUFFER_OLDEST(currFrameBuffer)];
+    if (globalMotionCompensation)
+    {
+        const globalMotionModel &gm = globalMotion[BUFFER_OLDEST(currFrameBuffer)];
+        fprintf(file, "Global motion: (%6.2f %6.2f) + x(%5.3f %5.3f) + y(%5.3f %5.3f)  Inliers: %4.2f  %s\n",
+                gm.a[0], gm.a[3], gm.a[1], gm.a[4], gm.a[2], gm.a[5], gm.inlierRatio, gm.applied ? "compensated" : "not compensated");
+    }
+    if (globalMotionFrame[BUFFER_OLDEST(currFrameBuffer)])
+        fprintf(file, "(global motion frame, labelling and tracking skipped)\n");
     while (currId)
     {
         if ((i < MAX_CONNAREAS) && (detectedAreas[i].id != 0))
         {
             currId = detectedAreas[i].id;
-            fprintf(stderr, "ID: %5d  Size: %5d  Center: (%6.2f %6.2f) dirX/dirY: %6.2f %6.2f  Mag/Angle: %6.2f %6.2f \n",
+            fprintf(file, "ID: %5d  Size: %5d  Center: (%6.2f %6.2f) dirX/dirY: %6.2f %6.2f  Mag/Angle: %6.2f %6.2f \n",
                     detectedAreas[i].id,
                     detectedAreas[i].size,
                     detectedAreas[i].centroidX,
@@ -663,10 +1117,10 @@ void MoveDetector::WriteMapConsole()
             break;
     }
 
-    fprintf(stderr, "---- Tracked objects ---- \n");
+    fprintf(file, "---- Tracked objects ---- \n");
     for (auto &i : trackedObjects)
     {
-        fprintf(stderr, "Tracker ID: %5d  Current area: %5d  Next area: %5d Center: (%4d %4d) dirX/dirY: %4d %4d FTL: %d  IoU: %4.2f  Status: %d\n",
+        fprintf(file, "Tracker ID: %5d  Current area: %5d  Next area: %5d Center: (%4d %4d) dirX/dirY: %4d %4d FTL: %d  IoU: %4.2f  Status: %d\n",
                 i.trackerID,
                 i.id,
                 i.candidateArea->id,
@@ -679,6 +1133,6 @@ void MoveDetector::WriteMapConsole()
                 i.currStatus);
     }
 
-    fprintf(stderr, "\n");
+    fprintf(file, "\n");
 }
 
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mv_log.h"
+
+static const size_t logSlots = 4096;          //power of two
+static const int logLineSize = 240;           //longer messages are allocated
+static const size_t logBatchSize = 1 << 16;   //bytes to one file in one write
+static const int logBatchMs = 10;             //between drains while messages keep coming
+
+static const char *logLevelNames[] = {"error", "warning", "info", "frame", "debug"};
+
+//a slot is free for the message at position p when its sequence is p, holds it when it is p + 1
+struct logSlot
+{
+    std::atomic<size_t> sequence;
+    FILE *file;
+    std::string *block;
+    int length;
+    char text[logLineSize];
+};
+
+static logSlot slots[logSlots];
+static std::atomic<size_t> enqueuePosition(0);
+static std::atomic<long> droppedMessages(0);
+static std::atomic<bool> writerSleeping(false);
+static std::atomic<bool> writerStarted(false);
+static std::once_flag startOnce;
+static std::thread *writer;
+
+//the writer's own
+static size_t readPosition;
+
+static std::mutex writerLock;
+static std::condition_variable writerWake;
+static std::condition_variable flushed;
+static std::condition_variable slotsFreed;
+static size_t writtenPosition;
+static int flushWaiters;
+static int slotWaiters;
+static bool stopping;
+
+std::atomic<int> Logger::currentLevel(LOG_LEVEL_INFO);
+
+static bool SlotReady()
+{
+    return slots[readPosition & (logSlots - 1)].sequence.load(std::memory_order_acquire) == readPosition + 1;
+}
+
+static void WriteBatch(std::string &batch, FILE *file)
+{
+    if (!batch.empty())
+        fwrite(batch.data(), 1, batch.size(), file);
+    batch.clear();
+}
+
+//consecutive messages to the same file go out in one write
+static size_t Drain(std::vector<FILE *> &touched)
+{
+    std::string batch;
+    FILE *batchFile = NULL;
+    size_t count = 0;
+    while (SlotReady())
+    {
+        logSlot &slot = slots[readPosition & (logSlots - 1)];
+        if (slot.file != batchFile || batch.size() >= logBatchSize)
+        {
+            WriteBatch(batch, batchFile);
+            batchFile = slot.file;
+            if (std::find(touched.begin(), touched.end(), batchFile) == touched.end())
+                touched.push_back(batchFile);
+        }
+        if (slot.block)
+        {
+            batch += *slot.block;
+            delete slot.block;
+        }
+        else
+            batch.append(slot.text, slot.length);
+        slot.sequence.store(readPosition + logSlots, std::memory_order_release);
+        readPosition++;
+        count++;
+    }
+    WriteBatch(batch, batchFile);
+    return count;
+}
+
+static void WriterLoop()
+{
+    std::vector<FILE *> touched;
+    while (1)
+    {
+        const size_t count = Drain(touched);
+        long dropped = droppedMessages.exchange(0);
+        if (dropped)
+            fprintf(stderr, "log: %ld messages dropped, the log ring was full\n", dropped);
+
+        std::unique_lock<std::mutex> guard(writerLock);
+        if (slotWaiters && count > 0)
+            slotsFreed.notify_all();
+        if (flushWaiters || count == 0 || stopping)
+        {
+            for (FILE *file : touched)
+                fflush(file);
+            touched.clear();
+            writtenPosition = readPosition;
+            flushed.notify_all();
+        }
+        if (stopping && !SlotReady())
+            break;
+        //while messages keep coming they are collected for a while; an idle writer sleeps until the next one
+        if (count > 0)
+        {
+            if (!flushWaiters && !slotWaiters)
+                writerWake.wait_for(guard, std::chrono::milliseconds(logBatchMs));
+            continue;
+        }
+        writerSleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        writerWake.wait(guard, [] { return SlotReady() || flushWaiters || slotWaiters || stopping; });
+        writerSleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+static void StartWriter()
+{
+    for (size_t i = 0; i < logSlots; i++)
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    writer = new std::thread(WriterLoop);
+    writerStarted.store(true, std::memory_order_release);
+    //error paths leave through exit()
+    atexit(Logger::Stop);
+}
+
+//a free slot for the next message. A full ring drops it (NULL), or with wait, blocks until the writer frees a slot
+static logSlot *Claim(FILE *file, size_t &position, bool wait)
+{
+    std::call_once(startOnce, StartWriter);
+    position = enqueuePosition.load(std::memory_order_relaxed);
+    while (1)
+    {
+        logSlot *slot = &slots[position & (logSlots - 1)];
+        const intptr_t diff = (intptr_t)slot->sequence.load(std::memory_order_acquire) - (intptr_t)position;
+        if (diff == 0)
+        {
+            if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                slot->file = file;
+                slot->block = NULL;
+                return slot;
+            }
+        }
+        else if (diff < 0 && wait)
+        {
+            std::unique_lock<std::mutex> guard(writerLock);
+            if (stopping)
+                return NULL;
+            slotWaiters++;
+            writerWake.notify_one();
+            slotsFreed.wait(guard, [&] { return (intptr_t)slot->sequence.load(std::memory_order_acquire) - (intptr_t)position >= 0 || stopping; });
+            slotWaiters--;
+            position = enqueuePosition.load(std::memory_order_relaxed);
+        }
+        else if (diff < 0)
+        {
+            droppedMessages++;
+            return NULL;
+        }
+        else
+            position = enqueuePosition.load(std::memory_order_relaxed);
+    }
+}
+
+static void Publish(logSlot *slot, size_t position)
+{
+    slot->sequence.store(position + 1, std::memory_order_release);
+    //pairs with the writer's fence before it goes to sleep: either it sees the message or this sees it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writerSleeping.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        writerWake.notify_one();
+    }
+}
+
+int Logger::LevelFromName(const char *name)
+{
+    for (int level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++)
+        if (strcmp(name, logLevelNames[level]) == 0)
+            return level;
+    return -1;
+}
+
+void Logger::Printf(FILE *file, const char *format, ...)
+{
+    size_t position;
+    logSlot *slot = Claim(file, position, false);
+    if (!slot)
+        return;
+
+    va_list args, again;
+    va_start(args, format);
+    va_copy(again, args);
+    int length = vsnprintf(slot->text, logLineSize, format, args);
+    if (length >= logLineSize)
+    {
+        slot->block = new std::string(length, '\0');
+        vsnprintf(&(*slot->block)[0], length + 1, format, again);
+    }
+    slot->length = std::max(std::min(length, logLineSize - 1), 0);
+    va_end(again);
+    va_end(args);
+    Publish(slot, position);
+}
+
+void Logger::Write(FILE *file, const char *data, size_t size)
+{
+    size_t position;
+    logSlot *slot = Claim(file, position, true);
+    if (!slot)
+        return;
+    if (size < (size_t)logLineSize)
+        memcpy(slot->text, data, size);
+    else
+        slot->block = new std::string(data, size);
+    slot->length = size;
+    Publish(slot, position);
+}
+
+void Logger::Flush()
+{
+    if (!writerStarted.load(std::memory_order_acquire))
+        return;
+    const size_t target = enqueuePosition.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> guard(writerLock);
+    flushWaiters++;
+    writerWake.notify_one();
+    flushed.wait(guard, [&] { return writtenPosition >= target || stopping; });
+    flushWaiters--;
+}
+
+void Logger::Stop()
+{
+    if (!writerStarted.exchange(false))
+        return;
+    {
+        std::lock_guard<std::mutex> guard(writerLock);
+        stopping = true;
+    }
+    writerWake.notify_one();
+    slotsFreed.notify_all();
+    writer->join();
+    delete writer;
+    writer = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef MV_LOG_H
+#define MV_LOG_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdio.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_FRAME 3       //a line per decoded and per reported frame
+#define LOG_LEVEL_DEBUG 4
+
+//a message above the current level costs a load and a compare, its arguments are not evaluated
+#define MV_LOG(level, file, ...)                  \
+    do                                            \
+    {                                             \
+        if (Logger::Enabled(level))               \
+            Logger::Printf(file, __VA_ARGS__);    \
+    } while (0)
+
+//process-wide: any thread formats its messages straight into a lock-free ring, one thread of the logger's
+//own writes them to their files in the order they were queued. A full ring drops messages and counts them,
+//the analysis never waits for the terminal or the journal over a diagnostic.
+class Logger
+{
+  public:
+    static void SetLevel(int level) { currentLevel.store(level, std::memory_order_relaxed); }
+    static bool Enabled(int level) { return level <= currentLevel.load(std::memory_order_relaxed); }
+    //error, warning, info, frame or debug; -1 for anything else
+    static int LevelFromName(const char *name);
+
+    static void Printf(FILE *file, const char *format, ...) __attribute__((format(printf, 2, 3)));
+    //a block of text written as it is, whatever the level. It is product output, not a diagnostic: on a full
+    //ring this waits for the writer instead of dropping it
+    static void Write(FILE *file, const char *data, size_t size);
+    //returns once everything queued so far is written and flushed: before a file is closed or read back
+    static void Flush();
+    //flushes and stops the writer, at exit
+    static void Stop();
+
+  private:
+    static std::atomic<int> currentLevel;
+};
+
+#endif
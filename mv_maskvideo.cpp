@@ -0,0 +1,230 @@
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "motion_watch.h"
+
+static const size_t maskVideoQueue = 32;     //rendered frames waiting for the encoder before the analysis waits
+
+//the grids of one rendered mask; pooled governor levels change their size, not the picture's
+struct maskGridFrame
+{
+    int rows, cols;
+    int cellWidth, cellHeight;
+    std::vector<uint8_t> y, u, v;
+};
+
+struct maskEncoder
+{
+    AVFormatContext *ctx;
+    AVCodecContext *enc;
+    AVFrame *picture;
+    int64_t nextPts;
+    int64_t bytes;
+    int frames;
+    int waits;
+
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable room;
+    std::deque<maskGridFrame> queue;
+    bool closing;
+};
+
+static void WriteMaskPackets(maskEncoder *video, const char *filename)
+{
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    while (avcodec_receive_packet(video->enc, &packet) >= 0)
+    {
+        av_packet_rescale_ts(&packet, video->enc->time_base, video->ctx->streams[0]->time_base);
+        packet.stream_index = 0;
+        video->bytes += packet.size;
+        if (av_interleaved_write_frame(video->ctx, &packet) < 0)
+            fprintf(stderr, "cannot write to the mask video %s\n", filename);
+        av_packet_unref(&packet);
+    }
+}
+
+//every cell repeated over its block of the picture, chroma at half the size
+static void UpsampleMask(const maskGridFrame &grid, AVFrame *picture)
+{
+    const std::vector<uint8_t> *planes[3] = {&grid.y, &grid.u, &grid.v};
+    for (int plane = 0; plane < 3; plane++)
+    {
+        const int shift = plane ? 1 : 0;
+        const int cellWidth = grid.cellWidth >> shift, cellHeight = grid.cellHeight >> shift;
+        const int width = picture->width >> shift;
+        for (int row = 0; row < grid.rows; row++)
+        {
+            uint8_t *line = picture->data[plane] + (ptrdiff_t)row * cellHeight * picture->linesize[plane];
+            const uint8_t *cells = planes[plane]->data() + (size_t)row * grid.cols;
+            for (int col = 0; col < grid.cols && col * cellWidth < width; col++)
+                memset(line + col * cellWidth, cells[col], std::min(cellWidth, width - col * cellWidth));
+            for (int k = 1; k < cellHeight; k++)
+                memcpy(line + (ptrdiff_t)k * picture->linesize[plane], line, width);
+        }
+    }
+}
+
+static void MaskEncoderLoop(maskEncoder *video, std::string filename)
+{
+    while (1)
+    {
+        maskGridFrame grid;
+        {
+            std::unique_lock<std::mutex> guard(video->lock);
+            video->wake.wait(guard, [&] { return !video->queue.empty() || video->closing; });
+            if (video->queue.empty())
+                break;
+            grid = std::move(video->queue.front());
+            video->queue.pop_front();
+        }
+        video->room.notify_one();
+
+        //the encoder may still hold the last picture as a reference
+        if (av_frame_make_writable(video->picture) < 0)
+            continue;
+        UpsampleMask(grid, video->picture);
+        video->picture->pts = video->nextPts++;
+        if (avcodec_send_frame(video->enc, video->picture) >= 0)
+            video->frames++;
+        WriteMaskPackets(video, filename.c_str());
+    }
+    avcodec_send_frame(video->enc, NULL);
+    WriteMaskPackets(video, filename.c_str());
+}
+
+//in place of the y4m header: the encoder, the container named by the file extension and the encoding thread
+int MoveDetector::OpenMaskVideo()
+{
+    AllocAnalyzeBuffers();
+    AVCodec *codec = avcodec_find_encoder_by_name(maskCodec.c_str());
+    if (!codec)
+    {
+        fprintf(stderr, "no encoder %s for the mask video in this FFmpeg build\n", maskCodec.c_str());
+        return -1;
+    }
+
+    maskEncoder *video = new maskEncoder();
+    if (avformat_alloc_output_context2(&video->ctx, NULL, NULL, mask_filename) < 0 || !video->ctx)
+    {
+        fprintf(stderr, "no container for the mask video %s\n", mask_filename);
+        delete video;
+        return -1;
+    }
+    AVStream *st = avformat_new_stream(video->ctx, NULL);
+    video->enc = avcodec_alloc_context3(codec);
+    video->picture = av_frame_alloc();
+
+    AVRational rate = fmt_ctx->streams[video_stream_index]->r_frame_rate;
+    if (rate.num <= 0 || rate.den <= 0)
+        rate = AVRational{25, 1};
+    rate.den *= analysisStride;
+    int ret = st && video->enc && video->picture ? 0 : AVERROR(ENOMEM);
+    if (ret >= 0)
+    {
+        video->enc->width = output_width;
+        video->enc->height = output_height;
+        video->enc->pix_fmt = AV_PIX_FMT_YUV420P;
+        video->enc->time_base = av_inv_q(rate);
+        video->enc->framerate = rate;
+        //the encoding thread is the parallelism, the encoder runs on it alone
+        video->enc->thread_count = 1;
+        //fixed quality for the codecs that take a quantiser, lossless x264; FFV1 is lossless anyway
+        video->enc->flags |= AV_CODEC_FLAG_QSCALE;
+        video->enc->global_quality = FF_QP2LAMBDA;
+        if (video->ctx->oformat->flags & AVFMT_GLOBALHEADER)
+            video->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        AVDictionary *opts = NULL;
+        av_dict_set(&opts, "preset", "ultrafast", 0);
+        av_dict_set(&opts, "qp", "0", 0);
+        ret = avcodec_open2(video->enc, codec, &opts);
+        av_dict_free(&opts);
+    }
+    if (ret >= 0)
+        ret = avcodec_parameters_from_context(st->codecpar, video->enc);
+    if (ret >= 0)
+    {
+        st->time_base = video->enc->time_base;
+        video->picture->width = output_width;
+        video->picture->height = output_height;
+        video->picture->format = AV_PIX_FMT_YUV420P;
+        ret = av_frame_get_buffer(video->picture, 0);
+    }
+    if (ret >= 0 && !(video->ctx->oformat->flags & AVFMT_NOFILE))
+        ret = avio_open(&video->ctx->pb, mask_filename, AVIO_FLAG_WRITE);
+    if (ret >= 0)
+        ret = avformat_write_header(video->ctx, NULL);
+    if (ret < 0)
+    {
+        fprintf(stderr, "cannot write the mask video %s with %s\n", mask_filename, codec->name);
+        if (video->ctx->pb && !(video->ctx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&video->ctx->pb);
+        avformat_free_context(video->ctx);
+        avcodec_free_context(&video->enc);
+        av_frame_free(&video->picture);
+        delete video;
+        return -1;
+    }
+
+    video->thread = std::thread(MaskEncoderLoop, video, std::string(mask_filename));
+    maskVideo = video;
+    return 0;
+}
+
+//a copy of the rendered grids goes to the encoding thread; a full queue holds the analysis up
+void MoveDetector::QueueMaskFrame()
+{
+    maskGridFrame grid;
+    grid.rows = nSectorsY;
+    grid.cols = nSectorsX;
+    grid.cellWidth = output_block_size * mbPerSectorX;
+    grid.cellHeight = output_block_size * mbPerSectorY;
+    const size_t cells = (size_t)grid.rows * grid.cols;
+    grid.y.resize(cells);
+    grid.u.resize(cells);
+    grid.v.resize(cells);
+    for (int row = 0; row < grid.rows; row++)
+    {
+        memcpy(&grid.y[(size_t)row * grid.cols], maskFrameY[row], grid.cols);
+        memcpy(&grid.u[(size_t)row * grid.cols], maskFrameU[row], grid.cols);
+        memcpy(&grid.v[(size_t)row * grid.cols], maskFrameV[row], grid.cols);
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(maskVideo->lock);
+        if (maskVideo->queue.size() >= maskVideoQueue)
+        {
+            maskVideo->waits++;
+            maskVideo->room.wait(guard, [&] { return maskVideo->queue.size() < maskVideoQueue; });
+        }
+        maskVideo->queue.push_back(std::move(grid));
+    }
+    maskVideo->wake.notify_one();
+}
+
+//drains the queue and the encoder
+void MoveDetector::CloseMaskVideo()
+{
+    {
+        std::lock_guard<std::mutex> guard(maskVideo->lock);
+        maskVideo->closing = true;
+    }
+    maskVideo->wake.notify_one();
+    maskVideo->thread.join();
+
+    av_write_trailer(maskVideo->ctx);
+    if (!(maskVideo->ctx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&maskVideo->ctx->pb);
+    fprintf(logFile, "Mask video: %d frames, %4.2f MB with %s; the analysis waited for the encoder %d times\n",
+            maskVideo->frames, maskVideo->bytes / 1048576.0, maskVideo->enc->codec->name, maskVideo->waits);
+    avformat_free_context(maskVideo->ctx);
+    avcodec_free_context(&maskVideo->enc);
+    av_frame_free(&maskVideo->picture);
+    delete maskVideo;
+    maskVideo = NULL;
+}
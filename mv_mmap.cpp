@@ -0,0 +1,183 @@
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "motion_watch.h"
+
+static const int mmapBufferSize = 1 << 18;        //AVIOContext buffer, reads larger than it bypass it
+static const size_t mmapReadahead = 64 << 20;     //window asked for ahead of the read position
+static const int ioBenchRounds = 2;               //alternating rounds, the best one of each mode counts
+
+//a read-only mapping of the whole input, owned by the AVIOContext it serves
+struct mappedInput
+{
+    uint8_t *data;
+    size_t size;
+    size_t position;
+    size_t prefetched;
+};
+
+static int MappedRead(void *opaque, uint8_t *buf, int size)
+{
+    mappedInput *input = (mappedInput *)opaque;
+    if (input->position >= input->size)
+        return AVERROR_EOF;
+
+    //MADV_WILLNEED on the whole file would read all of it at once, ask for the next window only
+    if (input->position + mmapReadahead / 2 > input->prefetched && input->prefetched < input->size)
+    {
+        size_t pageMask = ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        size_t from = input->position & pageMask;
+        size_t length = std::min(mmapReadahead, input->size - from);
+        madvise(input->data + from, length, MADV_WILLNEED);
+        input->prefetched = from + length;
+    }
+
+    size_t n = std::min((size_t)size, input->size - input->position);
+    memcpy(buf, input->data + input->position, n);
+    input->position += n;
+    return n;
+}
+
+static int64_t MappedSeek(void *opaque, int64_t offset, int whence)
+{
+    mappedInput *input = (mappedInput *)opaque;
+    int64_t target;
+
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case AVSEEK_SIZE:
+        return input->size;
+    case SEEK_SET:
+        target = offset;
+        break;
+    case SEEK_CUR:
+        target = input->position + offset;
+        break;
+    case SEEK_END:
+        target = input->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (target < 0 || target > (int64_t)input->size)
+        return AVERROR(EINVAL);
+    //a jump (triage, --from, segments) starts a new readahead window
+    if ((size_t)target < input->position || (size_t)target > input->prefetched)
+        input->prefetched = target;
+    input->position = target;
+    return target;
+}
+
+//NULL when the input cannot be mapped (not a regular file), the caller then uses the default I/O
+AVIOContext *MoveDetector::OpenMappedInput(const char *filename)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    mappedInput *input = new mappedInput{(uint8_t *)data, (size_t)st.st_size, 0, 0};
+    unsigned char *buffer = (unsigned char *)av_malloc(mmapBufferSize);
+    AVIOContext *io = buffer ? avio_alloc_context(buffer, mmapBufferSize, 0, input, MappedRead, NULL, MappedSeek) : NULL;
+    if (!io)
+    {
+        av_free(buffer);
+        munmap(data, st.st_size);
+        delete input;
+    }
+    return io;
+}
+
+void MoveDetector::CloseMappedInput(AVIOContext *&io)
+{
+    if (!io)
+        return;
+    mappedInput *input = (mappedInput *)io->opaque;
+    munmap(input->data, input->size);
+    delete input;
+    av_freep(&io->buffer);
+    avio_context_free(&io);
+}
+
+//demuxer over the mapping, or over the default file protocol when it cannot be mapped
+int MoveDetector::OpenInputFormat(const char *filename, AVFormatContext *&ctx, AVIOContext *&io, AVDictionary **options)
+{
+    io = useMmap ? OpenMappedInput(filename) : NULL;
+    if (io)
+    {
+        if (!(ctx = avformat_alloc_context()))
+        {
+            CloseMappedInput(io);
+            return AVERROR(ENOMEM);
+        }
+        ctx->pb = io;
+        ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    int ret = avformat_open_input(&ctx, filename, NULL, options);
+    if (ret < 0)
+        CloseMappedInput(io);
+    return ret;
+}
+
+//demux-only passes over the input with the default I/O and with the mapping
+void MoveDetector::MainIOBench(const char *filename)
+{
+    double best[2] = {0.0, 0.0};
+    int64_t bytes = 0, packets = 0;
+    const bool mapped = useMmap;
+
+    for (int round = 0; round < 2 * ioBenchRounds; round++)
+    {
+        useMmap = round % 2;
+        AVFormatContext *ctx = NULL;
+        AVIOContext *io = NULL;
+        AVPacket pkt;
+        if (OpenInputFormat(filename, ctx, io, NULL) < 0 || avformat_find_stream_info(ctx, NULL) < 0)
+        {
+            fprintf(stderr, "io-bench: cannot open %s\n", filename);
+            break;
+        }
+        if (useMmap && !io)
+        {
+            fprintf(stderr, "io-bench: %s cannot be mapped\n", filename);
+            avformat_close_input(&ctx);
+            break;
+        }
+
+        bytes = 0;
+        packets = 0;
+        chrono::high_resolution_clock::time_point start_t = chrono::high_resolution_clock::now();
+        while (av_read_frame(ctx, &pkt) >= 0)
+        {
+            bytes += pkt.size;
+            packets++;
+            av_packet_unref(&pkt);
+        }
+        double seconds = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start_t).count() / 1000000.0;
+        avformat_close_input(&ctx);
+        CloseMappedInput(io);
+
+        double rate = seconds > 0 ? bytes / seconds : 0.0;
+        best[useMmap] = std::max(best[useMmap], rate);
+    }
+    useMmap = mapped;
+
+    fprintf(stderr, "io-bench: %lld packets, %4.2f MB of packet data; best of %d rounds each\n",
+            (long long)packets, bytes / 1048576.0, ioBenchRounds);
+    fprintf(stderr, "  default I/O: %8.2f MB/s\n", best[0] / 1048576.0);
+    fprintf(stderr, "  mmap:        %8.2f MB/s (%+4.1f percent)\n", best[1] / 1048576.0,
+            best[0] > 0 ? (best[1] / best[0] - 1.0) * 100.0 : 0.0);
+}
@@ -0,0 +1,230 @@
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mv_outqueue.h"
+
+static const int reconnectMs = 200;     //between attempts to reach a reader that is not there (yet)
+
+OutputQueue::OutputQueue(const std::string &target, Policy policy, size_t limit)
+    : target(target), policy(policy), limit(limit)
+{
+    queuedBytes = 0;
+    closing = false;
+    written = 0;
+    droppedMasks = 0;
+    droppedEvents = 0;
+    connections = 0;
+
+    //a reader that goes away shows as EPIPE on the write
+    signal(SIGPIPE, SIG_IGN);
+    writer = std::thread(&OutputQueue::WriterLoop, this);
+}
+
+OutputQueue::~OutputQueue()
+{
+    Finish();
+}
+
+void OutputQueue::Finish()
+{
+    if (!writer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+    wake.notify_all();
+    room.notify_all();
+    writer.join();
+}
+
+bool OutputQueue::IsStreamTarget(const char *target)
+{
+    struct stat st;
+    if (strcmp(target, "-") == 0 || strncmp(target, "unix:", 5) == 0)
+        return true;
+    return stat(target, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode));
+}
+
+void OutputQueue::SetHeader(const char *data, size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    header.assign(data, data + size);
+}
+
+//the oldest queued message of this kind, under the lock
+bool OutputQueue::DropOne(Kind kind)
+{
+    for (auto it = queue.begin(); it != queue.end(); ++it)
+    {
+        if (it->kind != kind)
+            continue;
+        queuedBytes -= it->data.size();
+        queue.erase(it);
+        (kind == MASK ? droppedMasks : droppedEvents)++;
+        return true;
+    }
+    return false;
+}
+
+void OutputQueue::Push(Kind kind, const char *data, size_t size)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (queuedBytes + size > limit && !queue.empty() && !closing)
+    {
+        if (policy == DROP_OLDEST)
+        {
+            DropOne(queue.front().kind);
+            continue;
+        }
+        if (policy == DROP_MASKS)
+        {
+            //a new mask frame only pushes older ones out, events wait for room when nothing else can go
+            if (DropOne(MASK))
+                continue;
+            if (kind == MASK)
+            {
+                droppedMasks++;
+                return;
+            }
+        }
+        room.wait(guard);
+    }
+    queue.push_back({kind, std::vector<char>(data, data + size)});
+    queuedBytes += size;
+    guard.unlock();
+    wake.notify_one();
+}
+
+//blocks until a reader is there; -1 once the queue is closing, or when stdout is gone
+int OutputQueue::Connect()
+{
+    const bool socketTarget = strncmp(target.c_str(), "unix:", 5) == 0;
+    const std::string path = socketTarget ? target.substr(5) : target;
+    while (1)
+    {
+        int fd = -1;
+        struct stat st;
+        if (target == "-")
+            fd = connections == 0 ? dup(STDOUT_FILENO) : -1;
+        else if (socketTarget || (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)))
+        {
+            struct sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        else
+        {
+            //a FIFO without a reader fails with ENXIO instead of blocking here
+            fd = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd >= 0)
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        }
+        if (fd >= 0)
+        {
+            connections++;
+            return fd;
+        }
+        if (target == "-")
+            return -1;
+
+        std::unique_lock<std::mutex> guard(lock);
+        if (wake.wait_for(guard, std::chrono::milliseconds(reconnectMs), [&] { return closing; }))
+            return -1;
+    }
+}
+
+bool OutputQueue::WriteAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+void OutputQueue::WriterLoop()
+{
+    int fd = -1;
+    bool gone = false;
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return !queue.empty() || closing; });
+            if (queue.empty())
+                break;
+        }
+
+        //a new reader gets the header first; messages queued meanwhile wait, or are dropped by the policy
+        if (fd < 0 && !gone)
+        {
+            fd = Connect();
+            std::vector<char> head;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                head = header;
+            }
+            if (fd >= 0 && !WriteAll(fd, head.data(), head.size()))
+            {
+                close(fd);
+                fd = -1;
+            }
+            gone = fd < 0 && (target == "-" || closing);
+        }
+
+        message next;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (fd < 0 && !gone)
+                continue;
+            next = std::move(queue.front());
+            queue.pop_front();
+            queuedBytes -= next.data.size();
+        }
+        room.notify_all();
+
+        if (fd >= 0 && WriteAll(fd, next.data.data(), next.data.size()))
+        {
+            written++;
+            continue;
+        }
+        //the reader went away: what it did not get counts as dropped, the next message waits for a new one
+        std::lock_guard<std::mutex> guard(lock);
+        (next.kind == MASK ? droppedMasks : droppedEvents)++;
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+void OutputQueue::PrintStats(FILE *file)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    fprintf(file, "Output %s: %lld messages written, %lld mask frames and %lld events dropped, %d connections\n",
+            target.c_str(), written, droppedMasks, droppedEvents, connections);
+}
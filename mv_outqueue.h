@@ -0,0 +1,73 @@
+#ifndef MV_OUTQUEUE_H
+#define MV_OUTQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+//whole messages (mask frames, report blocks) written to stdout, a FIFO or a Unix socket by a thread of
+//its own; the queue is bounded in bytes and a slow reader costs drops instead of analysis time
+class OutputQueue
+{
+  public:
+    enum Policy
+    {
+        BLOCK,          //the analysis waits for the reader
+        DROP_OLDEST,    //the oldest queued messages make room
+        DROP_MASKS      //mask frames make room, events are never dropped
+    };
+    enum Kind
+    {
+        MASK,
+        EVENT
+    };
+
+    OutputQueue(const std::string &target, Policy policy, size_t limit);
+    ~OutputQueue();
+
+    //"-" (stdout), "unix:<path>", or an existing FIFO or socket
+    static bool IsStreamTarget(const char *target);
+
+    //sent ahead of everything else on every connection, e.g. the y4m header
+    void SetHeader(const char *data, size_t size);
+    void Push(Kind kind, const char *data, size_t size);
+    //writes what is queued while a reader is connected, then stops the writer
+    void Finish();
+    void PrintStats(FILE *file);
+
+  private:
+    struct message
+    {
+        Kind kind;
+        std::vector<char> data;
+    };
+
+    void WriterLoop();
+    int Connect();
+    bool WriteAll(int fd, const char *data, size_t size);
+    bool DropOne(Kind kind);
+
+    std::string target;
+    Policy policy;
+    size_t limit;
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable room;
+    std::deque<message> queue;
+    std::vector<char> header;
+    size_t queuedBytes;
+    bool closing;
+
+    long long written;
+    long long droppedMasks;
+    long long droppedEvents;
+    int connections;
+};
+
+#endif
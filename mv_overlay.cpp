@@ -0,0 +1,212 @@
+#include <limits.h>
+
+extern "C"
+{
+#include <libavutil/pixdesc.h>
+}
+
+#include "motion_watch.h"
+
+static const uint8_t overlayBackgroundY = 32;     //WriteMaskFile's colour of cells without motion
+static const AVRational overlayDefaultRate = {25, 1};
+
+//the encoder is opened on the first frame, which gives the size and pixel format
+int MoveDetector::OpenOverlay(const AVFrame *picture)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)picture->format);
+    if (!desc || desc->nb_components < 3 || desc->comp[0].depth != 8 || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) ||
+        (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+    {
+        fprintf(stderr, "overlay: cannot draw on %s frames\n", desc ? desc->name : "unknown");
+        return -1;
+    }
+
+    AVCodec *codec = avcodec_find_encoder_by_name(overlayCodec.c_str());
+    if (!codec)
+    {
+        fprintf(stderr, "overlay: no encoder %s in this FFmpeg build\n", overlayCodec.c_str());
+        return -1;
+    }
+    if (codec->pix_fmts)
+    {
+        const AVPixelFormat *format = codec->pix_fmts;
+        while (*format != AV_PIX_FMT_NONE && *format != picture->format)
+            format++;
+        if (*format == AV_PIX_FMT_NONE)
+        {
+            fprintf(stderr, "overlay: %s cannot encode %s frames\n", codec->name, desc->name);
+            return -1;
+        }
+    }
+
+    if (avformat_alloc_output_context2(&overlayCtx, NULL, NULL, overlayFile.c_str()) < 0 || !overlayCtx)
+    {
+        fprintf(stderr, "overlay: no container for %s\n", overlayFile.c_str());
+        return -1;
+    }
+    AVStream *st = avformat_new_stream(overlayCtx, NULL);
+    overlayEnc = avcodec_alloc_context3(codec);
+    if (!st || !overlayEnc)
+        return -1;
+
+    //frame numbers are the timestamps
+    AVRational rate = fmt_ctx->streams[video_stream_index]->r_frame_rate;
+    if (rate.num <= 0 || rate.den <= 0)
+        rate = overlayDefaultRate;
+    overlayEnc->width = picture->width;
+    overlayEnc->height = picture->height;
+    overlayEnc->pix_fmt = (AVPixelFormat)picture->format;
+    overlayEnc->sample_aspect_ratio = picture->sample_aspect_ratio;
+    overlayEnc->time_base = av_inv_q(rate);
+    overlayEnc->framerate = rate;
+    overlayEnc->thread_count = 0;
+    if (overlayCtx->oformat->flags & AVFMT_GLOBALHEADER)
+        overlayEnc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    AVDictionary *opts = NULL;
+    av_dict_set(&opts, "preset", overlayPreset.c_str(), 0);
+    int ret = avcodec_open2(overlayEnc, codec, &opts);
+    //encoders without presets leave the option unused
+    if (ret >= 0 && av_dict_get(opts, "preset", NULL, 0))
+        fprintf(stderr, "overlay: %s has no presets, %s is ignored\n", codec->name, overlayPreset.c_str());
+    av_dict_free(&opts);
+    if (ret < 0 || avcodec_parameters_from_context(st->codecpar, overlayEnc) < 0)
+    {
+        fprintf(stderr, "overlay: cannot open the %s encoder\n", codec->name);
+        return -1;
+    }
+    st->time_base = overlayEnc->time_base;
+
+    if ((!(overlayCtx->oformat->flags & AVFMT_NOFILE) && avio_open(&overlayCtx->pb, overlayFile.c_str(), AVIO_FLAG_WRITE) < 0) ||
+        avformat_write_header(overlayCtx, NULL) < 0)
+    {
+        fprintf(stderr, "overlay: cannot write %s\n", overlayFile.c_str());
+        return -1;
+    }
+    MV_LOG(LOG_LEVEL_INFO, logFile, "overlay: %dx%d %s, %s preset %s\n", picture->width, picture->height, desc->name, codec->name, overlayPreset.c_str());
+    return 0;
+}
+
+//the encoder and the container are closed whether the overlay got opened completely or not
+void MoveDetector::CloseOverlay()
+{
+    if (overlayCtx && overlayCtx->pb && !(overlayCtx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&overlayCtx->pb);
+    if (overlayCtx)
+        avformat_free_context(overlayCtx);
+    overlayCtx = NULL;
+    avcodec_free_context(&overlayEnc);
+}
+
+//decoded frames wait here until the motion data of their frame number is known
+void MoveDetector::QueueOverlayFrame(const AVFrame *picture, int frameNumber)
+{
+    if (overlayFailed)
+        return;
+    AVFrame *copy = av_frame_clone(picture);
+    if (copy)
+        overlayFrames.push_back({frameNumber, copy});
+}
+
+//the mask grids of WriteMaskFile blended half and half into the picture, one cell per grid sector
+void MoveDetector::DrawOverlay(AVFrame *picture)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)picture->format);
+    const int cellWidth = output_block_size * mbPerSectorX;
+    const int cellHeight = output_block_size * mbPerSectorY;
+    Grid<uint8_t> *mask[3] = {&maskFrameY, &maskFrameU, &maskFrameV};
+
+    for (int plane = 0; plane < 3; plane++)
+    {
+        const int shiftX = plane ? desc->log2_chroma_w : 0;
+        const int shiftY = plane ? desc->log2_chroma_h : 0;
+        const int width = AV_CEIL_RSHIFT(picture->width, shiftX);
+        const int height = AV_CEIL_RSHIFT(picture->height, shiftY);
+        for (int sector_y = 0; sector_y < nSectorsY; sector_y++)
+        {
+            const int y0 = (sector_y * cellHeight) >> shiftY;
+            const int y1 = std::min(((sector_y + 1) * cellHeight) >> shiftY, height);
+            for (int sector_x = 0; sector_x < nSectorsX; sector_x++)
+            {
+                if (maskFrameY[sector_y][sector_x] == overlayBackgroundY && maskFrameU[sector_y][sector_x] == 128 && maskFrameV[sector_y][sector_x] == 128)
+                    continue;
+                const uint8_t colour = (*mask[plane])[sector_y][sector_x];
+                const int x0 = (sector_x * cellWidth) >> shiftX;
+                const int x1 = std::min(((sector_x + 1) * cellWidth) >> shiftX, width);
+                for (int y = y0; y < y1; y++)
+                {
+                    uint8_t *row = picture->data[plane] + (ptrdiff_t)y * picture->linesize[plane];
+                    for (int x = x0; x < x1; x++)
+                        row[x] = (row[x] + colour + 1) >> 1;
+                }
+            }
+        }
+    }
+}
+
+//a NULL picture drains the encoder
+void MoveDetector::EncodeOverlayFrame(AVFrame *picture)
+{
+    int ret = avcodec_send_frame(overlayEnc, picture);
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    while (ret >= 0 && (ret = avcodec_receive_packet(overlayEnc, &packet)) >= 0)
+    {
+        av_packet_rescale_ts(&packet, overlayEnc->time_base, overlayCtx->streams[0]->time_base);
+        packet.stream_index = 0;
+        if (av_interleaved_write_frame(overlayCtx, &packet) < 0)
+            fprintf(stderr, "overlay: cannot write to %s\n", overlayFile.c_str());
+        av_packet_unref(&packet);
+    }
+}
+
+//frames up to the reported one get its mask: frames in between were not analysed on their own
+void MoveDetector::WriteOverlayFrames(int reportedFrame)
+{
+    while (!overlayFrames.empty() && overlayFrames.front().first <= reportedFrame)
+    {
+        const int frameNumber = overlayFrames.front().first;
+        AVFrame *picture = overlayFrames.front().second;
+        overlayFrames.pop_front();
+
+        if (!overlayFailed && !overlayEnc && OpenOverlay(picture) < 0)
+        {
+            overlayFailed = true;
+            CloseOverlay();
+        }
+        //a playlist entry of another size or format cannot go into the same stream
+        if (!overlayFailed && (picture->width != overlayEnc->width || picture->height != overlayEnc->height || picture->format != overlayEnc->pix_fmt))
+            overlaySkipped++;
+        //the decoder may still reference the picture, drawing happens on a copy then
+        else if (!overlayFailed && av_frame_make_writable(picture) >= 0)
+        {
+            DrawOverlay(picture);
+            picture->pts = frameNumber;
+            picture->pict_type = AV_PICTURE_TYPE_NONE;
+            EncodeOverlayFrame(picture);
+            overlayCount++;
+        }
+        av_frame_free(&picture);
+    }
+}
+
+//frames after the last motion data keep the last mask
+void MoveDetector::FinishOverlay()
+{
+    if (overlayEnc)
+    {
+        WriteOverlayFrames(INT_MAX);
+        EncodeOverlayFrame(NULL);
+        av_write_trailer(overlayCtx);
+        fprintf(logFile, "Overlay: %d frames written to %s", overlayCount, overlayFile.c_str());
+        if (overlaySkipped)
+            fprintf(logFile, ", %d frames of another size or format left out", overlaySkipped);
+        fprintf(logFile, "\n");
+    }
+    for (auto &queued : overlayFrames)
+        av_frame_free(&queued.second);
+    overlayFrames.clear();
+    CloseOverlay();
+}
@@ -1,41 +1,64 @@
 #include <algorithm>
+#include <functional>
 #include <stack>
 
 #include "motion_watch.h"
 
-void MoveDetector::CalculateMagAng()
+int MoveDetector::TileCount(int rows) const
 {
-    int i, j;
-    for (i = 0; i < MAX_MAP_SIDE; ++i)
-        for (j = 0; j < MAX_MAP_SIDE; ++j)
-        {
-            mvGridMag[i][j] = 0;
-            mvGridArg[i][j] = 0;
-        }
+    //with frameParallel the workers are busy with whole frames
+    return workers && !frameParallel ? std::max(std::min(workerThreads, rows), 1) : 1;
+}
 
-    auto *mvGrid = mvGridCoords[BUFFER_CURR(currFrameBuffer)];
+void MoveDetector::RunTiles(int tiles, const std::function<void(int)> &job)
+{
+    if (tiles > 1 && workers)
+        workers->ParallelFor(tiles, job);
+    else
+        for (int t = 0; t < tiles; t++)
+            job(t);
+}
 
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
+//splits the rows into horizontal tiles, one per worker thread
+void MoveDetector::ForEachTile(int rows, const std::function<void(int, int)> &job)
+{
+    const int tiles = TileCount(rows);
+    RunTiles(tiles, [&](int t) { job(rows * t / tiles, rows * (t + 1) / tiles); });
+}
+
+void MoveDetector::CalculateMagAng(Grid<coordinate> &mvGrid, Grid<float> &mag, Grid<float> &arg, const gridSpan &span)
+{
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        int i, j;
+        for (i = rowBegin; i < rowEnd; ++i)
+            for (j = 0; j < span.cols; ++j)
+            {
+                mag[i][j] = 0;
+                arg[i][j] = 0;
+            }
+
+        for (i = rowBegin; i < rowEnd; i++)
         {
-            mvGridArg[i][j] = atan2f(mvGrid[i][j].y, mvGrid[i][j].x);
-            mvGridArg[i][j] = mvGridArg[i][j] * (float)180 / (float)M_PI + (float)180;
-            
-            mvGridMag[i][j] = sqrt(mvGrid[i][j].x *
-                                       mvGrid[i][j].x +
-                                   mvGrid[i][j].y *
-                                       mvGrid[i][j].y);
+            for (j = span.colBegin[i]; j < span.colEnd[i]; j++)
+            {
+                arg[i][j] = atan2f(mvGrid[i][j].y, mvGrid[i][j].x);
+                arg[i][j] = arg[i][j] * (float)180 / (float)M_PI + (float)180;
+
+                mag[i][j] = sqrt(mvGrid[i][j].x *
+                                     mvGrid[i][j].x +
+                                 mvGrid[i][j].y *
+                                     mvGrid[i][j].y);
+            }
         }
-    }
+    });
 }
 
-void MoveDetector::MorphologyProcess()
+void MoveDetector::MorphologyProcess(frameWorkspace &ws)
 {
-    int i, j;
-    int u, v;
-
-    int mvMask[MAX_MAP_SIDE][MAX_MAP_SIDE];
+    int i;
+    const gridSpan &span = ws.fineSpan;
+    Grid<int> &mvMask = ws.mvMask;
+    Grid<int> &areaGridMarkedCurr = areaGridMarked[BUFFER_CURR(ws.frameBuffer)];
 
     // //threshold MVs by vector magnitude
     // for (i = 0; i < nSectorsY; i++)
@@ -50,93 +73,83 @@ void MoveDetector::MorphologyProcess()
     // }
 
     //plug in fg-bg mask from temporal filtering instead
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
+    //edge pixels are set to black for fill to work properly
+    ForEachTile(nSectorsY, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; i++)
         {
-            mvMask[i][j] = areaFgMarked[i][j] > 0 ? 1 : 0;
-        }
-    }
-
-    //set edge pixels to black for fill to work properly
-    for (i = 0; i < nSectorsX; i++)
-        mvMask[0][i] = 0;
-    for (i = 0; i < nSectorsX; i++)
-        mvMask[nSectorsY - 1][i] = 0;
-    for (i = 0; i < nSectorsY; i++)
-        mvMask[i][0] = 0;
-    for (i = 0; i < nSectorsY; i++)
-        mvMask[i][nSectorsX - 1] = 0;
-
-    //flood fill (stack-based)
-
-    std::stack<coordinate> toFill;
-    toFill.push({0, 0});
-
-    coordinate top;
-    while (!toFill.empty())
-    {
-        top = toFill.top();
-        toFill.pop();
-        if ((top.x >= 0 && top.y >= 0) && (top.x < nSectorsX && top.y < nSectorsY) && (mvMask[top.y][top.x]) == 0)
-        {
-            //paints background with '-1'
-            mvMask[top.y][top.x] = -1;
-            toFill.push({top.x + 1, top.y});
-            toFill.push({top.x - 1, top.y});
-            toFill.push({top.x, top.y + 1});
-            toFill.push({top.x, top.y - 1});
-        }
-    }
-    //all holes are now marked with zeros
-
-    //fill holes, restore background to '0'
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
-        {
-            switch (mvMask[i][j])
+            for (int j = 0; j < nSectorsX; j++)
             {
-            case 0:
-                mvMask[i][j] = 1;
-                break;
-            case -1:
-                mvMask[i][j] = 0;
-                break;
+                mvMask[i][j] = ws.areaFgMarked[i][j] > 0 && i > 0 && i < nSectorsY - 1 && j > 0 && j < nSectorsX - 1 ? 1 : 0;
             }
         }
-    }
+    });
+
+    //fill holes: background components that do not reach the edge of the processed span
+    //(the frame border for a full span, background outside of it otherwise)
+    Grid<int> &mvMask_temp = ws.mvMaskTemp;
+    Grid<int> &holeLabels = ws.holeLabels;
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; i++)
+            for (int j = 0; j < span.cols; j++)
+                mvMask_temp[i][j] = span.Contains(j, i) && !mvMask[i][j];
+    });
+    int backgroundCount = DetectConnectedAreas2(ws, mvMask_temp, holeLabels, span);
+
+    const int tiles = TileCount(span.rows);
+    std::vector<std::vector<char>> reachesEdge(tiles, std::vector<char>(backgroundCount + 1, 0));
+    RunTiles(tiles, [&](int t) {
+        for (int i = span.rows * t / tiles; i < span.rows * (t + 1) / tiles; i++)
+            for (int j = span.colBegin[i]; j < span.colEnd[i]; j++)
+                if (!span.Contains(j - 1, i) || !span.Contains(j + 1, i) || !span.Contains(j, i - 1) || !span.Contains(j, i + 1))
+                    reachesEdge[t][holeLabels[i][j]] = 1;
+    });
+    for (int t = 1; t < tiles; t++)
+        for (i = 1; i <= backgroundCount; i++)
+            reachesEdge[0][i] |= reachesEdge[t][i];
+
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; i++)
+            for (int j = span.colBegin[i]; j < span.colEnd[i]; j++)
+                if (holeLabels[i][j] && !reachesEdge[0][holeLabels[i][j]])
+                    mvMask[i][j] = 1;
+    });
 
     //create a temp array
-    int mvMask_temp[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    for (i = 0; i < MAX_MAP_SIDE; ++i)
-        for (j = 0; j < MAX_MAP_SIDE; ++j)
-            mvMask_temp[i][j] = mvMask[i][j];
+    ForEachTile(nSectorsY, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; ++i)
+            for (int j = 0; j < nSectorsX; ++j)
+                mvMask_temp[i][j] = mvMask[i][j];
+    });
 
     //morph closing
     //erode
-    ErodeDilate(useSquareElement, MORPH_OP_ERODE, mvMask, mvMask_temp);
+    ErodeDilate(useSquareElement, MORPH_OP_ERODE, mvMask, mvMask_temp, span);
 
     //remove pixels not adjacent to any other
-    for (i = 0; i < MAX_MAP_SIDE; ++i)
-        for (j = 0; j < MAX_MAP_SIDE; ++j)
-            mvMask_temp[i][j] = mvMask[i][j];
-
-    for (i = 0 + 1; i < nSectorsY - 1; i++)
-    {
-        for (j = 0 + 1; j < nSectorsX - 1; j++)
+    ForEachTile(nSectorsY, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; ++i)
+            for (int j = 0; j < nSectorsX; ++j)
+                mvMask_temp[i][j] = mvMask[i][j];
+    });
+
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        for (int i = std::max(rowBegin, 1); i < std::min(rowEnd, span.rows - 1); i++)
         {
-            if (
-                (mvMask[i - 1][j] == 0) && (mvMask[i + 1][j] == 0) && (mvMask[i][j - 1] == 0) && (mvMask[i][j + 1] == 0))
-                mvMask_temp[i][j] = 0;
+            for (int j = std::max(span.colBegin[i], 1); j < std::min(span.colEnd[i], span.cols - 1); j++)
+            {
+                if (
+                    (mvMask[i - 1][j] == 0) && (mvMask[i + 1][j] == 0) && (mvMask[i][j - 1] == 0) && (mvMask[i][j + 1] == 0))
+                    mvMask_temp[i][j] = 0;
+            }
         }
-    }
+    });
 
     //dilate
-    ErodeDilate(useSquareElement, MORPH_OP_DILATE, mvMask_temp, mvMask);
+    ErodeDilate(useSquareElement, MORPH_OP_DILATE, mvMask_temp, mvMask, span);
 
-    DetectConnectedAreas2(mvMask, areaGridMarked[BUFFER_CURR(currFrameBuffer)]);
-    ProcessConnectedAreas(areaGridMarked[BUFFER_CURR(currFrameBuffer)], areaBuffer[BUFFER_CURR(currFrameBuffer)]);
+    int labelsCount = DetectConnectedAreas2(ws, mvMask, areaGridMarkedCurr, span);
+    truncatedFrame[BUFFER_CURR(ws.frameBuffer)] = LimitConnectedAreas(ws, areaGridMarkedCurr, labelsCount) < labelsCount;
+    ProcessConnectedAreas(ws, areaGridMarkedCurr, areaBuffer[BUFFER_CURR(ws.frameBuffer)]);
     //TrackAreas();
 }
 
@@ -150,7 +163,7 @@ static const char kernelSquare[3][3] = {
     {1, 1, 1}};
 static const int kernelSize = 3;
 
-void MoveDetector::ErodeDilate(int useSquareKernel, int operation, int (*inputArray)[MAX_MAP_SIDE], int (*outputArray)[MAX_MAP_SIDE])
+void MoveDetector::ErodeDilate(int useSquareKernel, int operation, Grid<int> &inputArray, Grid<int> &outputArray, const gridSpan &span)
 {
     //probably wont ever use kernel sizes larger than 3, so this is alright
     char convKernel[kernelSize][kernelSize];
@@ -168,47 +181,46 @@ void MoveDetector::ErodeDilate(int useSquareKernel, int operation, int (*inputAr
     }
 
     //the following is, however, reusable
-    int halfOffset = kernelSize / 2;
-    int doOperation = 0;
-    int u, v;
-    for (int i = 0 + halfOffset; i < nSectorsY - halfOffset; i++)
-    {
-        for (int j = 0 + halfOffset; j < nSectorsX - halfOffset; j++)
+    //tiles only write their own rows; the halo rows of the neighbours are read from inputArray
+    const int halfOffset = kernelSize / 2;
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        int doOperation = 0;
+        int u, v;
+        for (int i = std::max(rowBegin, halfOffset); i < std::min(rowEnd, span.rows - halfOffset); i++)
         {
-            doOperation = 0;
-            //possible to optimize
-            for (u = 0; u < kernelSize; u++)
+            for (int j = std::max(span.colBegin[i], halfOffset); j < std::min(span.colEnd[i], span.cols - halfOffset); j++)
             {
-                for (v = 0; v < kernelSize; v++)
+                doOperation = 0;
+                //possible to optimize
+                for (u = 0; u < kernelSize; u++)
                 {
-                    if ((inputArray[i + u - halfOffset][j + v - halfOffset] == operation) && (convKernel[u][v]))
+                    for (v = 0; v < kernelSize; v++)
                     {
-                        doOperation = 1;
+                        if ((inputArray[i + u - halfOffset][j + v - halfOffset] == operation) && (convKernel[u][v]))
+                        {
+                            doOperation = 1;
+                        }
                     }
                 }
-            }
-            if (doOperation)
-            {
-                outputArray[i][j] = operation;
-            }
-            else
-            {
-                outputArray[i][j] = !operation;
+                if (doOperation)
+                {
+                    outputArray[i][j] = operation;
+                }
+                else
+                {
+                    outputArray[i][j] = !operation;
+                }
             }
         }
-    }
+    });
 }
 
-void MoveDetector::DetectConnectedAreas(int (*inputArray)[MAX_MAP_SIDE], int (*outputArray)[MAX_MAP_SIDE])
+void MoveDetector::DetectConnectedAreas(Grid<int> &inputArray, Grid<int> &outputArray)
 {
 
     int i, j, u, v;
 
-    for (j = 0; j < MAX_MAP_SIDE; ++j)
-        for (i = 0; i < MAX_MAP_SIDE; ++i)
-        {
-            outputArray[i][j] = 0;
-        }
+    outputArray.Clear();
 
     int areasCounter = 1;
     // ABC-mask area detection
@@ -262,87 +274,194 @@ void MoveDetector::DetectConnectedAreas(int (*inputArray)[MAX_MAP_SIDE], int (*o
     }
 }
 
-void MoveDetector::DetectConnectedAreas2(int (*inputArray)[MAX_MAP_SIDE], int (*outputArray)[MAX_MAP_SIDE])
+static int FindLabelRoot(const std::vector<int> &parent, int label)
 {
-    int i, j, u, v;
-
-    for (j = 0; j < MAX_MAP_SIDE; ++j)
-        for (i = 0; i < MAX_MAP_SIDE; ++i)
-        {
-            outputArray[i][j] = 0;
-        }
-
-    std::stack<coordinate> blocks;
-    coordinate top;
-    int currentLabel = 1;
+    while (parent[label] != label)
+        label = parent[label];
+    return label;
+}
 
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
+int MoveDetector::DetectConnectedAreas2(frameWorkspace &ws, Grid<int> &inputArray, Grid<int> &outputArray, const gridSpan &span)
+{
+    std::vector<int> &labelParent = ws.labelParent;
+    std::vector<int> &labelRemap = ws.labelRemap;
+    const int cols = outputArray.Cols();
+    const int tiles = TileCount(span.rows);
+    std::vector<int> tileRoots(tiles + 1, 0);
+
+    ForEachTile(outputArray.Rows(), [&](int rowBegin, int rowEnd) {
+        outputArray.ClearRows(rowBegin, rowEnd);
+    });
+    labelParent.resize((size_t)outputArray.Rows() * cols + 1);
+    labelRemap.resize(labelParent.size());
+
+    //pass 1: flood fill inside each tile; a component is provisionally labelled
+    //with the index of its first cell in raster order, which is also its root
+    RunTiles(tiles, [&](int t) {
+        const int rowBegin = span.rows * t / tiles, rowEnd = span.rows * (t + 1) / tiles;
+        std::stack<coordinate> blocks;
+        coordinate top;
+        for (int i = rowBegin; i < rowEnd; i++)
         {
-            if (!outputArray[i][j] && inputArray[i][j])
+            for (int j = span.colBegin[i]; j < span.colEnd[i]; j++)
             {
-                blocks.push({j, i});
-                while (!blocks.empty())
+                if (!outputArray[i][j] && inputArray[i][j])
                 {
-                    top = blocks.top();
-                    blocks.pop();
-
-                    if ((top.x >= 0 && top.y >= 0) &&
-                        (top.x < nSectorsX && top.y < nSectorsY) &&
-                        (!outputArray[top.y][top.x]) &&
-                        (inputArray[top.y][top.x]))
+                    const int currentLabel = i * cols + j + 1;
+                    labelParent[currentLabel] = currentLabel;
+                    blocks.push({j, i});
+                    while (!blocks.empty())
                     {
-                        outputArray[top.y][top.x] = currentLabel;
-                        blocks.push({top.x + 1, top.y});
-                        blocks.push({top.x - 1, top.y});
-                        blocks.push({top.x, top.y + 1});
-                        blocks.push({top.x, top.y - 1});
+                        top = blocks.top();
+                        blocks.pop();
+
+                        if ((top.x >= 0 && top.y >= rowBegin) &&
+                            (top.x < span.cols && top.y < rowEnd) &&
+                            (!outputArray[top.y][top.x]) &&
+                            (inputArray[top.y][top.x]))
+                        {
+                            outputArray[top.y][top.x] = currentLabel;
+                            blocks.push({top.x + 1, top.y});
+                            blocks.push({top.x - 1, top.y});
+                            blocks.push({top.x, top.y + 1});
+                            blocks.push({top.x, top.y - 1});
+                        }
                     }
                 }
-                currentLabel++;
             }
         }
+    });
+
+    //pass 2: merge components touching across tile seams, the smaller (earlier) root wins
+    for (int t = 1; t < tiles; t++)
+    {
+        const int seam = span.rows * t / tiles;
+        for (int j = 0; j < span.cols; j++)
+        {
+            if (!outputArray[seam - 1][j] || !outputArray[seam][j])
+                continue;
+            int a = FindLabelRoot(labelParent, outputArray[seam - 1][j]);
+            int b = FindLabelRoot(labelParent, outputArray[seam][j]);
+            if (a != b)
+                labelParent[std::max(a, b)] = std::min(a, b);
+        }
+    }
+
+    //pass 3: number the roots in raster order, which gives the same labels as a single flood fill over the frame
+    RunTiles(tiles, [&](int t) {
+        const int rowBegin = span.rows * t / tiles, rowEnd = span.rows * (t + 1) / tiles;
+        int roots = 0;
+        for (int i = rowBegin; i < rowEnd; i++)
+            for (int j = span.colBegin[i]; j < span.colEnd[i]; j++)
+                if (outputArray[i][j] == i * cols + j + 1 && labelParent[outputArray[i][j]] == outputArray[i][j])
+                    roots++;
+        tileRoots[t + 1] = roots;
+    });
+    for (int t = 0; t < tiles; t++)
+        tileRoots[t + 1] += tileRoots[t];
+
+    RunTiles(tiles, [&](int t) {
+        const int rowBegin = span.rows * t / tiles, rowEnd = span.rows * (t + 1) / tiles;
+        int currentLabel = tileRoots[t] + 1;
+        for (int i = rowBegin; i < rowEnd; i++)
+            for (int j = span.colBegin[i]; j < span.colEnd[i]; j++)
+                if (outputArray[i][j] == i * cols + j + 1 && labelParent[outputArray[i][j]] == outputArray[i][j])
+                    labelRemap[outputArray[i][j]] = currentLabel++;
+    });
+
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; i++)
+            for (int j = 0; j < span.cols; j++)
+                if (outputArray[i][j])
+                    outputArray[i][j] = labelRemap[FindLabelRoot(labelParent, outputArray[i][j])];
+    });
+    return tileRoots[tiles];
+}
+
+int MoveDetector::LimitConnectedAreas(frameWorkspace &ws, Grid<int> &markedAreas, int labelsCount)
+{
+    int i, j;
+    const gridSpan &fineSpan = ws.fineSpan;
+
+    if (labelsCount <= maxAreas)
+        return labelsCount;
+
+    //over budget: keep the largest areas, drop the rest back to background
+    std::vector<int> labelSizes(labelsCount + 1, 0);
+    for (i = 0; i < fineSpan.rows; i++)
+        for (j = fineSpan.colBegin[i]; j < fineSpan.colEnd[i]; j++)
+            labelSizes[markedAreas[i][j]]++;
+
+    std::vector<int> sizes(labelSizes.begin() + 1, labelSizes.end());
+    std::nth_element(sizes.begin(), sizes.begin() + maxAreas - 1, sizes.end(), std::greater<int>());
+    const int minKeptSize = sizes[maxAreas - 1];
+
+    //areas larger than the cut-off are always kept, ties are kept in label order
+    int tiesToKeep = maxAreas - std::count_if(sizes.begin(), sizes.end(), [minKeptSize](int x) { return x > minKeptSize; });
+    std::vector<int> newLabel(labelsCount + 1, 0);
+    for (i = 1; i <= labelsCount; i++)
+    {
+        if (labelSizes[i] > minKeptSize)
+            newLabel[i] = i;
+        else if (labelSizes[i] == minKeptSize && tiesToKeep > 0)
+        {
+            newLabel[i] = i;
+            tiesToKeep--;
+        }
     }
+
+    for (i = 0; i < fineSpan.rows; i++)
+        for (j = fineSpan.colBegin[i]; j < fineSpan.colEnd[i]; j++)
+            markedAreas[i][j] = newLabel[markedAreas[i][j]];
+
+    ws.degradation.areaOverflowFrames++;
+    ws.degradation.areasDropped += labelsCount - maxAreas;
+    return maxAreas;
 }
 
-void MoveDetector::ProcessConnectedAreas(int (*markedAreas)[MAX_MAP_SIDE], connectedArea (&processedAreas)[MAX_CONNAREAS])
+void MoveDetector::ProcessConnectedAreas(frameWorkspace &ws, Grid<int> &markedAreas, connectedArea *processedAreas)
 {
-    int i, j ,u;
+    int i, j;
+    const gridSpan &fineSpan = ws.fineSpan;
+    Grid<coordinate> &mvGridCurr = mvGridCoords[BUFFER_CURR(ws.frameBuffer)];
 
     int areaCounter = 0;
     int currentArea = 0;
     connectedArea newArea;
 
     // coordinateF normVector;
-    float length;
+    // float length;
 
     for (i = 0; i < MAX_CONNAREAS; i++)
     {
         processedAreas[i] = {};
     }
 
+    //label -> index in processedAreas, -1 if not added yet
+    std::vector<int> areaIndex;
+
     //enumerate all connected areas in this frame
-    for (i = 0; i < nSectorsY; i++)
+    for (i = 0; i < fineSpan.rows; i++)
     {
-        for (j = 0; j < nSectorsX; j++)
+        for (j = fineSpan.colBegin[i]; j < fineSpan.colEnd[i]; j++)
         {
             if (markedAreas[i][j])
             {
-                //search the list of areas to see if this one is added or not                
+                //look up the list entry for this label
                 currentArea = markedAreas[i][j];
-                //potential bottleneck:
-                connectedArea *findresult =
-                    std::find_if(begin(processedAreas), end(processedAreas),
-                                 [&currentArea](const connectedArea &x) { return x.areaID == currentArea; });
-                //if this one is not in the list, add it
-                if (findresult == end(processedAreas))
+                if (currentArea >= (int)areaIndex.size())
+                    areaIndex.resize(currentArea + 1, -1);
+                //if this one is not in the list, add it (the last entry stays empty as a terminator)
+                if (areaIndex[currentArea] < 0)
                 {
+                    if (areaCounter >= MAX_CONNAREAS - 1)
+                        continue;
+
                     newArea = {};
                     newArea.areaID = currentArea;
                     newArea.size = 1;
-                    newArea.directionX = mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].x;
-                    newArea.directionY = mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].y;
+                    newArea.directionX = mvGridCurr[i][j].x;
+                    newArea.directionY = mvGridCurr[i][j].y;
                     // newArea.directionXVar = -1;
                     // newArea.directionYVar = -1;
                     newArea.centroidX = j;
@@ -357,11 +476,13 @@ void MoveDetector::ProcessConnectedAreas(int (*markedAreas)[MAX_MAP_SIDE], conne
                     // newArea.delta2 = {};
                     // newArea.M2 = {};
                     processedAreas[areaCounter] = newArea;
+                    areaIndex[currentArea] = areaCounter;
                     areaCounter++;
                 }
                 //otherwise, update existing entry with new values
                 else
                 {
+                    connectedArea *findresult = &processedAreas[areaIndex[currentArea]];
                     if (findresult->boundBoxU.x > j)
                         findresult->boundBoxU.x = j;
                     if (findresult->boundBoxU.y > i)
@@ -376,16 +497,16 @@ void MoveDetector::ProcessConnectedAreas(int (*markedAreas)[MAX_MAP_SIDE], conne
                     findresult->centroidX = (j + findresult->size * findresult->centroidX) / (findresult->size + 1);
                     findresult->centroidY = (i + findresult->size * findresult->centroidY) / (findresult->size + 1);
 
-                    findresult->directionX = (mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].x + findresult->size * findresult->directionX) / (findresult->size + 1);
-                    findresult->directionY = (mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].y + findresult->size * findresult->directionY) / (findresult->size + 1);
+                    findresult->directionX = (mvGridCurr[i][j].x + findresult->size * findresult->directionX) / (findresult->size + 1);
+                    findresult->directionY = (mvGridCurr[i][j].y + findresult->size * findresult->directionY) / (findresult->size + 1);
 
                     findresult->size++;
 
                     //normalize vectors to be able to estimate angular variance from x,y variances
                     //TODO: alot happening here, probably could be optimized
-                    length = sqrt(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].x * mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].x + mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].y * mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].y);
-                    // normVector.x = (length) ? mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].x / length : 0;
-                    // normVector.y = (length) ? mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].y / length : 0;
+                    // length = sqrt(mvGridCurr[i][j].x * mvGridCurr[i][j].x + mvGridCurr[i][j].y * mvGridCurr[i][j].y);
+                    // normVector.x = (length) ? mvGridCurr[i][j].x / length : 0;
+                    // normVector.y = (length) ? mvGridCurr[i][j].y / length : 0;
 
                     //accumulative mean and variance (Welford's algorithm on wiki)
                     // findresult->delta.x = normVector.x - findresult->normV.x;
@@ -413,7 +534,6 @@ void MoveDetector::ProcessConnectedAreas(int (*markedAreas)[MAX_MAP_SIDE], conne
         processedAreas[i].directionMag =
             sqrt(processedAreas[i].directionX * processedAreas[i].directionX +
                  processedAreas[i].directionY * processedAreas[i].directionY);
-        processedAreas[i].id = rand() % 30000 + 1;
         processedAreas[i].centroidX *= output_block_size;
         processedAreas[i].centroidY *= output_block_size;
         processedAreas[i].boundBoxB.x *= output_block_size;
@@ -468,15 +588,28 @@ void MoveDetector::TrackAreas()
     connectedArea *currentAreas = areaBuffer[BUFFER_PREV(currFrameBuffer)];
     connectedArea *nextAreas = areaBuffer[BUFFER_CURR(currFrameBuffer)];
 
+    std::vector<connectedArea *> newAreas;
     while (currentAreas[i].id > 0)
     {
         if (!currentAreas[i].isTracked)
-            trackedObjects.push_back(trackedObject(currentAreas[i]));
+            newAreas.push_back(&currentAreas[i]);
         i++;
     }
+    //over the tracker budget: only the largest new areas get a tracker
+    int freeTrackers = std::max(maxTrackers - (int)trackedObjects.size(), 0);
+    if ((int)newAreas.size() > freeTrackers)
+    {
+        std::stable_sort(newAreas.begin(), newAreas.end(), [](const connectedArea *a, const connectedArea *b) { return a->size > b->size; });
+        degradation.trackerOverflowFrames++;
+        degradation.trackersRefused += newAreas.size() - freeTrackers;
+        newAreas.resize(freeTrackers);
+        std::sort(newAreas.begin(), newAreas.end());
+    }
+    for (auto area : newAreas)
+        trackedObjects.push_back(trackedObject(*area));
 
-    auto detectedGridCurr = areaGridMarked[BUFFER_PREV(currFrameBuffer)];
-    auto detectedGridNext = areaGridMarked[BUFFER_CURR(currFrameBuffer)];
+    auto &detectedGridCurr = areaGridMarked[BUFFER_PREV(currFrameBuffer)];
+    auto &detectedGridNext = areaGridMarked[BUFFER_CURR(currFrameBuffer)];
     
     //step 1: find good matches for every tracker-area pair based on IoU
     for (auto tracker = trackedObjects.begin(); tracker != trackedObjects.end(); )
@@ -493,21 +626,28 @@ void MoveDetector::TrackAreas()
 
             //mark working area
             coordinate boundU = {min(tracker->boundBoxU.x + tracker->direction.x, nextAreas[i].boundBoxU.x), min(tracker->boundBoxU.y + tracker->direction.y, nextAreas[i].boundBoxU.y)};
-            coordinate boundB = {max(tracker->boundBoxB.x + tracker->direction.x, nextAreas[i].boundBoxB.x), max(tracker->boundBoxB.y + tracker->direction.x, nextAreas[i].boundBoxB.y)};
+            coordinate boundB = {max(tracker->boundBoxB.x + tracker->direction.x, nextAreas[i].boundBoxB.x), max(tracker->boundBoxB.y + tracker->direction.y, nextAreas[i].boundBoxB.y)};
             ValidateCoordinate(boundU);
             ValidateCoordinate(boundB);
 
-            //calculate IoU
+            //calculate IoU; cells the tracker's shift moves off the grid are not part of its area
             int _intersection = 0;
             int _union = 0;
+            const int shiftY = tracker->direction.y / output_block_size;
+            const int shiftX = tracker->direction.x / output_block_size;
             for (int v = boundU.y / output_block_size; v < boundB.y / output_block_size; v++)
             {
+                const int prevV = v + shiftY;
                 for (int u = boundU.x / output_block_size; u < boundB.x / output_block_size; u++)
                 {
-                    if (detectedGridCurr[v + tracker->direction.y / output_block_size][u + tracker->direction.x / output_block_size] == tracker->areaID || detectedGridNext[v][u] == nextAreas[i].areaID)
+                    const int prevU = u + shiftX;
+                    const bool inTracker = prevV >= 0 && prevV < nSectorsY && prevU >= 0 && prevU < nSectorsX &&
+                                           detectedGridCurr[prevV][prevU] == tracker->areaID;
+                    const bool inArea = detectedGridNext[v][u] == nextAreas[i].areaID;
+                    if (inTracker || inArea)
                     {
                         _union++;
-                        if (detectedGridCurr[v + tracker->direction.y / output_block_size][u + tracker->direction.x / output_block_size] == tracker->areaID && detectedGridNext[v][u] == nextAreas[i].areaID)
+                        if (inTracker && inArea)
                             _intersection++;
                     }
                 }
@@ -600,15 +740,16 @@ void MoveDetector::TrackAreas()
     }
 }
 
-void inline MoveDetector::ValidateCoordinate(coordinate c)
+//clamps a pixel position to the analysed grid
+void inline MoveDetector::ValidateCoordinate(coordinate &c)
 {
     c.x = c.x > 0 ? c.x : 0;
     c.y = c.y > 0 ? c.y : 0;
-    c.x = c.x < input_width ? c.x : input_width;
-    c.y = c.y < input_height ? c.y : input_height;
+    c.x = c.x < nSectorsX * output_block_size ? c.x : nSectorsX * output_block_size;
+    c.y = c.y < nSectorsY * output_block_size ? c.y : nSectorsY * output_block_size;
 }
 
-float inline MoveDetector::CalculateIoUofBoxes(coordinate b1U, coordinate b1B, coordinate b2U, coordinate b2B)
+float MoveDetector::CalculateIoUofBoxes(coordinate b1U, coordinate b1B, coordinate b2U, coordinate b2B)
 {
     int x_left = max(b1U.x, b2U.x);
     int x_right = min(b1B.x, b2B.x);
@@ -806,10 +947,10 @@ void MoveDetector::SpatialConsistProcess()
             if (areaGridMarked[i][j] == 0)
             {
                 //test this seed
-                blockSimilarity[0] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j - 1].y - mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].y);
-                blockSimilarity[1] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i + 1][j].x - mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].x);
-                blockSimilarity[2] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j + 1].y - mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].y);
-                blockSimilarity[3] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i - 1][j].x - mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j].x);
+                blockSimilarity[0] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j - 1].y - mvGridCurr[i][j].y);
+                blockSimilarity[1] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i + 1][j].x - mvGridCurr[i][j].x);
+                blockSimilarity[2] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i][j + 1].y - mvGridCurr[i][j].y);
+                blockSimilarity[3] = abs(mvGridCoords[BUFFER_CURR(currFrameBuffer)][i - 1][j].x - mvGridCurr[i][j].x);
                 if (blockSimilarity[0] < CONSIST_THRESHOLD &&
                     blockSimilarity[1] < CONSIST_THRESHOLD &&
                     blockSimilarity[2] < CONSIST_THRESHOLD &&
@@ -884,331 +1025,713 @@ void MoveDetector::SpatialConsistProcess()
 }
 */
 
-void MoveDetector::TemporalConsistProcess()
+void MoveDetector::PoolBufferedFrame(int bufferIndex)
+{
+    int i, j, u, v;
+    auto &mvGrid = mvGridCoords[bufferIndex];
+    auto &types = subMbTypes[bufferIndex];
+
+    //average the MVs of each gridPooling x gridPooling block of the 4x4 grid, in place
+    for (i = 0; i < nSectorsY; i++)
+    {
+        for (j = 0; j < nSectorsX; j++)
+        {
+            int sumX = 0, sumY = 0, nVectors = 0, type = 0;
+            for (u = i * gridPooling; u < (i + 1) * gridPooling; u++)
+            {
+                for (v = j * gridPooling; v < (j + 1) * gridPooling; v++)
+                {
+                    if (types[u][v])
+                    {
+                        sumX += mvGrid[u][v].x;
+                        sumY += mvGrid[u][v].y;
+                        type = types[u][v];
+                        nVectors++;
+                    }
+                }
+            }
+            mvGrid[i][j] = nVectors ? coordinate{sumX / nVectors, sumY / nVectors} : coordinate{0, 0};
+            types[i][j] = type;
+        }
+    }
+}
+
+void MoveDetector::RescaleBufferedFrame(int bufferIndex, int fromPooling, int toPooling)
 {
     int i, j;
-    for (i = 0; i < MAX_MAP_SIDE; i++)
-        for (j = 0; j < MAX_MAP_SIDE; j++)
+    auto &mvGrid = mvGridCoords[bufferIndex];
+    auto &labels = areaGridMarked[bufferIndex];
+    const int rows = nSectorsY * gridPooling, cols = nSectorsX * gridPooling;
+
+    if (toPooling > fromPooling)
+    {
+        const int f = toPooling / fromPooling;
+        for (i = 0; i < rows / toPooling; i++)
         {
-            bwProjected[i][j] = {};
-            fwProjected[i][j] = {};
+            for (j = 0; j < cols / toPooling; j++)
+            {
+                mvGrid[i][j] = mvGrid[i * f][j * f];
+                labels[i][j] = labels[i * f][j * f];
+            }
+        }
+    }
+    else
+    {
+        //go backwards so that no coarse cell is overwritten before it is copied
+        const int f = fromPooling / toPooling;
+        for (i = rows / toPooling - 1; i >= 0; i--)
+        {
+            for (j = cols / toPooling - 1; j >= 0; j--)
+            {
+                mvGrid[i][j] = mvGrid[i / f][j / f];
+                labels[i][j] = labels[i / f][j / f];
+            }
         }
-    ProjectMVectors(mvGridCoords[BUFFER_NEXT(currFrameBuffer)], bwProjected, MV_PROJECT_BACKWARDS);
-    ProjectMVectors(mvGridCoords[BUFFER_PREV(currFrameBuffer)], fwProjected, MV_PROJECT_BACKWARDS);
-    CalculateSimilarity(mvGridCoords[BUFFER_CURR(currFrameBuffer)], bwProjected, similarityBW);
-    CalculateSimilarity(mvGridCoords[BUFFER_CURR(currFrameBuffer)], fwProjected, similarityFW);
-    CalculateSimilarity(bwProjected, fwProjected, similarityBWFW);
-    DetectForeground();
-    SpatialFilter(areaFgMarked);
+    }
 }
 
-void MoveDetector::ProjectMVectors(coordinate mVectors[][MAX_MAP_SIDE], coordinateF projectedOut[][MAX_MAP_SIDE], int projectionDir)
+void MoveDetector::BuildCoarseFrame(int bufferIndex)
 {
-    int i, j, xOffset, yOffset;
+    int i, j, u, v;
+    auto &mvGrid = mvGridCoords[bufferIndex];
+    auto &types = subMbTypes[bufferIndex];
+    auto &coarse = mvCoarseCoords[bufferIndex];
+    const int f = pyramidFactor;
 
-    //multiplier to help with comparing fields
-    const float weightFactor = 4.0f;
-    coordinate currMV;
-    coordinateF *A, *B, *C, *D;
-    int *cA, *cB, *cC, *cD;
-    float aA, aB, aC, aD;
+    //average every pyramidFactor x pyramidFactor block of the analysis grid into one 16x16 cell
+    for (i = 0; i < nSectorsY / f; i++)
+    {
+        for (j = 0; j < nSectorsX / f; j++)
+        {
+            int sumX = 0, sumY = 0, nVectors = 0;
+            for (u = i * f; u < (i + 1) * f; u++)
+            {
+                for (v = j * f; v < (j + 1) * f; v++)
+                {
+                    if (types[u][v])
+                    {
+                        sumX += mvGrid[u][v].x;
+                        sumY += mvGrid[u][v].y;
+                        nVectors++;
+                    }
+                }
+            }
+            coarse[i][j] = nVectors ? coordinate{sumX / nVectors, sumY / nVectors} : coordinate{0, 0};
+        }
+    }
+}
 
-    int mvCount[MAX_MAP_SIDE][MAX_MAP_SIDE];
-    coordinateF projected[MAX_MAP_SIDE][MAX_MAP_SIDE];
+void MoveDetector::CoarseForegroundProcess(frameWorkspace &ws)
+{
+    int i, j;
+    const int frameBuffer = ws.frameBuffer;
+    const int f = pyramidFactor;
+    gridSpan &coarseSpan = ws.coarseSpan;
+    gridSpan &fineSpan = ws.fineSpan;
+    const int rows = nSectorsY / f, cols = nSectorsX / f;
+    std::vector<int> rowMin(rows), rowMax(rows);
+
+    //same temporal consistency test as on the analysis grid, on the 16x16 field
+    coarseSpan.SetFull(rows, cols);
+    for (i = 0; i < rows; i++)
+        for (j = 0; j < cols; j++)
+        {
+            ws.coarseBwProjected[i][j] = {};
+            ws.coarseFwProjected[i][j] = {};
+        }
+    CalculateMagAng(mvCoarseCoords[BUFFER_CURR(frameBuffer)], ws.coarseGridMag, ws.coarseGridArg, coarseSpan);
+    ProjectMVectors(ws, mvCoarseCoords[BUFFER_NEXT(frameBuffer)], ws.coarseBwProjected, coarseSpan, MV_PROJECT_BACKWARDS, mvFrameScale[BUFFER_NEXT(frameBuffer)]);
+    ProjectMVectors(ws, mvCoarseCoords[BUFFER_PREV(frameBuffer)], ws.coarseFwProjected, coarseSpan, MV_PROJECT_BACKWARDS, mvFrameScale[BUFFER_PREV(frameBuffer)]);
+    CalculateSimilarity(mvCoarseCoords[BUFFER_CURR(frameBuffer)], ws.coarseBwProjected, ws.coarseSimilarityBW, coarseSpan);
+    CalculateSimilarity(mvCoarseCoords[BUFFER_CURR(frameBuffer)], ws.coarseFwProjected, ws.coarseSimilarityFW, coarseSpan);
+    CalculateSimilarity(ws.coarseBwProjected, ws.coarseFwProjected, ws.coarseSimilarityBWFW, coarseSpan);
+    DetectForeground(ws.coarseSimilarityFW, ws.coarseSimilarityBW, ws.coarseSimilarityBWFW, ws.coarseFwProjected, ws.coarseGridMag, ws.coarseFgMarked, coarseSpan);
+    SpatialFilter(ws, ws.coarseFgMarked, coarseSpan);
+
+    //horizontal extent of the foreground in each coarse row
+    for (i = 0; i < rows; i++)
+    {
+        rowMin[i] = cols;
+        rowMax[i] = -1;
+        for (j = 0; j < cols; j++)
+            if (ws.coarseFgMarked[i][j] > 0)
+            {
+                rowMin[i] = std::min(rowMin[i], j);
+                rowMax[i] = std::max(rowMax[i], j);
+            }
+    }
 
+    //dilate by one coarse cell and map onto the rows of the analysis grid
+    int cells = 0;
+    fineSpan.rows = nSectorsY;
+    fineSpan.cols = nSectorsX;
+    fineSpan.colBegin.resize(nSectorsY);
+    fineSpan.colEnd.resize(nSectorsY);
     for (i = 0; i < nSectorsY; i++)
-        for (j = 0; j < nSectorsX; j++)
+    {
+        int r = i / f;
+        int begin = cols, end = -1;
+        for (int u = std::max(r - 1, 0); u <= std::min(r + 1, rows - 1); u++)
         {
-            mvCount[i][j] = 0;
-            projected[i][j] = {};
+            begin = std::min(begin, rowMin[u] - 1);
+            end = std::max(end, rowMax[u] + 1);
         }
+        if (end < begin)
+        {
+            fineSpan.colBegin[i] = 0;
+            fineSpan.colEnd[i] = 0;
+            continue;
+        }
+        fineSpan.colBegin[i] = std::max(begin, 0) * f;
+        fineSpan.colEnd[i] = std::min(end + 1, cols) * f;
+        cells += fineSpan.colEnd[i] - fineSpan.colBegin[i];
+    }
+    ws.pyramidFrames++;
+    ws.pyramidCells += (double)cells / (nSectorsX * nSectorsY);
+}
+
+static const int gmcIterations = 5;
+static const float gmcMinSamples = 0.25f;   //fraction of the grid that must carry MVs
+static const float gmcMinInliers = 0.5f;    //fraction of MVs the model must explain
+static const float gmcMinMagnitude = 1.0f;  //px, smaller camera motion is left alone
+static const float gmcMinScale = 1.0f;      //px, lower bound for the Tukey cut-off
 
+static bool Solve3x3(double m[3][3], double b[3], double x[3])
+{
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                 m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                 m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (fabs(det) < 1e-9)
+        return false;
+
+    for (int k = 0; k < 3; k++)
+    {
+        double t[3][3];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                t[i][j] = j == k ? b[i] : m[i][j];
+        x[k] = (t[0][0] * (t[1][1] * t[2][2] - t[1][2] * t[2][1]) -
+                t[0][1] * (t[1][0] * t[2][2] - t[1][2] * t[2][0]) +
+                t[0][2] * (t[1][0] * t[2][1] - t[1][1] * t[2][0])) / det;
+    }
+    return true;
+}
+
+bool MoveDetector::EstimateGlobalMotion(int bufferIndex, globalMotionModel &model)
+{
+    int i, j, n, k;
+    const float centerX = (nSectorsX - 1) / 2.0f;
+    const float centerY = (nSectorsY - 1) / 2.0f;
+
+    model = {};
+
+    //gather cells that actually carry an MV, laid out flat for the IRLS passes
+    std::vector<float> xs, ys, us, vs;
     for (i = 0; i < nSectorsY; i++)
     {
         for (j = 0; j < nSectorsX; j++)
         {
-            currMV.x = mVectors[i][j].x * projectionDir;
-            currMV.y = mVectors[i][j].y * projectionDir;
-
-            //no MV here
-            if (!currMV.x && !currMV.y)
+            if (!subMbTypes[bufferIndex][i][j])
                 continue;
+            xs.push_back(j - centerX);
+            ys.push_back(i - centerY);
+            us.push_back(mvGridCoords[bufferIndex][i][j].x);
+            vs.push_back(mvGridCoords[bufferIndex][i][j].y);
+        }
+    }
+    const int samples = xs.size();
+    if (samples < 3 || samples < gmcMinSamples * nSectorsX * nSectorsY)
+        return false;
+
+    std::vector<float> weights(samples, 1.0f);
+    std::vector<float> residuals(samples);
+    std::vector<float> sorted(samples);
+
+    //start from the median translation so moving objects do not drag the first fit
+    sorted = us;
+    std::nth_element(sorted.begin(), sorted.begin() + samples / 2, sorted.end());
+    model.a[0] = sorted[samples / 2];
+    sorted = vs;
+    std::nth_element(sorted.begin(), sorted.begin() + samples / 2, sorted.end());
+    model.a[3] = sorted[samples / 2];
+
+    float cutoff = 0.0f;
+    for (k = 0; k <= gmcIterations; k++)
+    {
+        const float *a = model.a;
+        for (n = 0; n < samples; n++)
+        {
+            float du = us[n] - (a[0] + a[1] * xs[n] + a[2] * ys[n]);
+            float dv = vs[n] - (a[3] + a[4] * xs[n] + a[5] * ys[n]);
+            residuals[n] = sqrtf(du * du + dv * dv);
+        }
+
+        //Tukey biweight with the cut-off taken from the median residual
+        sorted = residuals;
+        std::nth_element(sorted.begin(), sorted.begin() + samples / 2, sorted.end());
+        cutoff = std::max(4.685f * 1.4826f * sorted[samples / 2], gmcMinScale);
+        for (n = 0; n < samples; n++)
+        {
+            float r = residuals[n] / cutoff;
+            weights[n] = r < 1.0f ? (1.0f - r * r) * (1.0f - r * r) : 0.0f;
+        }
+
+        if (k == gmcIterations)
+            break;
 
-            //MV points outside this frame (should consider this case maybe?)
-            if (i * 16 + currMV.y < 0 || i * 16 + currMV.y > 16 * nSectorsY ||
-                j * 16 + currMV.x < 0 || j * 16 + currMV.x > 16 * nSectorsX)
+        //weighted least squares for [1 x y], shared by both components
+        double m[3][3] = {}, bu[3] = {}, bv[3] = {};
+        for (n = 0; n < samples; n++)
+        {
+            const double w = weights[n], x = xs[n], y = ys[n];
+            m[0][0] += w;
+            m[0][1] += w * x;
+            m[0][2] += w * y;
+            m[1][1] += w * x * x;
+            m[1][2] += w * x * y;
+            m[2][2] += w * y * y;
+            bu[0] += w * us[n];
+            bu[1] += w * us[n] * x;
+            bu[2] += w * us[n] * y;
+            bv[0] += w * vs[n];
+            bv[1] += w * vs[n] * x;
+            bv[2] += w * vs[n] * y;
+        }
+        m[1][0] = m[0][1];
+        m[2][0] = m[0][2];
+        m[2][1] = m[1][2];
+
+        double pu[3], pv[3];
+        if (!Solve3x3(m, bu, pu) || !Solve3x3(m, bv, pv))
+            break;
+        for (n = 0; n < 3; n++)
+        {
+            model.a[n] = pu[n];
+            model.a[n + 3] = pv[n];
+        }
+    }
+
+    int inliers = 0;
+    for (n = 0; n < samples; n++)
+        if (residuals[n] < cutoff)
+            inliers++;
+    model.inlierRatio = (float)inliers / samples;
+
+    //average model displacement over the grid: translation plus the linear terms at the mean |offset|
+    float magnitude = sqrtf(model.a[0] * model.a[0] + model.a[3] * model.a[3]) +
+                      (fabsf(model.a[1]) + fabsf(model.a[4])) * nSectorsX / 4.0f +
+                      (fabsf(model.a[2]) + fabsf(model.a[5])) * nSectorsY / 4.0f;
+
+    return model.inlierRatio >= gmcMinInliers && magnitude >= gmcMinMagnitude;
+}
+
+void MoveDetector::CompensateGlobalMotion(int bufferIndex)
+{
+    int i, j;
+    globalMotionModel &model = globalMotion[bufferIndex];
+
+    model.applied = EstimateGlobalMotion(bufferIndex, model);
+    if (!model.applied)
+        return;
+
+    const float centerX = (nSectorsX - 1) / 2.0f;
+    const float centerY = (nSectorsY - 1) / 2.0f;
+    for (i = 0; i < nSectorsY; i++)
+    {
+        const float y = i - centerY;
+        for (j = 0; j < nSectorsX; j++)
+        {
+            if (!subMbTypes[bufferIndex][i][j])
                 continue;
+            const float x = j - centerX;
+            coordinate &mv = mvGridCoords[bufferIndex][i][j];
+            mv.x = lrintf(mv.x - (model.a[0] + model.a[1] * x + model.a[2] * y));
+            mv.y = lrintf(mv.y - (model.a[3] + model.a[4] * x + model.a[5] * y));
+        }
+    }
+}
 
-            xOffset = (currMV.x % 16 + 16) % 16;
-            yOffset = (currMV.y % 16 + 16) % 16;
+void MoveDetector::TemporalConsistProcess(frameWorkspace &ws)
+{
+    const int frameBuffer = ws.frameBuffer;
+    ws.bwProjected.Clear();
+    ws.fwProjected.Clear();
+    ProjectMVectors(ws, mvGridCoords[BUFFER_NEXT(frameBuffer)], ws.bwProjected, ws.fineSpan, MV_PROJECT_BACKWARDS, mvFrameScale[BUFFER_NEXT(frameBuffer)]);
+    ProjectMVectors(ws, mvGridCoords[BUFFER_PREV(frameBuffer)], ws.fwProjected, ws.fineSpan, MV_PROJECT_BACKWARDS, mvFrameScale[BUFFER_PREV(frameBuffer)]);
+    CalculateSimilarity(mvGridCoords[BUFFER_CURR(frameBuffer)], ws.bwProjected, ws.similarityBW, ws.fineSpan);
+    CalculateSimilarity(mvGridCoords[BUFFER_CURR(frameBuffer)], ws.fwProjected, ws.similarityFW, ws.fineSpan);
+    CalculateSimilarity(ws.bwProjected, ws.fwProjected, ws.similarityBWFW, ws.fineSpan);
+    DetectForeground(ws.similarityFW, ws.similarityBW, ws.similarityBWFW, ws.fwProjected, ws.mvGridMag, ws.areaFgMarked, ws.fineSpan);
+    if (governorLevel < GOVERNOR_LEVEL_NO_SPATIAL)
+        SpatialFilter(ws, ws.areaFgMarked, ws.fineSpan);
+}
 
-            //if 4 cells are affected
-            if (xOffset && yOffset)
+void MoveDetector::ProjectMVectors(frameWorkspace &ws, Grid<coordinate> &mVectors, Grid<coordinateF> &projectedOut, const gridSpan &span, int projectionDir, float mvScale)
+{
+    std::vector<projectionBand> &projectionBands = ws.projectionBands;
+    //multiplier to help with comparing fields
+    const float weightFactor = 4.0f;
+    const int tiles = TileCount(span.rows);
+    if ((int)projectionBands.size() < tiles)
+        projectionBands.resize(tiles);
+
+    //every tile scatters the MVs of its rows into its own band of target rows, which
+    //extends past the tile by the largest vertical shift found in it (the halo)
+    RunTiles(tiles, [&](int t) {
+        const int rowBegin = span.rows * t / tiles, rowEnd = span.rows * (t + 1) / tiles;
+        projectionBand &band = projectionBands[t];
+        int i, j, xOffset, yOffset, targetX, targetY;
+        coordinate currMV, shiftMV;
+        coordinateF *A, *B, *C, *D;
+        int *cA, *cB, *cC, *cD;
+        float aA, aB, aC, aD;
+
+        int halo = 0;
+        for (i = rowBegin; i < rowEnd; i++)
+            for (j = span.colBegin[i]; j < span.colEnd[i]; j++)
+                halo = std::max(halo, abs((int)lrintf(mVectors[i][j].y * projectionDir * mvScale)));
+        halo = halo / 16 + 1;
+
+        //one extra row and column: MVs ending on the frame edge touch the cells past it
+        band.rowBegin = std::max(rowBegin - halo, 0);
+        band.rowEnd = std::min(rowEnd + halo, span.rows) + 1;
+        band.count.Reserve(band.rowEnd - band.rowBegin, span.cols + 1);
+        band.sum.Reserve(band.rowEnd - band.rowBegin, span.cols + 1);
+        band.count.ClearRows(0, band.rowEnd - band.rowBegin);
+        band.sum.ClearRows(0, band.rowEnd - band.rowBegin);
+
+        for (i = rowBegin; i < rowEnd; i++)
+        {
+            for (j = span.colBegin[i]; j < span.colEnd[i]; j++)
             {
-                A = &(projected[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
-                cA = &(mvCount[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
+                currMV.x = mVectors[i][j].x * projectionDir;
+                currMV.y = mVectors[i][j].y * projectionDir;
 
-                B = &(projected[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16 + 1]);
-                cB = &(mvCount[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16 + 1]);
+                //no MV here
+                if (!currMV.x && !currMV.y)
+                    continue;
 
-                C = &(projected[(i * 16 + currMV.y) / 16 + 1][(j * 16 + currMV.x) / 16]);
-                cC = &(mvCount[(i * 16 + currMV.y) / 16 + 1][(j * 16 + currMV.x) / 16]);
+                //the MV spans its reference distance, the shift spans the distance between analysed frames
+                shiftMV.x = lrintf(currMV.x * mvScale);
+                shiftMV.y = lrintf(currMV.y * mvScale);
 
-                D = &(projected[(i * 16 + currMV.y) / 16 + 1][(j * 16 + currMV.x) / 16 + 1]);
-                cD = &(mvCount[(i * 16 + currMV.y) / 16 + 1][(j * 16 + currMV.x) / 16 + 1]);
+                //MV points outside this frame (should consider this case maybe?)
+                if (i * 16 + shiftMV.y < 0 || i * 16 + shiftMV.y > 16 * span.rows ||
+                    j * 16 + shiftMV.x < 0 || j * 16 + shiftMV.x > 16 * span.cols)
+                    continue;
 
-                aA = (16 - xOffset) * (16 - yOffset) / (float)256;
-                aB = (xOffset) * (16 - yOffset) / (float)256;
-                aC = (16 - xOffset) * (yOffset) / (float)256;
-                aD = (xOffset) * (yOffset) / (float)256;
+                xOffset = (shiftMV.x % 16 + 16) % 16;
+                yOffset = (shiftMV.y % 16 + 16) % 16;
+                targetX = (j * 16 + shiftMV.x) / 16;
+                targetY = (i * 16 + shiftMV.y) / 16 - band.rowBegin;
 
-                A->x += currMV.x * aA * weightFactor;
-                A->y += currMV.y * aA * weightFactor;
+                //if 4 cells are affected
+                if (xOffset && yOffset)
+                {
+                    A = &(band.sum[targetY][targetX]);
+                    cA = &(band.count[targetY][targetX]);
 
-                B->x += currMV.x * aB * weightFactor;
-                B->y += currMV.y * aB * weightFactor;
+                    B = &(band.sum[targetY][targetX + 1]);
+                    cB = &(band.count[targetY][targetX + 1]);
 
-                C->x += currMV.x * aC * weightFactor;
-                C->y += currMV.y * aC * weightFactor;
+                    C = &(band.sum[targetY + 1][targetX]);
+                    cC = &(band.count[targetY + 1][targetX]);
 
-                D->x += currMV.x * aD * weightFactor;
-                D->y += currMV.y * aD * weightFactor;
+                    D = &(band.sum[targetY + 1][targetX + 1]);
+                    cD = &(band.count[targetY + 1][targetX + 1]);
 
-                (*cA)++;
-                (*cB)++;
-                (*cC)++;
-                (*cD)++;
-            }
-            //2 cells affected (L/R)
-            else if (!yOffset && xOffset)
-            {
-                A = &(projected[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
-                cA = &(mvCount[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
+                    aA = (16 - xOffset) * (16 - yOffset) / (float)256;
+                    aB = (xOffset) * (16 - yOffset) / (float)256;
+                    aC = (16 - xOffset) * (yOffset) / (float)256;
+                    aD = (xOffset) * (yOffset) / (float)256;
 
-                B = &(projected[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16 + 1]);
-                cB = &(mvCount[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16 + 1]);
+                    A->x += currMV.x * aA * weightFactor;
+                    A->y += currMV.y * aA * weightFactor;
 
-                aA = (16 - xOffset) * (16) / (float)256;
-                aB = (xOffset) * (16) / (float)256;
+                    B->x += currMV.x * aB * weightFactor;
+                    B->y += currMV.y * aB * weightFactor;
 
-                A->x += currMV.x * aA * weightFactor;
-                A->y += currMV.y * aA * weightFactor;
+                    C->x += currMV.x * aC * weightFactor;
+                    C->y += currMV.y * aC * weightFactor;
 
-                B->x += currMV.x * aB * weightFactor;
-                B->y += currMV.y * aB * weightFactor;
+                    D->x += currMV.x * aD * weightFactor;
+                    D->y += currMV.y * aD * weightFactor;
 
-                (*cA)++;
-                (*cB)++;
-            }
-            //2 cells affected (T/B)
-            else if (!xOffset && yOffset)
-            {
-                A = &(projected[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
-                cA = &(mvCount[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
+                    (*cA)++;
+                    (*cB)++;
+                    (*cC)++;
+                    (*cD)++;
+                }
+                //2 cells affected (L/R)
+                else if (!yOffset && xOffset)
+                {
+                    A = &(band.sum[targetY][targetX]);
+                    cA = &(band.count[targetY][targetX]);
 
-                C = &(projected[(i * 16 + currMV.y) / 16 + 1][(j * 16 + currMV.x) / 16]);
-                cC = &(mvCount[(i * 16 + currMV.y) / 16 + 1][(j * 16 + currMV.x) / 16]);
+                    B = &(band.sum[targetY][targetX + 1]);
+                    cB = &(band.count[targetY][targetX + 1]);
 
-                aA = (16) * (16 - yOffset) / (float)256;
-                aC = (16) * (yOffset) / (float)256;
+                    aA = (16 - xOffset) * (16) / (float)256;
+                    aB = (xOffset) * (16) / (float)256;
 
-                A->x += currMV.x * aA * weightFactor;
-                A->y += currMV.y * aA * weightFactor;
+                    A->x += currMV.x * aA * weightFactor;
+                    A->y += currMV.y * aA * weightFactor;
 
-                C->x += currMV.x * aC * weightFactor;
-                C->y += currMV.y * aC * weightFactor;
+                    B->x += currMV.x * aB * weightFactor;
+                    B->y += currMV.y * aB * weightFactor;
 
-                (*cA)++;
-                (*cC)++;
-            }
-            //MV points to another block exactly
-            else
-            {
-                A = &(projected[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
-                cA = &(mvCount[(i * 16 + currMV.y) / 16][(j * 16 + currMV.x) / 16]);
+                    (*cA)++;
+                    (*cB)++;
+                }
+                //2 cells affected (T/B)
+                else if (!xOffset && yOffset)
+                {
+                    A = &(band.sum[targetY][targetX]);
+                    cA = &(band.count[targetY][targetX]);
+
+                    C = &(band.sum[targetY + 1][targetX]);
+                    cC = &(band.count[targetY + 1][targetX]);
+
+                    aA = (16) * (16 - yOffset) / (float)256;
+                    aC = (16) * (yOffset) / (float)256;
+
+                    A->x += currMV.x * aA * weightFactor;
+                    A->y += currMV.y * aA * weightFactor;
+
+                    C->x += currMV.x * aC * weightFactor;
+                    C->y += currMV.y * aC * weightFactor;
+
+                    (*cA)++;
+                    (*cC)++;
+                }
+                //MV points to another block exactly
+                else
+                {
+                    A = &(band.sum[targetY][targetX]);
+                    cA = &(band.count[targetY][targetX]);
 
-                aA = 1.0;
+                    aA = 1.0;
 
-                A->x += currMV.x * aA * weightFactor;
-                A->y += currMV.y * aA * weightFactor;
+                    A->x += currMV.x * aA * weightFactor;
+                    A->y += currMV.y * aA * weightFactor;
 
-                (*cA)++;
+                    (*cA)++;
+                }
             }
         }
-    }
-    for (i = 0; i < nSectorsY; i++)
-        for (j = 0; j < nSectorsX; j++)
-        {
-            projectedOut[i][j].x = mvCount[i][j] > 0 ? projected[i][j].x / (float)mvCount[i][j] : 0;
-            projectedOut[i][j].y = mvCount[i][j] > 0 ? projected[i][j].y / (float)mvCount[i][j] : 0;
-        }
+    });
+
+    //merge the bands overlapping each row, in tile order
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; i++)
+            for (int j = span.colBegin[i]; j < span.colEnd[i]; j++)
+            {
+                int mvCount = 0;
+                coordinateF projected = {};
+                for (int t = 0; t < tiles; t++)
+                {
+                    projectionBand &band = projectionBands[t];
+                    if (i < band.rowBegin || i >= band.rowEnd)
+                        continue;
+                    mvCount += band.count[i - band.rowBegin][j];
+                    projected.x += band.sum[i - band.rowBegin][j].x;
+                    projected.y += band.sum[i - band.rowBegin][j].y;
+                }
+                projectedOut[i][j].x = mvCount > 0 ? projected.x / (float)mvCount : 0;
+                projectedOut[i][j].y = mvCount > 0 ? projected.y / (float)mvCount : 0;
+            }
+    });
 }
 
-void MoveDetector::CalculateSimilarity(coordinate currentMV[][MAX_MAP_SIDE], coordinateF projectedMV[][MAX_MAP_SIDE], float metricOut[][MAX_MAP_SIDE])
+void MoveDetector::CalculateSimilarity(Grid<coordinate> &currentMV, Grid<coordinateF> &projectedMV, Grid<float> &metricOut, const gridSpan &span)
 {
-    int i, j;
-    float absdiff = 0.0;
-    float abscurr = 0.0;
-    float absproj = 0.0;
-    coordinate *currMV;
-    coordinateF *projMV;
-
-    for (i = 0; i < nSectorsY; i++)
-        for (j = 0; j < nSectorsX; j++)
-        {
-            metricOut[i][j] = 0.0;
-        }
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        int i, j;
+        float absdiff = 0.0;
+        float abscurr = 0.0;
+        float absproj = 0.0;
+        coordinate *currMV;
+        coordinateF *projMV;
+
+        for (i = rowBegin; i < rowEnd; i++)
+            for (j = 0; j < span.cols; j++)
+            {
+                metricOut[i][j] = 0.0;
+            }
 
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
+        for (i = rowBegin; i < rowEnd; i++)
         {
-            currMV = &currentMV[i][j];
-            projMV = &projectedMV[i][j];
+            for (j = span.colBegin[i]; j < span.colEnd[i]; j++)
+            {
+                currMV = &currentMV[i][j];
+                projMV = &projectedMV[i][j];
 
-            abscurr = sqrt(currMV->x * currMV->x + currMV->y * currMV->y);
-            absproj = sqrt(projMV->x * projMV->x + projMV->y * projMV->y);
-            absdiff = (currMV->x - projMV->x) * (currMV->x - projMV->x) + (currMV->y - projMV->y) * (currMV->y - projMV->y);
+                abscurr = sqrt(currMV->x * currMV->x + currMV->y * currMV->y);
+                absproj = sqrt(projMV->x * projMV->x + projMV->y * projMV->y);
+                absdiff = (currMV->x - projMV->x) * (currMV->x - projMV->x) + (currMV->y - projMV->y) * (currMV->y - projMV->y);
 
-            metricOut[i][j] = (abscurr + absproj) ? exp(-1 * (absdiff) / ((abscurr + absproj) * (abscurr + absproj))) : 1.0;
+                metricOut[i][j] = (abscurr + absproj) ? exp(-1 * (absdiff) / ((abscurr + absproj) * (abscurr + absproj))) : 1.0;
+            }
         }
-    }
+    });
 }
 
-void MoveDetector::CalculateSimilarity(coordinateF currentMV[][MAX_MAP_SIDE], coordinateF projectedMV[][MAX_MAP_SIDE], float metricOut[][MAX_MAP_SIDE])
+void MoveDetector::CalculateSimilarity(Grid<coordinateF> &currentMV, Grid<coordinateF> &projectedMV, Grid<float> &metricOut, const gridSpan &span)
 {
-    int i, j;
-    float absdiff = 0.0;
-    float abscurr = 0.0;
-    float absproj = 0.0;
-    coordinateF *currMV;
-    coordinateF *projMV;
-
-    for (i = 0; i < nSectorsY; i++)
-        for (j = 0; j < nSectorsX; j++)
-        {
-            metricOut[i][j] = 0.0;
-        }
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        int i, j;
+        float absdiff = 0.0;
+        float abscurr = 0.0;
+        float absproj = 0.0;
+        coordinateF *currMV;
+        coordinateF *projMV;
+
+        for (i = rowBegin; i < rowEnd; i++)
+            for (j = 0; j < span.cols; j++)
+            {
+                metricOut[i][j] = 0.0;
+            }
 
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
+        for (i = rowBegin; i < rowEnd; i++)
         {
-            currMV = &currentMV[i][j];
-            projMV = &projectedMV[i][j];
+            for (j = span.colBegin[i]; j < span.colEnd[i]; j++)
+            {
+                currMV = &currentMV[i][j];
+                projMV = &projectedMV[i][j];
 
-            abscurr = sqrt(currMV->x * currMV->x + currMV->y * currMV->y);
-            absproj = sqrt(projMV->x * projMV->x + projMV->y * projMV->y);
-            absdiff = (currMV->x - projMV->x) * (currMV->x - projMV->x) + (currMV->y - projMV->y) * (currMV->y - projMV->y);
+                abscurr = sqrt(currMV->x * currMV->x + currMV->y * currMV->y);
+                absproj = sqrt(projMV->x * projMV->x + projMV->y * projMV->y);
+                absdiff = (currMV->x - projMV->x) * (currMV->x - projMV->x) + (currMV->y - projMV->y) * (currMV->y - projMV->y);
 
-            metricOut[i][j] = (abscurr + absproj) ? exp(-1 * (absdiff) / ((abscurr + absproj) * (abscurr + absproj))) : 1.0;
+                metricOut[i][j] = (abscurr + absproj) ? exp(-1 * (absdiff) / ((abscurr + absproj) * (abscurr + absproj))) : 1.0;
+            }
         }
-    }
+    });
 }
 
-void MoveDetector::DetectForeground()
+void MoveDetector::DetectForeground(Grid<float> &similarityFW, Grid<float> &similarityBW, Grid<float> &similarityBWFW,
+                                    Grid<coordinateF> &fwProjected, Grid<float> &mvGridMag, Grid<int> &areaFgMarked, const gridSpan &span)
 {
     //const float alpha = 0.7, beta = 4;
-    int i, j;
-    for (i = 0; i < MAX_MAP_SIDE; i++)
-        for (j = 0; j < MAX_MAP_SIDE; j++)
-        {
-            areaFgMarked[i][j] = 0;
-        }
-
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
-        {
-            if ((similarityFW[i][j] > alpha) && (similarityBW[i][j] > alpha))
-            {
-                areaFgMarked[i][j] = mvGridMag[i][j] > beta ? 1 : -1;
-            }
-            else if ((similarityFW[i][j] > alpha) || (similarityBW[i][j] > alpha))
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        int i, j;
+        for (i = rowBegin; i < rowEnd; i++)
+            for (j = 0; j < span.cols; j++)
             {
-                float max = std::max(similarityBW[i][j], similarityFW[i][j]);
-                areaFgMarked[i][j] = mvGridMag[i][j] * max * max > beta ? 2 : -2;
+                areaFgMarked[i][j] = 0;
             }
-            else if (similarityBWFW[i][j] > alpha)
+
+        for (i = rowBegin; i < rowEnd; i++)
+        {
+            for (j = span.colBegin[i]; j < span.colEnd[i]; j++)
             {
-                float absFW = sqrt(fwProjected[i][j].x * fwProjected[i][j].x + fwProjected[i][j].y * fwProjected[i][j].y);
-                areaFgMarked[i][j] = similarityBWFW[i][j] * similarityBWFW[i][j] * absFW > beta ? 3 : -3;
+                if ((similarityFW[i][j] > alpha) && (similarityBW[i][j] > alpha))
+                {
+                    areaFgMarked[i][j] = mvGridMag[i][j] > beta ? 1 : -1;
+                }
+                else if ((similarityFW[i][j] > alpha) || (similarityBW[i][j] > alpha))
+                {
+                    float max = std::max(similarityBW[i][j], similarityFW[i][j]);
+                    areaFgMarked[i][j] = mvGridMag[i][j] * max * max > beta ? 2 : -2;
+                }
+                else if (similarityBWFW[i][j] > alpha)
+                {
+                    float absFW = sqrt(fwProjected[i][j].x * fwProjected[i][j].x + fwProjected[i][j].y * fwProjected[i][j].y);
+                    areaFgMarked[i][j] = similarityBWFW[i][j] * similarityBWFW[i][j] * absFW > beta ? 3 : -3;
+                }
             }
         }
-    }
+    });
 }
 
-void MoveDetector::SpatialFilter(int marked[][MAX_MAP_SIDE])
+bool MoveDetector::IsGlobalMotion(frameWorkspace &ws)
 {
-    int i, j, u;
-
-    int marked_tmp[MAX_MAP_SIDE][MAX_MAP_SIDE];
+    int i, j;
+    Grid<int> &areaFgMarked = ws.areaFgMarked;
+    int fgCount = 0;
     for (i = 0; i < nSectorsY; i++)
-    {
         for (j = 0; j < nSectorsX; j++)
+            if (areaFgMarked[i][j] > 0)
+                fgCount++;
+
+    return fgCount > maxFgFraction * nSectorsX * nSectorsY;
+}
+
+void MoveDetector::SpatialFilter(frameWorkspace &ws, Grid<int> &marked, const gridSpan &span)
+{
+    //every tile reads up to 2 rows of its neighbours, so the copy is complete before any tile filters
+    Grid<int> &marked_tmp = ws.markedTemp;
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        for (int i = rowBegin; i < rowEnd; i++)
         {
-            marked_tmp[i][j] = marked[i][j];
+            for (int j = 0; j < span.cols; j++)
+            {
+                marked_tmp[i][j] = marked[i][j];
+            }
         }
-    }
+    });
 
-    //0 - close to BG, 1 - closer to FG
-    float score = 0.0f;
-    for (i = 0; i < nSectorsY; i++)
-    {
-        for (j = 0; j < nSectorsX; j++)
+    ForEachTile(span.rows, [&](int rowBegin, int rowEnd) {
+        int i, j, u;
+        //0 - close to BG, 1 - closer to FG
+        float score = 0.0f;
+        for (i = rowBegin; i < rowEnd; i++)
         {
-            //if this sector is unmarked
-            if (!marked_tmp[i][j])
+            for (j = span.colBegin[i]; j < span.colEnd[i]; j++)
             {
-                score = 0.0f;
-                //search downwards
-                for (u = i; (u < nSectorsY && u < i + 3); u++)
+                //if this sector is unmarked
+                if (!marked_tmp[i][j])
                 {
-                    //found a marked sector
-                    if (marked_tmp[u][j])
+                    score = 0.0f;
+                    //search downwards
+                    for (u = i; (u < span.rows && u < i + 3); u++)
                     {
-                        score += marked_tmp[u][j] > 0 ? 1.0f / u : -1.0f / u;
-                        break;
+                        //found a marked sector
+                        if (marked_tmp[u][j])
+                        {
+                            score += marked_tmp[u][j] > 0 ? 1.0f / u : -1.0f / u;
+                            break;
+                        }
                     }
-                }
 
-                //search upwards
-                for (u = i; (u >= 0 && u > i - 3); u--)
-                {
-                    //found a marked sector
-                    if (marked_tmp[u][j])
+                    //search upwards
+                    for (u = i; (u >= 0 && u > i - 3); u--)
                     {
-                        score += marked_tmp[u][j] > 0 ? 1.0f / u : -1.0f / u;
-                        break;
+                        //found a marked sector
+                        if (marked_tmp[u][j])
+                        {
+                            score += marked_tmp[u][j] > 0 ? 1.0f / u : -1.0f / u;
+                            break;
+                        }
                     }
-                }
 
-                //search to the right
-                for (u = j; (u < nSectorsX && u < j + 3); u++)
-                {
-                    //found a marked sector
-                    if (marked_tmp[i][u])
+                    //search to the right
+                    for (u = j; (u < span.cols && u < j + 3); u++)
                     {
-                        score += marked_tmp[i][u] > 0 ? 1.0f / u : -1.0f / u;
-                        break;
+                        //found a marked sector
+                        if (marked_tmp[i][u])
+                        {
+                            score += marked_tmp[i][u] > 0 ? 1.0f / u : -1.0f / u;
+                            break;
+                        }
                     }
-                }
 
-                //search to the left
-                for (u = j; (u >= 0 && u > j - 3); u--)
-                {
-                    //found a marked sector
-                    if (marked_tmp[i][u])
+                    //search to the left
+                    for (u = j; (u >= 0 && u > j - 3); u--)
                     {
-                        score += marked_tmp[i][u] > 0 ? 1.0f / u : -1.0f / u;
-                        break;
+                        //found a marked sector
+                        if (marked_tmp[i][u])
+                        {
+                            score += marked_tmp[i][u] > 0 ? 1.0f / u : -1.0f / u;
+                            break;
+                        }
                     }
-                }
 
-                score /= 4.0f;
+                    score /= 4.0f;
 
-                marked[i][j] = score > 0.0f ? 4 : -4;
+                    marked[i][j] = score > 0.0f ? 4 : -4;
+                }
             }
         }
-    }
-}
\ No newline at end of file
+    });
+}
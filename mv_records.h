@@ -0,0 +1,43 @@
+#ifndef MV_RECORDS_H
+#define MV_RECORDS_H
+
+#include <stdint.h>
+
+//fixed-width results of a frame as other programs get them, from the shared memory ring (mv_shmring.h) and
+//the event stream (mv_events.h); native byte order, no padding
+
+//flags of a frame
+#define RESULT_FRAME_GLOBAL_MOTION 1    //labelling and tracking were skipped
+#define RESULT_FRAME_TRUNCATED 2        //more areas or trackers than there was room for
+
+//labelled area of the frame; the label grid of the shared memory ring holds its areaID in every cell it
+//covers, 0 is background. id is the one trackers refer to, areaID only ties the area to its cells
+struct resultArea
+{
+    int32_t id;
+    int32_t areaID;
+    int32_t size;               //cells
+    float centroidX, centroidY;
+    float directionX, directionY;
+    float directionMag, directionAng;
+    int32_t boxLeft, boxTop, boxRight, boxBottom;
+    int32_t tracked;
+};
+
+struct resultTracker
+{
+    int32_t trackerID;
+    int32_t areaID;             //id of the area it follows in this frame
+    int32_t size;
+    int32_t centerX, centerY;
+    int32_t directionX, directionY;
+    int32_t boxLeft, boxTop, boxRight, boxBottom;
+    float iou;
+    int32_t status;
+    int32_t lifeTime;
+    int32_t aliveFor;
+};
+
+static_assert(sizeof(resultArea) == 14 * 4 && sizeof(resultTracker) == 15 * 4, "records are read as they are laid out");
+
+#endif
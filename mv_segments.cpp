@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <chrono>
+
+#include "motion_watch.h"
+
+int64_t MoveDetector::FrameToTimestamp(int64_t frameNumber)
+{
+    AVStream *st = fmt_ctx->streams[video_stream_index];
+    return av_rescale_q(frameNumber, av_inv_q(st->r_frame_rate), st->time_base);
+}
+
+int64_t MoveDetector::TimestampToFrame(int64_t timestamp)
+{
+    AVStream *st = fmt_ctx->streams[video_stream_index];
+    return av_rescale_q(timestamp, st->time_base, av_inv_q(st->r_frame_rate));
+}
+
+//0 without a stream, as in a performance test
+int64_t MoveDetector::StreamTimeUs(int64_t frameNumber)
+{
+    if (!fmt_ctx || fmt_ctx->streams[video_stream_index]->r_frame_rate.num <= 0)
+        return 0;
+    return av_rescale_q(frameNumber, av_inv_q(fmt_ctx->streams[video_stream_index]->r_frame_rate), AV_TIME_BASE_Q);
+}
+
+int64_t MoveDetector::SecondsToFrame(double seconds)
+{
+    AVStream *st = fmt_ctx->streams[video_stream_index];
+    return av_rescale_q(llrint(seconds * AV_TIME_BASE), AVRational{1, AV_TIME_BASE}, av_inv_q(st->r_frame_rate));
+}
+
+//first frame of every segment: the keyframe at or before each n-th of the stream duration
+int MoveDetector::FindSegmentStarts(std::vector<int64_t> &starts)
+{
+    AVStream *st = fmt_ctx->streams[video_stream_index];
+    int64_t firstFrame = st->start_time != AV_NOPTS_VALUE ? TimestampToFrame(st->start_time) : 0;
+    int64_t frames = 0;
+    if (st->duration != AV_NOPTS_VALUE && st->duration > 0)
+        frames = TimestampToFrame(st->duration);
+    else if (fmt_ctx->duration != AV_NOPTS_VALUE && fmt_ctx->duration > 0)
+        frames = av_rescale_q(fmt_ctx->duration, AVRational{1, AV_TIME_BASE}, av_inv_q(st->r_frame_rate));
+
+    //--from/--to: only the selected window is cut
+    if (rangeEnd != INT64_MAX)
+        frames = std::min(frames, rangeEnd - firstFrame);
+    if (rangeStart > firstFrame)
+    {
+        frames -= rangeStart - firstFrame;
+        firstFrame = rangeStart;
+    }
+
+    starts.clear();
+    if (frames <= 0 || st->r_frame_rate.num <= 0)
+        return 0;
+    starts.push_back(firstFrame);
+
+    AVPacket pkt;
+    for (int s = 1; s < segments; s++)
+    {
+        if (av_seek_frame(fmt_ctx, video_stream_index, FrameToTimestamp(firstFrame + frames * s / segments), AVSEEK_FLAG_BACKWARD) < 0)
+            break;
+        while (av_read_frame(fmt_ctx, &pkt) >= 0)
+        {
+            if (pkt.stream_index != video_stream_index)
+            {
+                av_packet_unref(&pkt);
+                continue;
+            }
+            int64_t keyFrame = TimestampToFrame(pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts);
+            //GOPs longer than a segment give the same keyframe twice
+            if (keyFrame > starts.back())
+                starts.push_back(keyFrame);
+            av_packet_unref(&pkt);
+            break;
+        }
+    }
+    av_seek_frame(fmt_ctx, video_stream_index, FrameToTimestamp(firstFrame), AVSEEK_FLAG_BACKWARD);
+    return starts.size();
+}
+
+static int StitchedID(const std::map<int, int> &stitchedIDs, int trackerID)
+{
+    auto found = stitchedIDs.find(trackerID);
+    return found != stitchedIDs.end() ? found->second : trackerID;
+}
+
+//a segment numbers its output frames from zero, shift them to their place in the joined output;
+//trackers that continue one of the segment before take its ID
+static void AppendReport(FILE *from, FILE *to, int outputOffset, const std::map<int, int> &stitchedIDs)
+{
+    char line[4096];
+    int frameNumber, outputFrame, trackerID, length;
+    rewind(from);
+    while (fgets(line, sizeof(line), from))
+    {
+        if (sscanf(line, "motion data for frame %d (output frame %d)", &frameNumber, &outputFrame) == 2)
+            fprintf(to, "motion data for frame %d (output frame %d)\n", frameNumber, outputFrame + outputOffset);
+        else if (sscanf(line, "Tracker ID: %d%n", &trackerID, &length) == 1)
+            fprintf(to, "Tracker ID: %5d%s", StitchedID(stitchedIDs, trackerID), line + length);
+        else
+            fputs(line, to);
+    }
+    fclose(from);
+}
+
+//the mask of a segment as the labelled cells and the trackers of every frame, rendered when the segments
+//are joined. Raw structs, read back by the process that wrote them
+struct labelFrameHeader
+{
+    int pooling;
+    int trackers;
+};
+
+void MoveDetector::WriteLabelFrame(FILE *file)
+{
+    const Grid<int> &labels = areaGridMarked[BUFFER_OLDEST(currFrameBuffer)];
+    labelFrameHeader header = {gridPooling, (int)trackedObjects.size()};
+    fwrite(&header, sizeof(header), 1, file);
+    for (int i = 0; i < nSectorsY; i++)
+        fwrite(labels[i], sizeof(int), nSectorsX, file);
+    for (auto &tracker : trackedObjects)
+    {
+        trackedObject copy = tracker;
+        copy.candidateArea = NULL;
+        fwrite(&copy, sizeof(copy), 1, file);
+    }
+}
+
+//a segment's label frames into the joined mask, in the format of -o
+void MoveDetector::AppendLabelFrames(FILE *from, const std::map<int, int> &stitchedIDs)
+{
+    labelFrameHeader header;
+    Grid<int> labels;
+    list<trackedObject> trackers;
+    rewind(from);
+    while (fread(&header, sizeof(header), 1, from) == 1)
+    {
+        //the governor's pooled levels analyse a coarser grid
+        if (header.pooling != gridPooling)
+        {
+            gridPooling = header.pooling;
+            AllocAnalyzeBuffers();
+        }
+        labels.Resize(nSectorsY, nSectorsX);
+        bool ok = true;
+        for (int i = 0; ok && i < nSectorsY; i++)
+            ok = fread(labels[i], sizeof(int), nSectorsX, from) == (size_t)nSectorsX;
+        trackers.clear();
+        for (int i = 0; ok && i < header.trackers; i++)
+        {
+            trackedObject tracker;
+            ok = fread(&tracker, sizeof(tracker), 1, from) == 1;
+            tracker.trackerID = StitchedID(stitchedIDs, tracker.trackerID);
+            trackers.push_back(tracker);
+        }
+        if (!ok)
+            break;
+        for (int i = 0; i < nSectorsY; i++)
+            for (int j = 0; j < nSectorsX; j++)
+                if (labels[i][j] > 0)
+                    labels[i][j] = StitchedID(stitchedIDs, labels[i][j]);
+
+        if (maskFormat == MASK_FORMAT_GRID)
+            WriteGridFrame(fvideomask_desc, labels, trackers);
+        else
+        {
+            RenderMask(labels, trackers);
+            WriteFrameToFile(fvideomask_desc, maskFrameY, maskFrameU, maskFrameV);
+        }
+    }
+    fclose(from);
+}
+
+void MoveDetector::MainDecSegments(const char *filename)
+{
+    std::vector<int64_t> starts;
+    if (FindSegmentStarts(starts) < 2)
+    {
+        fprintf(stderr, "cannot cut %s into segments, processing it as a whole\n", filename);
+        MainDec();
+        return;
+    }
+    std::vector<int64_t> ends(starts.begin() + 1, starts.end());
+    ends.push_back(rangeEnd);
+    starts[0] = rangeStart;
+
+    std::vector<std::unique_ptr<MoveDetector>> parts;
+    int64_t duration = RunSegments(filename, starts, ends, starts.size(), parts);
+
+    int totalFrames = 0;
+    for (auto &part : parts)
+        totalFrames += part->processedFrames;
+    fprintf(stderr, "Segments: %d; frames processed (including warm-up): %d\n", (int)parts.size(), totalFrames);
+    fprintf(stderr, "Total execution time = %f sec\n", double(duration) / 1000000.0f);
+    fprintf(stderr, "Average FPS: %4.3f\n", (double)totalFrames * 1000000.0f / double(duration));
+    if (movemask_file_flag)
+        PrintMaskHint();
+}
+
+//one detector per frame range [starts[s], ends[s]), up to `threads` of them at a time; their trackers are
+//stitched, then their reports and mask frames joined in stream order. Returns the wall time in microseconds
+int64_t MoveDetector::RunSegments(const char *filename, const std::vector<int64_t> &starts, const std::vector<int64_t> &ends,
+                                  int threads, std::vector<std::unique_ptr<MoveDetector>> &parts)
+{
+    const int count = starts.size();
+
+    //every segment decodes on its own contexts and buffers its report until all are done
+    parts.resize(count);
+    for (int s = 0; s < count; s++)
+    {
+        MoveDetector *part = new MoveDetector();
+        parts[s].reset(part);
+        part->CopySettings(*this);
+        part->segmentIndex = s;
+        part->rangeStart = starts[s];
+        part->rangeEnd = ends[s];
+        part->logFile = tmpfile();
+        if (movemask_file_flag)
+        {
+            part->fvideomask_desc = tmpfile();
+            part->movemask_file_flag = part->fvideomask_desc != NULL;
+        }
+        if (!part->logFile || (movemask_file_flag && !part->movemask_file_flag))
+        {
+            fprintf(stderr, "Error while creating temporary files for segment %d\n", s);
+            exit(0);
+        }
+        if (part->OpenVideoFile(filename) < 0)
+        {
+            fprintf(stderr, "Error while opening orig videostream %s for segment %d\n", filename, s);
+            exit(0);
+        }
+    }
+
+    chrono::high_resolution_clock::time_point start_t = chrono::high_resolution_clock::now();
+    {
+        ThreadPool segmentWorkers(std::max(std::min(threads, count), 1));
+        segmentWorkers.ParallelFor(count, [&](int s) { parts[s]->MainDec(); });
+    }
+    chrono::high_resolution_clock::time_point end_t = chrono::high_resolution_clock::now();
+
+    //the parts' reports are read back
+    Logger::Flush();
+    StitchSegments(parts);
+    if (movemask_file_flag)
+        WriteMaskHeader(fvideomask_desc);
+    int outputOffset = 0;
+    for (int s = 0; s < count; s++)
+    {
+        fprintf(stderr, "==== Segment %d: frames %lld .. %lld ====\n", s, (long long)starts[s],
+                ends[s] != INT64_MAX ? (long long)ends[s] - 1 : -1LL);
+        AppendReport(parts[s]->logFile, stderr, outputOffset, parts[s]->stitchedIDs);
+        outputOffset += parts[s]->reportedFrames;
+        if (movemask_file_flag)
+        {
+            AppendLabelFrames(parts[s]->fvideomask_desc, parts[s]->stitchedIDs);
+            parts[s]->fvideomask_desc = NULL;
+            parts[s]->movemask_file_flag = 0;
+        }
+    }
+    return chrono::duration_cast<chrono::microseconds>(end_t - start_t).count();
+}
+
+//a tracker that is alive at the end of one segment is the one the next segment's warm-up
+//built on the same frames: pair them by box overlap, with the motion pointing the same way.
+//The later one is joined under the ID of the earlier, through any number of segments
+void MoveDetector::StitchSegments(std::vector<std::unique_ptr<MoveDetector>> &parts)
+{
+    int stitched = 0, boundaries = 0;
+    fprintf(stderr, "---- Stitched trackers ---- \n");
+    for (size_t s = 0; s + 1 < parts.size(); s++)
+    {
+        //segments with a gap between them share no frames
+        if (parts[s]->rangeEnd != parts[s + 1]->rangeStart)
+            continue;
+        boundaries++;
+
+        std::vector<const trackedObject *> ending;
+        for (auto &tracker : parts[s]->tailTrackers)
+            ending.push_back(&tracker);
+
+        for (auto &tracker : parts[s + 1]->headTrackers)
+        {
+            float bestIoU = 0.5f;
+            int best = -1;
+            for (size_t i = 0; i < ending.size(); i++)
+            {
+                if (!ending[i])
+                    continue;
+                int dot = ending[i]->direction.x * tracker.direction.x + ending[i]->direction.y * tracker.direction.y;
+                if (dot < 0)
+                    continue;
+                float iou = CalculateIoUofBoxes(ending[i]->boundBoxU, ending[i]->boundBoxB, tracker.boundBoxU, tracker.boundBoxB);
+                if (iou > bestIoU)
+                {
+                    bestIoU = iou;
+                    best = i;
+                }
+            }
+            if (best < 0)
+                continue;
+            const int joinedID = StitchedID(parts[s]->stitchedIDs, ending[best]->trackerID);
+            fprintf(stderr, "Segment %d -> %d: tracker %5d continues tracker %5d  IoU: %4.2f\n",
+                    (int)s, (int)s + 1, tracker.trackerID, joinedID, bestIoU);
+            parts[s + 1]->stitchedIDs[tracker.trackerID] = joinedID;
+            ending[best] = NULL;
+            stitched++;
+        }
+    }
+    fprintf(stderr, "%d trackers stitched across %d segment boundaries\n", stitched, boundaries);
+}
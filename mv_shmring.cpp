@@ -0,0 +1,200 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "mv_shmring.h"
+
+static const size_t shmAlignment = 64;     //cache lines: the writer's stores to one part do not touch another
+
+static size_t AlignUp(size_t size)
+{
+    return (size + shmAlignment - 1) / shmAlignment * shmAlignment;
+}
+
+//shm_open wants a single leading slash
+static void ShmName(const char *name, char *out, size_t size)
+{
+    snprintf(out, size, "/%s", name[0] == '/' ? name + 1 : name);
+}
+
+static const char *SlotAt(const shmRingHeader *ring, uint64_t frame)
+{
+    return (const char *)ring + ring->slotsOffset + frame % ring->slotCount * ring->slotSize;
+}
+
+ShmRingWriter::ShmRingWriter()
+{
+    name[0] = '\0';
+    ring = NULL;
+    mappedSize = 0;
+    current = NULL;
+}
+
+ShmRingWriter::~ShmRingWriter()
+{
+    if (!ring)
+        return;
+    ring->closed.store(1, std::memory_order_release);
+    munmap(ring, mappedSize);
+    shm_unlink(name);
+}
+
+int ShmRingWriter::Create(const char *ringName, int slots, int rows, int cols, int areas, int trackers)
+{
+    ShmName(ringName, name, sizeof(name));
+    const size_t labelsOffset = AlignUp(sizeof(shmFrameHeader));
+    const size_t areasOffset = labelsOffset + AlignUp((size_t)rows * cols * sizeof(int32_t));
+    const size_t trackersOffset = areasOffset + AlignUp((size_t)areas * sizeof(resultArea));
+    const size_t slotSize = trackersOffset + AlignUp((size_t)trackers * sizeof(resultTracker));
+    const size_t slotsOffset = AlignUp(sizeof(shmRingHeader));
+    mappedSize = slotsOffset + (size_t)slots * slotSize;
+
+    //a ring left behind by an earlier writer is replaced, its readers keep the old mapping until they reopen
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, mappedSize) < 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    void *mapping = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return -1;
+    }
+
+    //the mapping comes zeroed; the magic goes in last, readers do not take a ring without it
+    ring = (shmRingHeader *)mapping;
+    ring->version = SHM_RING_VERSION;
+    ring->slotCount = slots;
+    ring->slotSize = slotSize;
+    ring->maxRows = rows;
+    ring->maxCols = cols;
+    ring->maxAreas = areas;
+    ring->maxTrackers = trackers;
+    ring->slotsOffset = slotsOffset;
+    ring->labelsOffset = labelsOffset;
+    ring->areasOffset = areasOffset;
+    ring->trackersOffset = trackersOffset;
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(ring->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+    return 0;
+}
+
+shmFrameHeader *ShmRingWriter::BeginFrame(int32_t **labels, resultArea **areas, resultTracker **trackers)
+{
+    const uint64_t frame = ring->published.load(std::memory_order_relaxed);
+    char *slot = (char *)SlotAt(ring, frame);
+    current = (shmFrameHeader *)slot;
+    current->sequence.store(2 * frame + 1, std::memory_order_relaxed);
+    //readers that see the new data also see the odd sequence
+    std::atomic_thread_fence(std::memory_order_release);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    current->publishTimeUs = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    *labels = (int32_t *)(slot + ring->labelsOffset);
+    *areas = (resultArea *)(slot + ring->areasOffset);
+    *trackers = (resultTracker *)(slot + ring->trackersOffset);
+    return current;
+}
+
+void ShmRingWriter::EndFrame()
+{
+    const uint64_t frame = ring->published.load(std::memory_order_relaxed);
+    current->sequence.store(2 * frame + 2, std::memory_order_release);
+    ring->published.store(frame + 1, std::memory_order_release);
+    current = NULL;
+}
+
+ShmRingReader::ShmRingReader()
+{
+    ring = NULL;
+    mappedSize = 0;
+}
+
+ShmRingReader::~ShmRingReader()
+{
+    Close();
+}
+
+int ShmRingReader::Open(const char *ringName)
+{
+    char name[256];
+    struct stat st;
+    Close();
+    ShmName(ringName, name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(shmRingHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    ring = (const shmRingHeader *)mapping;
+    mappedSize = st.st_size;
+    const bool complete = memcmp(ring->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC)) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!complete || ring->version != SHM_RING_VERSION || ring->slotCount == 0 ||
+        ring->slotsOffset + ring->slotCount * ring->slotSize > mappedSize)
+    {
+        Close();
+        return -1;
+    }
+    return 0;
+}
+
+void ShmRingReader::Close()
+{
+    if (ring)
+        munmap((void *)ring, mappedSize);
+    ring = NULL;
+    mappedSize = 0;
+}
+
+bool ShmRingReader::Latest(shmFrame &frame) const
+{
+    //the newest slot is only rewritten slotCount frames later; a reader that slow tries the next newest
+    for (uint32_t attempt = 0; attempt < ring->slotCount; attempt++)
+    {
+        const uint64_t published = ring->published.load(std::memory_order_acquire);
+        if (published == 0)
+            return false;
+        const char *slot = SlotAt(ring, published - 1);
+        frame.header = (const shmFrameHeader *)slot;
+        frame.sequence = frame.header->sequence.load(std::memory_order_acquire);
+        if (frame.sequence != 2 * published)
+            continue;
+        frame.labels = (const int32_t *)(slot + ring->labelsOffset);
+        frame.areas = (const resultArea *)(slot + ring->areasOffset);
+        frame.trackers = (const resultTracker *)(slot + ring->trackersOffset);
+        return true;
+    }
+    return false;
+}
+
+bool ShmRingReader::Valid(const shmFrame &frame) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return frame.header->sequence.load(std::memory_order_relaxed) == frame.sequence;
+}
+
+bool ShmRingReader::WriterClosed() const
+{
+    return ring->closed.load(std::memory_order_acquire) != 0;
+}
@@ -0,0 +1,106 @@
+#ifndef MV_SHMRING_H
+#define MV_SHMRING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mv_records.h"
+
+//per-frame results in a POSIX shared memory ring (/dev/shm/<name>): one writer, any number of readers that
+//map it read-only. Every slot carries a sequence number, odd while the writer fills it (a seqlock), so a
+//reader takes the newest frame in place and checks afterwards that it was not overwritten meanwhile.
+//This header and mv_shmring.cpp are all a consumer needs, they do not depend on the detector or FFmpeg.
+
+#define SHM_RING_MAGIC "MVSHM1"
+#define SHM_RING_VERSION 2
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring needs lock-free 64 bit atomics");
+
+struct shmRingHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slotCount;
+    uint64_t slotSize;
+    //capacity of every slot
+    uint32_t maxRows, maxCols;
+    uint32_t maxAreas, maxTrackers;
+    //offset of the first slot from the start of the ring, of the parts from the start of a slot
+    uint64_t slotsOffset;
+    uint64_t labelsOffset, areasOffset, trackersOffset;
+    //frames published so far, the newest is in slot (published - 1) % slotCount
+    std::atomic<uint64_t> published;
+    //set when the writer is done; a new writer creates a new ring under the same name
+    std::atomic<uint32_t> closed;
+};
+
+struct shmFrameHeader
+{
+    //2 * n + 1 while frame n is written, 2 * n + 2 once it is complete
+    std::atomic<uint64_t> sequence;
+    int64_t frameNumber;
+    int64_t streamTimeUs;       //position in the stream
+    int64_t publishTimeUs;      //wall clock
+    int32_t rows, cols;         //of the label grid, changes with the pooled governor levels
+    int32_t cellWidth, cellHeight;      //pixels per grid cell
+    int32_t areaCount, trackerCount;
+    int32_t flags;              //RESULT_FRAME_*
+};
+
+//a frame in the ring, valid for as long as ShmRingReader::Valid() says so
+struct shmFrame
+{
+    const shmFrameHeader *header;
+    uint64_t sequence;
+    const int32_t *labels;      //rows x cols, row by row
+    const resultArea *areas;
+    const resultTracker *trackers;
+};
+
+class ShmRingWriter
+{
+  public:
+    ShmRingWriter();
+    //marks the ring closed and removes its name; readers keep their mapping
+    ~ShmRingWriter();
+
+    int Create(const char *name, int slots, int rows, int cols, int areas, int trackers);
+
+    //the slot of the next frame, marked as being written: fill in the header and the parts, then EndFrame()
+    shmFrameHeader *BeginFrame(int32_t **labels, resultArea **areas, resultTracker **trackers);
+    void EndFrame();
+
+    const shmRingHeader *Header() const { return ring; }
+
+  private:
+    char name[256];
+    shmRingHeader *ring;
+    size_t mappedSize;
+    shmFrameHeader *current;
+};
+
+class ShmRingReader
+{
+  public:
+    ShmRingReader();
+    ~ShmRingReader();
+
+    int Open(const char *name);
+    void Close();
+
+    //the newest complete frame, pointing into the ring; false when nothing is published yet
+    bool Latest(shmFrame &frame) const;
+    //true if the frame was not overwritten while it was read: check after using it, drop what was read if not
+    bool Valid(const shmFrame &frame) const;
+    //the writer is gone: Open() again to follow the next one
+    bool WriterClosed() const;
+
+    const shmRingHeader *Header() const { return ring; }
+
+  private:
+    const shmRingHeader *ring;
+    size_t mappedSize;
+};
+
+#endif
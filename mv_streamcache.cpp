@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "motion_watch.h"
+
+static const int64_t cachedProbeSize = 32768;           //bytes, enough for the container header and a keyframe's headers
+static const int64_t cachedAnalyzeDuration = 100000;    //usec; 0 would mean the 5 sec default
+static const int streamCheckPackets = 64;               //packets read for the first frame before the cache is given up
+static const char *streamCacheSuffix = ".streaminfo";
+
+//a camera is its URL, or the directory and extension of its recordings
+static std::string StreamSource(const char *name)
+{
+    if (strstr(name, "://"))
+        return name;
+    char path[PATH_MAX];
+    std::string source = realpath(name, path) ? path : name;
+    size_t slash = source.rfind('/');
+    size_t dot = source.rfind('.');
+    std::string extension = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? source.substr(dot) : "";
+    return (slash == std::string::npos ? std::string(".") : source.substr(0, slash)) + "/*" + extension;
+}
+
+std::string MoveDetector::StreamCacheFile(const char *name)
+{
+    //FNV-1a, the source itself is stored in the file and compared
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : StreamSource(name))
+        hash = (hash ^ (uint8_t)c) * 1099511628211ULL;
+    char file[32];
+    snprintf(file, sizeof(file), "%016llx", (unsigned long long)hash);
+    return streamCache + "/" + file + streamCacheSuffix;
+}
+
+void MoveDetector::CachedProbeOptions(AVDictionary **options)
+{
+    av_dict_set_int(options, "probesize", cachedProbeSize, 0);
+    av_dict_set_int(options, "analyzeduration", cachedAnalyzeDuration, 0);
+}
+
+//text lines "key value"; extradata is hex
+void MoveDetector::SaveStreamParams(const char *name)
+{
+    const std::string cacheName = StreamCacheFile(name);
+    std::string tempName = cacheName + ".XXXXXX";
+    int fd = mkstemp(&tempName[0]);
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file)
+    {
+        fprintf(stderr, "cannot write the stream cache %s: %s\n", cacheName.c_str(), strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    const AVStream *st = fmt_ctx->streams[video_stream_index];
+    const AVCodecParameters *par = st->codecpar;
+    fprintf(file, "source %s\n", StreamSource(name).c_str());
+    fprintf(file, "demuxer %s\n", fmt_ctx->iformat ? fmt_ctx->iformat->name : "");
+    fprintf(file, "codec %d\n", (int)par->codec_id);
+    fprintf(file, "size %d %d\n", par->width, par->height);
+    fprintf(file, "format %d\n", par->format);
+    fprintf(file, "profile %d %d\n", par->profile, par->level);
+    fprintf(file, "frame_rate %d %d\n", st->r_frame_rate.num, st->r_frame_rate.den);
+    fprintf(file, "extradata %d ", par->extradata_size);
+    for (int i = 0; i < par->extradata_size; i++)
+        fprintf(file, "%02x", par->extradata[i]);
+    fprintf(file, "\n");
+
+    //concurrent watch workers may save the same source, the rename keeps one whole file
+    bool failed = fclose(file) != 0;
+    if (failed || rename(tempName.c_str(), cacheName.c_str()) < 0)
+    {
+        fprintf(stderr, "cannot write the stream cache %s: %s\n", cacheName.c_str(), strerror(errno));
+        remove(tempName.c_str());
+    }
+}
+
+bool MoveDetector::LoadStreamParams(const char *name)
+{
+    FILE *file = fopen(StreamCacheFile(name).c_str(), "r");
+    if (!file)
+        return false;
+
+    avcodec_parameters_free(&cachedParams);
+    cachedParams = avcodec_parameters_alloc();
+    cachedParams->codec_type = AVMEDIA_TYPE_VIDEO;
+    cachedFrameRate = AVRational{0, 1};
+    cachedDemuxer.clear();
+
+    const std::string source = StreamSource(name);
+    bool sourceMatches = false, complete = false;
+    std::vector<char> line(64 * 1024);
+    while (fgets(line.data(), line.size(), file))
+    {
+        char *value = strchr(line.data(), ' ');
+        if (!value)
+            continue;
+        *value++ = '\0';
+        value[strcspn(value, "\n")] = '\0';
+        std::string key = line.data();
+        int codec;
+
+        if (key == "source")
+            sourceMatches = source == value;
+        else if (key == "demuxer")
+            cachedDemuxer = value;
+        else if (key == "codec" && sscanf(value, "%d", &codec) == 1)
+            cachedParams->codec_id = (AVCodecID)codec;
+        else if (key == "size")
+            sscanf(value, "%d %d", &cachedParams->width, &cachedParams->height);
+        else if (key == "format")
+            sscanf(value, "%d", &cachedParams->format);
+        else if (key == "profile")
+            sscanf(value, "%d %d", &cachedParams->profile, &cachedParams->level);
+        else if (key == "frame_rate")
+            sscanf(value, "%d %d", &cachedFrameRate.num, &cachedFrameRate.den);
+        else if (key == "extradata")
+        {
+            int size = 0, offset = 0;
+            if (sscanf(value, "%d %n", &size, &offset) < 1 || size < 0 || (int)strlen(value + offset) != 2 * size)
+                break;
+            if (size > 0)
+            {
+                cachedParams->extradata = (uint8_t *)av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+                cachedParams->extradata_size = size;
+                for (int i = 0; i < size; i++)
+                {
+                    unsigned byte;
+                    sscanf(value + offset + 2 * i, "%2x", &byte);
+                    cachedParams->extradata[i] = byte;
+                }
+            }
+            complete = true;
+        }
+    }
+    fclose(file);
+    return sourceMatches && complete && cachedParams->codec_id != AV_CODEC_ID_NONE && cachedParams->width > 0;
+}
+
+//fills in what the short probe left open, the demuxer's own values stay
+void MoveDetector::ApplyStreamParams(AVStream *st)
+{
+    AVCodecParameters *par = st->codecpar;
+    if (par->codec_id != cachedParams->codec_id)
+        return;
+    if (par->width <= 0 || par->height <= 0)
+    {
+        par->width = cachedParams->width;
+        par->height = cachedParams->height;
+    }
+    if (par->format < 0)
+        par->format = cachedParams->format;
+    if (par->profile < 0)
+    {
+        par->profile = cachedParams->profile;
+        par->level = cachedParams->level;
+    }
+    if (!par->extradata_size && cachedParams->extradata_size)
+    {
+        par->extradata = (uint8_t *)av_mallocz(cachedParams->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        memcpy(par->extradata, cachedParams->extradata, cachedParams->extradata_size);
+        par->extradata_size = cachedParams->extradata_size;
+    }
+    if (st->r_frame_rate.num <= 0 && cachedFrameRate.num > 0)
+        st->r_frame_rate = cachedFrameRate;
+}
+
+//the first frame has to agree with the cache; the packets read for it are replayed by ReadPacket
+bool MoveDetector::CheckStreamParams()
+{
+    const char *demuxer = fmt_ctx->iformat ? fmt_ctx->iformat->name : "";
+    if (cachedDemuxer != demuxer || fmt_ctx->streams[video_stream_index]->codecpar->codec_id != cachedParams->codec_id)
+        return false;
+
+    int got_frame = 0;
+    for (int i = 0; i < streamCheckPackets && !got_frame; i++)
+    {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet || av_read_frame(fmt_ctx, packet) < 0)
+        {
+            av_packet_free(&packet);
+            break;
+        }
+        probedPackets.push_back(packet);
+        if (packet->stream_index == video_stream_index && decode(dec_ctx, frame, &got_frame, packet) < 0)
+            break;
+    }
+    bool match = got_frame && frame->width == cachedParams->width && frame->height == cachedParams->height;
+    av_frame_unref(frame);
+    avcodec_flush_buffers(dec_ctx);
+    return match;
+}
+
+int MoveDetector::ReadPacket(AVPacket *packet)
+{
+    if (probedPackets.empty())
+        return av_read_frame(fmt_ctx, packet);
+    AVPacket *next = probedPackets.front();
+    probedPackets.pop_front();
+    av_packet_move_ref(packet, next);
+    av_packet_free(&next);
+    return 0;
+}
+
+void MoveDetector::DropProbedPackets()
+{
+    for (AVPacket *packet : probedPackets)
+        av_packet_free(&packet);
+    probedPackets.clear();
+}
@@ -0,0 +1,87 @@
+#include "mv_threadpool.h"
+
+ThreadPool::ThreadPool(int threads)
+{
+    currentJob = NULL;
+    taskCount = 0;
+    nextTask = 0;
+    pendingTasks = 0;
+    generation = 0;
+    stopping = false;
+
+    //the calling thread takes part in every job
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)> &job)
+{
+    if (count <= 0)
+        return;
+    if (workers.empty() || count == 1)
+    {
+        for (int i = 0; i < count; i++)
+            job(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        currentJob = &job;
+        taskCount = count;
+        nextTask = 0;
+        pendingTasks = count;
+        generation++;
+    }
+    wake.notify_all();
+
+    RunTasks();
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return pendingTasks == 0; });
+    currentJob = NULL;
+}
+
+void ThreadPool::RunTasks()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (currentJob && nextTask < taskCount)
+    {
+        const std::function<void(int)> *job = currentJob;
+        int task = nextTask++;
+        guard.unlock();
+
+        (*job)(task);
+
+        guard.lock();
+        if (--pendingTasks == 0)
+            done.notify_all();
+    }
+}
+
+void ThreadPool::WorkerLoop()
+{
+    unsigned seenGeneration = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || generation != seenGeneration; });
+            if (stopping)
+                return;
+            seenGeneration = generation;
+        }
+        RunTasks();
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef MV_THREADPOOL_H
+#define MV_THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//fixed set of workers running one fork-join job at a time
+class ThreadPool
+{
+  public:
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    //runs job(0) .. job(count - 1) on the workers and the calling thread, returns when all are done
+    void ParallelFor(int count, const std::function<void(int)> &job);
+    int Size() const { return (int)workers.size() + 1; }
+
+  private:
+    void WorkerLoop();
+    void RunTasks();
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const std::function<void(int)> *currentJob;
+    int taskCount;
+    int nextTask;
+    int pendingTasks;
+    unsigned generation;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <chrono>
+
+#include "motion_watch.h"
+
+static const int triageWindow = 30;         //GOPs on either side that make up the running baseline
+static const float triageQuantile = 0.25f;  //baseline: this quantile of the mean inter packet size in the window
+static const float triageRatio = 2.0f;      //GOPs whose inter packets are this much larger than the baseline are active
+static const float triageMinMoving = 0.005f; //fraction of moving MVs that makes a sampled GOP active
+
+//fraction of the MVs of the first inter frame that move further than beta
+float MoveDetector::SampleGopMotion(AVPacket *keyPacket, AVPacket *interPacket)
+{
+    int moving = 0, total = 0;
+
+    avcodec_flush_buffers(dec_ctx);
+    if (avcodec_send_packet(dec_ctx, keyPacket) < 0 || avcodec_send_packet(dec_ctx, interPacket) < 0)
+        return 0.0f;
+    //drain, the decoder may hold the frames back
+    avcodec_send_packet(dec_ctx, NULL);
+    while (avcodec_receive_frame(dec_ctx, frame) >= 0)
+    {
+        if (frame->pict_type == FF_I_TYPE)
+            continue;
+        AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+        if (!sd)
+            continue;
+        const AVMotionVector *mvs = (const AVMotionVector *)sd->data;
+        int mvsCount = sd->size / sizeof(*mvs);
+        for (int i = 0; i < mvsCount; i++)
+        {
+            int dx = mvs[i].src_x - mvs[i].dst_x, dy = mvs[i].src_y - mvs[i].dst_y;
+            if (dx * dx + dy * dy > beta * beta)
+                moving++;
+        }
+        total += mvsCount;
+    }
+    avcodec_flush_buffers(dec_ctx);
+    return total ? (float)moving / total : 0.0f;
+}
+
+//demux pass: frame span and inter packet sizes of every GOP
+void MoveDetector::ScanGops(std::vector<gopInfo> &gops)
+{
+    AVPacket pkt, keyPacket = {}, interPacket = {};
+    bool sampled = true;
+    int64_t lastFrame = -1;
+
+    gops.clear();
+    while (av_read_frame(fmt_ctx, &pkt) >= 0)
+    {
+        if (pkt.stream_index != video_stream_index)
+        {
+            av_packet_unref(&pkt);
+            continue;
+        }
+        const int64_t frameNumber = TimestampToFrame(pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts);
+        lastFrame = std::max(lastFrame, frameNumber);
+
+        if (pkt.flags & AV_PKT_FLAG_KEY)
+        {
+            if (!gops.empty())
+                gops.back().endFrame = frameNumber;
+            gops.push_back({frameNumber, INT64_MAX, 0, 0, 0.0f, false});
+            if (triageSample)
+            {
+                av_packet_unref(&keyPacket);
+                av_packet_ref(&keyPacket, &pkt);
+                sampled = false;
+            }
+        }
+        else if (!gops.empty())
+        {
+            gops.back().interPackets++;
+            gops.back().interBytes += pkt.size;
+            if (!sampled)
+            {
+                av_packet_ref(&interPacket, &pkt);
+                gops.back().movingFraction = SampleGopMotion(&keyPacket, &interPacket);
+                av_packet_unref(&interPacket);
+                sampled = true;
+            }
+        }
+        av_packet_unref(&pkt);
+    }
+    av_packet_unref(&keyPacket);
+    if (!gops.empty())
+        gops.back().endFrame = lastFrame + 1;
+}
+
+void MoveDetector::ClassifyGops(std::vector<gopInfo> &gops)
+{
+    const int count = gops.size();
+    std::vector<float> meanSize(count), window;
+
+    for (int k = 0; k < count; k++)
+        meanSize[k] = gops[k].interPackets ? (float)gops[k].interBytes / gops[k].interPackets : 0.0f;
+
+    for (int k = 0; k < count; k++)
+    {
+        if (!gops[k].interPackets)
+            continue;
+
+        //running baseline: the quiet end of the GOPs around this one, so a long active stretch does not raise it
+        window.clear();
+        for (int u = std::max(k - triageWindow, 0); u <= std::min(k + triageWindow, count - 1); u++)
+            if (gops[u].interPackets)
+                window.push_back(meanSize[u]);
+        std::nth_element(window.begin(), window.begin() + (int)(triageQuantile * (window.size() - 1)), window.end());
+        const float baseline = window[(int)(triageQuantile * (window.size() - 1))];
+
+        gops[k].active = meanSize[k] > triageRatio * baseline;
+        if (triageSample && gops[k].movingFraction > triageMinMoving)
+            gops[k].active = true;
+    }
+}
+
+void MoveDetector::MainDecTriage(const char *filename)
+{
+    chrono::high_resolution_clock::time_point start_t = chrono::high_resolution_clock::now();
+
+    std::vector<gopInfo> gops;
+    ScanGops(gops);
+    if (gops.empty())
+    {
+        fprintf(stderr, "no keyframes found in %s, processing it as a whole\n", filename);
+        av_seek_frame(fmt_ctx, video_stream_index, 0, AVSEEK_FLAG_BACKWARD);
+        MainDec();
+        return;
+    }
+    ClassifyGops(gops);
+
+    chrono::high_resolution_clock::time_point scan_t = chrono::high_resolution_clock::now();
+    int64_t scanDuration = chrono::duration_cast<chrono::microseconds>(scan_t - start_t).count();
+
+    //active GOPs plus one on either side, adjacent ones merged into a single range
+    const int count = gops.size();
+    std::vector<int64_t> starts, ends;
+    int activeGops = 0, analysedGops = 0;
+    int64_t analysedFrames = 0;
+    for (int k = 0; k < count; k++)
+    {
+        if (gops[k].active)
+            activeGops++;
+        bool analyse = gops[k].active || (k > 0 && gops[k - 1].active) || (k + 1 < count && gops[k + 1].active);
+        if (!analyse)
+            continue;
+        analysedGops++;
+        analysedFrames += gops[k].endFrame - gops[k].startFrame;
+        if (!ends.empty() && ends.back() == gops[k].startFrame)
+            ends.back() = gops[k].endFrame;
+        else
+        {
+            starts.push_back(gops[k].startFrame);
+            ends.push_back(gops[k].endFrame);
+        }
+    }
+    if (!ends.empty() && ends.back() == gops.back().endFrame)
+        ends.back() = INT64_MAX;
+    const int64_t totalFrames = gops.back().endFrame - gops.front().startFrame;
+
+    std::vector<std::unique_ptr<MoveDetector>> parts;
+    int64_t analysisDuration = 0;
+    recordDetections = triageCheck;
+    if (!starts.empty())
+        analysisDuration = RunSegments(filename, starts, ends, segments, parts);
+    else if (movemask_file_flag)
+        WriteMaskHeader(fvideomask_desc);
+
+    fprintf(stderr, "Triage: %d of %d GOPs active, %d analysed with the margin in %d ranges; %lld of %lld frames (%4.2f percent) skipped\n",
+            activeGops, count, analysedGops, (int)starts.size(), (long long)(totalFrames - analysedFrames), (long long)totalFrames,
+            (double)(totalFrames - analysedFrames) / totalFrames * 100.0);
+    fprintf(stderr, "Total execution time = %f sec (scan %f sec, analysis %f sec)\n",
+            double(scanDuration + analysisDuration) / 1000000.0f, double(scanDuration) / 1000000.0f, double(analysisDuration) / 1000000.0f);
+
+    if (triageCheck)
+    {
+        //full pass on the same input, its detections are the reference
+        MoveDetector full;
+        full.CopySettings(*this);
+        full.logFile = tmpfile();
+        if (!full.logFile || full.OpenVideoFile(filename) < 0)
+        {
+            fprintf(stderr, "Error while preparing the full pass for %s\n", filename);
+            return;
+        }
+        chrono::high_resolution_clock::time_point full_t = chrono::high_resolution_clock::now();
+        full.MainDec();
+        int64_t fullDuration = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - full_t).count();
+        Logger::Flush();
+        fclose(full.logFile);
+
+        std::vector<int> found;
+        for (auto &part : parts)
+            found.insert(found.end(), part->detectedFrames.begin(), part->detectedFrames.end());
+        std::sort(found.begin(), found.end());
+        int recalled = 0;
+        for (int frameNumber : full.detectedFrames)
+            if (std::binary_search(found.begin(), found.end(), frameNumber))
+                recalled++;
+        fprintf(stderr, "Triage recall: %4.2f percent of the %d frames with detections in a full pass (full pass %f sec)\n",
+                full.detectedFrames.empty() ? 100.0 : (double)recalled / full.detectedFrames.size() * 100.0,
+                (int)full.detectedFrames.size(), double(fullDuration) / 1000000.0f);
+    }
+    if (movemask_file_flag)
+        PrintMaskHint();
+}
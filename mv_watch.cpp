@@ -0,0 +1,165 @@
+#include <chrono>
+#include <deque>
+#include <map>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "motion_watch.h"
+
+//the report is written next to the recording, its own close must not queue it again
+static const char *watchReportSuffix = ".motion.txt";
+
+static volatile sig_atomic_t watchStopping = 0;
+
+static void WatchSignal(int)
+{
+    watchStopping = 1;
+}
+
+static bool EndsWith(const std::string &s, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+//recordings found by the inotify loop, taken by the detector workers
+struct watchQueue
+{
+    std::deque<std::string> files;
+    std::mutex lock;
+    std::condition_variable ready;
+    bool closed;
+};
+
+void MoveDetector::ProcessWatchedFile(const std::string &path)
+{
+    const std::string reportName = path + watchReportSuffix;
+
+    ResetStreamState();
+    if (OpenVideoFile(path.c_str()) < 0)
+    {
+        fprintf(stderr, "watch: cannot open %s, skipped\n", path.c_str());
+        CloseInput();
+        return;
+    }
+    if ((logFile = fopen(reportName.c_str(), "w")) == NULL)
+    {
+        fprintf(stderr, "watch: cannot write %s, %s skipped\n", reportName.c_str(), path.c_str());
+        logFile = stderr;
+        CloseInput();
+        return;
+    }
+
+    chrono::high_resolution_clock::time_point start_t = chrono::high_resolution_clock::now();
+    MainDec();
+    int64_t duration = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start_t).count();
+    Logger::Flush();
+    fclose(logFile);
+    logFile = stderr;
+    fprintf(stderr, "watch: %s: %d frames in %f sec\n", path.c_str(), processedFrames, double(duration) / 1000000.0f);
+}
+
+void MoveDetector::MainWatch()
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(stderr, "cannot initialise inotify: %s\n", strerror(errno));
+        return;
+    }
+    std::map<int, std::string> watched;
+    for (auto &dir : watchDirs)
+    {
+        //a recording is complete once the writer closes it or it is moved in whole
+        int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+        {
+            fprintf(stderr, "cannot watch %s: %s\n", dir.c_str(), strerror(errno));
+            close(fd);
+            return;
+        }
+        watched[wd] = dir;
+    }
+
+    //no SA_RESTART: the signal has to interrupt the blocking read
+    struct sigaction action = {};
+    action.sa_handler = WatchSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    //every worker keeps its detector, with its buffers and grid threads, for all the files it takes
+    watchQueue queue;
+    queue.closed = false;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < watchWorkers; i++)
+    {
+        threads.emplace_back([this, &queue]() {
+            std::unique_ptr<MoveDetector> detector(new MoveDetector());
+            detector->CopySettings(*this);
+            while (true)
+            {
+                std::string path;
+                {
+                    std::unique_lock<std::mutex> guard(queue.lock);
+                    queue.ready.wait(guard, [&] { return queue.closed || !queue.files.empty(); });
+                    if (queue.files.empty())
+                        return;
+                    path = queue.files.front();
+                    queue.files.pop_front();
+                }
+                detector->ProcessWatchedFile(path);
+            }
+        });
+    }
+    fprintf(stderr, "watching %d directories with %d workers, reports are written to <recording>%s\n",
+            (int)watchDirs.size(), watchWorkers, watchReportSuffix);
+
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!watchStopping)
+    {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "inotify read failed: %s\n", strerror(errno));
+            break;
+        }
+        for (char *p = buffer; p < buffer + length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+                fprintf(stderr, "watch: inotify queue overflow, some recordings were missed\n");
+            if (!event->len || (event->mask & IN_ISDIR))
+                continue;
+
+            //hidden names are usually partial copies
+            std::string name = event->name;
+            if (name[0] == '.' || EndsWith(name, watchReportSuffix))
+                continue;
+            {
+                std::lock_guard<std::mutex> guard(queue.lock);
+                queue.files.push_back(watched[event->wd] + "/" + name);
+            }
+            queue.ready.notify_one();
+        }
+    }
+
+    //files being processed are finished, the ones still queued are dropped
+    int dropped;
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        dropped = queue.files.size();
+        queue.files.clear();
+        queue.closed = true;
+    }
+    queue.ready.notify_all();
+    for (auto &thread : threads)
+        thread.join();
+    close(fd);
+    fprintf(stderr, "watch stopped, %d queued recordings dropped\n", dropped);
+}